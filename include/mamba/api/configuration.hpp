@@ -90,6 +90,46 @@ namespace YAML
         }
     };
 
+    template <>
+    struct convert<mamba::DownloadOrder>
+    {
+        static Node encode(const mamba::DownloadOrder& rhs)
+        {
+            return Node(mamba::download_order_str(rhs));
+        }
+
+        static bool decode(const Node& node, mamba::DownloadOrder& rhs)
+        {
+            if (!node.IsScalar())
+            {
+                return false;
+            }
+
+            auto str = node.as<std::string>();
+
+            if (str == "fifo")
+            {
+                rhs = mamba::DownloadOrder::kFifo;
+            }
+            else if (str == "largest_first")
+            {
+                rhs = mamba::DownloadOrder::kLargestFirst;
+            }
+            else if (str == "critical_path")
+            {
+                rhs = mamba::DownloadOrder::kCriticalPath;
+            }
+            else
+            {
+                throw std::runtime_error(
+                    "Invalid 'DownloadOrder', should be in {'fifo', 'largest_first', "
+                    "'critical_path'}");
+            }
+
+            return true;
+        }
+    };
+
     template <>
     struct convert<mamba::ChannelPriority>
     {
@@ -327,6 +367,26 @@ namespace mamba
             std::string m_value = "";
         };
 
+        template <>
+        struct cli_config<DownloadOrder>
+        {
+            using storage_type = std::string;
+
+            cli_config(const std::string& value)
+                : m_value(value){};
+
+            bool defined()
+            {
+                return !m_value.empty();
+            };
+            DownloadOrder value()
+            {
+                return YAML::Node(m_value).as<DownloadOrder>();
+            };
+
+            std::string m_value = "";
+        };
+
         template <>
         struct cli_config<ChannelPriority>
         {
@@ -41,6 +41,28 @@ namespace mamba
 
         MRepo create_repo_from_pkgs_dir(MPool& pool, const fs::path& pkgs_dir);
 
+        // whether the installed packages match the specs, and the pins of the
+        // installed names, so that installing the specs would do nothing
+        bool specs_already_installed(const PrefixData& prefix_data,
+                                     const std::vector<std::string>& specs,
+                                     const std::vector<std::string>& pins);
+
+        // a way of solving the request, the portfolio solves the others
+        // with the configured one
+        struct SolveStrategy
+        {
+            std::string name;
+            bool strict_priority;
+            bool freeze_installed;
+            bool allow_uninstall;
+        };
+
+        // the strategies of the solve_portfolio names, in order, that differ
+        // from the configured solve and from each other
+        std::vector<SolveStrategy> portfolio_strategies(const std::vector<std::string>& names,
+                                                        bool strict_priority,
+                                                        bool freeze_installed);
+
         bool download_explicit(const std::vector<PackageInfo>& pkgs);
 
         struct yaml_file_contents
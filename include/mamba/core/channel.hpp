@@ -71,6 +71,12 @@ namespace mamba
     // public
     std::vector<const Channel*> get_channels(const std::vector<std::string>& channel_names);
 
+    // public
+    // The url of the same file on every mirror of its channel ('mirrored_channels'),
+    // starting with url itself. Empty if the channel has no mirrors. The token and
+    // user:password of url stay with its host, a mirror only gets its own ones.
+    std::vector<std::string> get_mirror_urls(const std::string& url);
+
     // XXX unused, but should be in python API according to docs
     void check_whitelist(const std::vector<std::string>& urls);
 }  // namespace mamba
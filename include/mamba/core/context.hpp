@@ -87,6 +87,17 @@ namespace mamba
     };
 
 
+    // order in which the packages of a transaction are downloaded
+    enum class DownloadOrder
+    {
+        kFifo,
+        kLargestFirst,
+        kCriticalPath
+    };
+
+    std::string download_order_str(DownloadOrder order);
+
+
     std::string env_name(const fs::path& prefix);
     fs::path locate_prefix_by_name(const std::string& name);
 
@@ -112,7 +123,20 @@ namespace mamba
         std::vector<fs::path> pkgs_dirs = { root_prefix / "pkgs" };
 
         bool use_index_cache = false;
+        // read-only index caches of other users, tried before downloading
+        std::vector<fs::path> shared_index_caches;
         std::size_t local_repodata_ttl = 1;  // take from header
+        // seconds past the ttl during which the cached repodata is used, and
+        // revalidated in the background. Per channel name in the map.
+        std::size_t repodata_max_stale = 0;
+        std::map<std::string, std::size_t> channel_repodata_max_stale;
+        // update stale repodata with the patches of repodata.jlap when available
+        bool repodata_use_patches = false;
+        // download repodata.json.zst instead of repodata.json when the channel has it
+        bool repodata_use_zst = true;
+        // only fetch the shards of the packages a request can reach, when the
+        // channel publishes repodata_shards.json
+        bool repodata_use_shards = false;
         bool offline = false;
         bool quiet = false;
         bool json = false;
@@ -120,6 +144,14 @@ namespace mamba
         bool auto_activate_base = false;
 
         long max_parallel_downloads = 5;
+        // multiplex transfers over HTTP/2 when libcurl supports it,
+        // otherwise (or when false) use HTTP/1.1
+        bool use_http2 = true;
+        DownloadOrder download_order = DownloadOrder::kLargestFirst;
+        // files of at least that size (in bytes, 0 to disable) are fetched
+        // in 'download_segments' ranges in parallel
+        std::size_t segmented_download_threshold = 0;
+        int download_segments = 4;
         int verbosity = 0;
 
         bool dev = false;
@@ -137,6 +169,8 @@ namespace mamba
 
         VerificationLevel safety_checks = VerificationLevel::kWarn;
         bool extra_safety_checks = false;
+        // decompress packages into a staging directory while they download
+        bool extract_while_downloading = false;
         bool verify_artifacts = false;
 
         // debug helpers
@@ -151,6 +185,8 @@ namespace mamba
         int retry_timeout = 2;  // seconds
         int retry_backoff = 3;  // retry_timeout * retry_backoff
         int max_retries = 3;    // max number of retries
+        // the longest Retry-After waited for, longer ones are shortened to it
+        int max_retry_after = 60;  // seconds
 
         std::string env_prompt = "({default_env}) ";
 
@@ -174,6 +210,9 @@ namespace mamba
 
         std::vector<std::string> channels;
         std::map<std::string, std::string> custom_channels;
+        // channel name -> base urls of its mirrors
+        std::map<std::string, std::vector<std::string>> mirrored_channels;
+        bool mirror_racing = false;
 
         std::vector<std::string> default_channels = {
 #ifdef _WIN32
@@ -192,8 +231,20 @@ namespace mamba
 
         std::vector<std::string> pinned_packages = {};
         bool freeze_installed = false;
+        // replay the result of an identical earlier solve, see MSolver::set_solve_cache
+        bool use_solve_cache = false;
+        // leave the solvables the request cannot reach out of the solve
+        bool prune_pool = false;
+        // fallback solve strategies when the configured one fails, by preference
+        std::vector<std::string> solve_portfolio;
 
         bool use_only_tar_bz2 = false;
+        // filters applied to the repodata records when they are loaded
+        std::size_t repodata_keep_versions = 0;  // newest versions per name, 0 for all
+        std::size_t repodata_keep_builds = 0;    // newest build numbers per version, 0 for all
+        std::vector<std::string> repodata_exclude_builds;    // regexes of build strings
+        std::vector<std::string> repodata_exclude_licenses;  // regexes of licenses
+        std::vector<std::string> repodata_drop_fields;       // not written to .solv files
 
         static Context& instance();
 
@@ -13,16 +13,114 @@ extern "C"
 #include <curl/curl.h>
 }
 
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "nlohmann/json.hpp"
 #include "output.hpp"
 #include "validate.hpp"
 
+// from zstd, only used through a pointer
+struct ZSTD_DCtx_s;
+
+// appended to the name of a partially downloaded file to store what
+// is needed to resume its download
+#define MAMBA_RESUME_STATE_SUFFIX ".resume.json"
+// appended to the name of a file downloaded in segments, for the ranges
+// that are already on disk
+#define MAMBA_SEGMENTS_STATE_SUFFIX ".segments.json"
+// with HTTP/2, how many transfers to a host can share a connection at most,
+// on average, when adapting the number of transfers to that host
+#define MAMBA_HTTP2_STREAMS_PER_CONNECTION 4
+
 namespace mamba
 {
     void init_curl_ssl();
+    bool use_http2();
+
+    /**
+     * Process-wide state shared by all the transfers of a command:
+     * DNS cache, TLS sessions and connection cache. Repodata and
+     * package downloads, as well as retries, reuse warm connections
+     * instead of doing new lookups and TLS handshakes.
+     *
+     * libcurl does not support using a shared connection cache from
+     * concurrent threads: transfers that run next to the ones of the main
+     * thread use the share handle without it, and only share the DNS cache
+     * and TLS sessions.
+     */
+    class DownloadSession
+    {
+    public:
+        static DownloadSession& instance();
+
+        DownloadSession(const DownloadSession&) = delete;
+        DownloadSession& operator=(const DownloadSession&) = delete;
+        DownloadSession(DownloadSession&&) = delete;
+        DownloadSession& operator=(DownloadSession&&) = delete;
+
+        CURLSH* share_handle(bool share_connections = true);
+
+    private:
+        DownloadSession();
+        ~DownloadSession();
+
+        static void lock_callback(CURL*, curl_lock_data data, curl_lock_access, void* self);
+        static void unlock_callback(CURL*, curl_lock_data data, void* self);
+
+        CURLSH* m_share;
+        CURLSH* m_share_no_connections;
+        std::array<std::mutex, CURL_LOCK_DATA_LAST> m_mutexes;
+    };
+
+    /**
+     * Latency and failures of the hosts serving channel mirrors, used to
+     * pick a mirror. Kept in 'cache/mirrors.json' of the first package
+     * cache between runs.
+     */
+    class MirrorHealth
+    {
+    public:
+        static MirrorHealth& instance();
+
+        MirrorHealth(const MirrorHealth&) = delete;
+        MirrorHealth& operator=(const MirrorHealth&) = delete;
+        MirrorHealth(MirrorHealth&&) = delete;
+        MirrorHealth& operator=(MirrorHealth&&) = delete;
+
+        // latency is the time to the first byte of the response, in seconds
+        void record_success(const std::string& host, double latency);
+        void record_failure(const std::string& host);
+        // healthy hosts first, by increasing latency; unknown hosts count as
+        // healthy and fast so that they get measured
+        std::vector<std::string> rank(const std::vector<std::string>& urls);
+        void save();
+
+    private:
+        MirrorHealth();
+
+        struct host_health
+        {
+            double latency = 0;
+            std::size_t failures = 0;
+            std::time_t last_failure = 0;
+        };
+
+        std::map<std::string, host_health> m_hosts;
+        fs::path m_path;
+        bool m_dirty = false;
+        std::mutex m_mutex;
+    };
 
     class DownloadTarget
     {
@@ -41,8 +139,54 @@ namespace mamba
         void set_mod_etag_headers(const nlohmann::json& mod_etag);
         void set_progress_bar(ProgressProxy progress_proxy);
         void set_expected_size(std::size_t size);
+        // keep partial data on failure and continue from it with a range
+        // request, on retry or in a later process
+        void set_resumable(bool yes);
+        // hash the data while it is written, results end up in sha256sum / md5sum
+        void compute_checksums(bool sha256, bool md5);
+        // the response is zstd compressed, decompress it into the file as it
+        // arrives. Hashes and sizes are those of the decompressed data.
+        void set_zstd_decompression(bool yes);
+        // called on the transfer thread with the number of bytes of the file that
+        // are on disk, as it grows and once more when the transfer succeeded.
+        // If that data gets discarded (the download restarts from scratch) it
+        // is called with 0 and the reporting starts over.
+        void set_write_observer(std::function<void(std::size_t)> observer);
+        // targets with a higher priority are started first by MultiDownloadTarget
+        void set_priority(std::size_t priority);
+        std::size_t priority() const;
+        // urls of the same file on other mirrors: the transfer uses the preferred
+        // one and fails over to the others
+        void set_mirrors(const std::vector<std::string>& urls);
+        // switch to the preferred mirror that did not fail for this target yet
+        void select_mirror();
+        // also request the file from a second mirror and keep the first
+        // response, for small files
+        void set_race_mirrors(bool yes);
+        // the target of that second request, or nullptr if there is no mirror
+        // to race against. It lives until end_race().
+        DownloadTarget* start_race();
+        // drop the second request, or take over its response and file
+        void end_race(bool adopt_racer);
+        DownloadTarget* racer() const;
+        DownloadTarget* race_primary() const;
+        // split a large file into ranges downloaded in parallel into the file,
+        // preallocated, continuing a previous attempt if there was one. Returns
+        // the targets of the segments left to download, or nothing if the file
+        // is too small or the download cannot be split.
+        std::vector<DownloadTarget*> split();
+        DownloadTarget* segment_parent() const;
+        // the transfer needs a connection of its own, it is not multiplexed
+        bool own_connection() const;
+        // called when a segment is done, returns true once they all are
+        bool segment_finished();
+        // from the finalize callback, when the response is of no use: download
+        // another url instead, the target is retried right away
+        void fall_back_to(const std::string& url);
 
         const std::string& name() const;
+        // host[:port] of the url, transfers are throttled per host
+        const std::string& host() const;
 
         void init_curl_target(const std::string& url);
 
@@ -73,8 +217,12 @@ namespace mamba
 
         bool can_retry();
         CURL* retry();
+        std::chrono::steady_clock::time_point next_retry() const;
+        // delay requested by the last response with a Retry-After header, 0 if
+        // none, at most max_retry_after
+        std::size_t retry_after() const;
 
-        CURLcode result;
+        CURLcode result = CURLE_OK;
         bool failed = false;
         int http_status = 10000;
         curl_off_t downloaded_size = 0;
@@ -82,11 +230,12 @@ namespace mamba
         std::string final_url;
 
         std::string etag, mod, cache_control;
+        std::string sha256sum, md5sum;
 
     private:
         std::function<bool()> m_finalize_callback;
 
-        std::string m_name, m_filename, m_url;
+        std::string m_name, m_filename, m_url, m_host;
 
         // validation
         std::size_t m_expected_size = 0;
@@ -97,9 +246,18 @@ namespace mamba
         std::chrono::steady_clock::time_point m_next_retry;
         std::size_t m_retry_wait_seconds = Context::instance().retry_timeout;
         std::size_t m_retries = 0;
+        std::size_t m_retry_after = 0;
+        bool m_fall_back = false;
+
+        // resume
+        bool m_resumable = false;
+        curl_off_t m_resume_from = 0;
+        std::string m_resume_etag, m_resume_mod;
+        // the url that sent the validators, mirrors have their own
+        std::string m_resume_url;
 
         CURL* m_handle;
-        curl_slist* m_headers;
+        curl_slist* m_headers = nullptr;
 
         bool m_has_progress_bar = false;
         bool m_ignore_failure = false;
@@ -107,15 +265,94 @@ namespace mamba
         ProgressProxy m_progress_bar;
 
         char m_errbuf[CURL_ERROR_SIZE];
-        std::ofstream m_file;
+        std::FILE* m_file = nullptr;
+        std::unique_ptr<char[]> m_file_buffer;
+        std::unique_ptr<validate::Hasher> m_sha256_hasher, m_md5_hasher;
+        std::function<void(std::size_t)> m_write_observer;
+        std::size_t m_file_size = 0;
+        std::size_t m_reported_size = 0;
+
+        // streaming decompression of the response, if it is compressed
+        ::ZSTD_DCtx_s* m_zstd_stream = nullptr;
+        std::unique_ptr<char[]> m_zstd_buffer;
+        bool m_decompressing = false;
+        // 0 once a whole frame was decompressed
+        std::size_t m_zstd_pending = 0;
+
+        std::size_t m_priority = 0;
+
+        // mirrors, the first one is the url the target was created with
+        std::vector<std::string> m_mirrors;
+        std::vector<std::string> m_failed_mirrors;
+        bool m_race_mirrors = false;
+        nlohmann::json m_mod_etag;
+        std::unique_ptr<DownloadTarget> m_racer;
+        DownloadTarget* m_race_primary = nullptr;
+
+        // segmented download
+        std::vector<std::unique_ptr<DownloadTarget>> m_segments;
+        std::size_t m_segments_finished = 0;
+        bool m_split_done = false;
+        bool m_segments_failed = false;
+        DownloadTarget* m_segment_parent = nullptr;
+        // inclusive range of the file
+        std::size_t m_segment_begin = 0;
+        std::size_t m_segment_end = 0;
+        // the start of the file that is hashed and reported to the observer
+        std::size_t m_prefix_size = 0;
+        std::chrono::steady_clock::time_point m_segments_state_time;
 
         static void init_curl_handle(CURL* handle, const std::string& url);
+        const std::string& origin_url() const;
+        bool has_untried_mirror() const;
+        void record_mirror_result(bool success);
+        fs::path segments_state_path() const;
+        void write_segments_state();
+        bool open_segment_file(long status);
+        void segment_written(DownloadTarget* segment,
+                             std::size_t offset,
+                             const char* data,
+                             std::size_t size);
+        void hash_prefix(const char* data, std::size_t size);
+        void advance_prefix();
+        void update_segment_progress();
+        bool finalize_segments();
+        void schedule_next_retry();
+        fs::path resume_state_path() const;
+        bool can_resume_from(std::size_t size) const;
+        void set_resume_options();
+        void write_resume_state();
+        bool open_file(bool append);
+        bool close_file();
+        bool write_data(const char* data, std::size_t size);
+        bool write_decompressed(const char* data, std::size_t size);
     };
 
+    /**
+     * Runs a set of transfers. Pending targets are queued per host, with
+     * their mirror picked and their segments split when they are added.
+     * They are started by decreasing priority, then in the order they were
+     * added, as soon as their host has room for one more transfer.
+     *
+     * Each host starts with max_parallel_downloads concurrent transfers,
+     * which also caps the connections overall. The limit is halved when
+     * the server throttles (429/503), whose Retry-After also holds back
+     * new transfers to that host, and grows by one while that improves the
+     * throughput: up to max_parallel_downloads with HTTP/1.1, and up to
+     * MAMBA_HTTP2_STREAMS_PER_CONNECTION times that with HTTP/2, whose
+     * transfers are multiplexed on the connections.
+     *
+     * Large files are split into segments (see DownloadTarget::split) that
+     * are queued and limited like any other transfer. Each segment uses a
+     * connection of its own, the connections of all the transfers are kept
+     * within max_parallel_downloads.
+     */
     class MultiDownloadTarget
     {
     public:
-        MultiDownloadTarget();
+        // share_connections is false for transfers run on a thread of their
+        // own while other transfers run, see DownloadSession
+        explicit MultiDownloadTarget(bool share_connections = true);
         ~MultiDownloadTarget();
 
         void add(DownloadTarget* target);
@@ -123,9 +360,77 @@ namespace mamba
         bool download(bool failfast);
 
     private:
+        using retry_entry = std::pair<std::chrono::steady_clock::time_point, DownloadTarget*>;
+        using retry_queue = std::priority_queue<retry_entry,
+                                                std::vector<retry_entry>,
+                                                std::greater<retry_entry>>;
+
+        struct pending_target
+        {
+            // retries go first, then by decreasing priority, then in order
+            bool retry;
+            std::size_t priority;
+            long long order;
+            DownloadTarget* target;
+
+            bool operator<(const pending_target& other) const;
+        };
+
+        struct host_state
+        {
+            double limit = 1;
+            std::vector<DownloadTarget*> running;
+            // running transfers that are not multiplexed
+            std::size_t own_connections = 0;
+            std::deque<pending_target> pending;
+            // since the last adaptation: some transfers waited for room,
+            // the server throttled us
+            bool saturated = false;
+            bool throttled = false;
+            curl_off_t finished_bytes = 0;
+            curl_off_t sampled_bytes = 0;
+            double rate = 0;  // bytes/s
+            std::chrono::steady_clock::time_point blocked_until;
+        };
+
+        host_state& host_of(DownloadTarget* target);
+        void queue(DownloadTarget* target, bool retry);
+        // connections the transfers use, counted against max_parallel_downloads
+        std::size_t connections() const;
+        void throttle(DownloadTarget* target);
+        void adapt_concurrency();
+
+        void start_transfer(DownloadTarget* target);
+        void finish_transfer(DownloadTarget* target);
+        bool is_running(DownloadTarget* target);
+        DownloadTarget* settle_race(DownloadTarget* finished, CURLcode& result);
+        void start_pending();
+        void schedule_retry(DownloadTarget* target);
+        void start_due_retries();
+        int wait_for_activity(long max_wait_msecs);
+
+        static int socket_callback(CURL*, curl_socket_t s, int what, void* self, void*);
+        static int timer_callback(CURLM*, long timeout_ms, void* self);
+
         std::vector<DownloadTarget*> m_targets;
-        std::vector<DownloadTarget*> m_retry_targets;
+        std::map<std::string, host_state> m_hosts;
+        std::size_t m_pending_count = 0;
+        // order of the queued targets, retries count down
+        long long m_queued = 0;
+        long long m_requeued = 0;
+        std::chrono::steady_clock::time_point m_last_adaptation;
+        // min-heap on the time at which the target can be retried
+        retry_queue m_retry_targets;
         CURLM* m_handle;
+        CURLSH* m_share;
+
+        // deadline requested by curl through the timer callback, or
+        // time_point::max() if there is no pending timeout
+        std::chrono::steady_clock::time_point m_timeout;
+        int m_running = 0;
+#ifdef __linux__
+        int m_epoll_fd = -1;
+#endif
     };
 
 }  // namespace mamba
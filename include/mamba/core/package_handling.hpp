@@ -7,11 +7,20 @@
 #ifndef MAMBA_CORE_PACKAGE_HANDLING_HPP
 #define MAMBA_CORE_PACKAGE_HANDLING_HPP
 
+extern "C"
+{
+#include <archive.h>
+}
+
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
 #include <string>
 #include <system_error>
 #include <vector>
 
 #include "mamba_fs.hpp"
+#include "thread_utils.hpp"
 
 namespace mamba
 {
@@ -35,6 +44,53 @@ namespace mamba
     fs::path extract(const fs::path& file);
     bool transmute(const fs::path& pkg_file, const fs::path& target, int compression_level);
     bool validate(const fs::path& pkg_folder);
+
+    /**
+     * Extracts a .tar.bz2 or .conda package while the file is still being
+     * written (downloaded). The writer reports how much of the file is on
+     * disk, the extraction runs on its own thread and waits for more data
+     * when it catches up.
+     */
+    class StreamingExtractor
+    {
+    public:
+        StreamingExtractor(const fs::path& file, const fs::path& destination);
+        ~StreamingExtractor();
+
+        StreamingExtractor(const StreamingExtractor&) = delete;
+        StreamingExtractor& operator=(const StreamingExtractor&) = delete;
+        StreamingExtractor(StreamingExtractor&&) = delete;
+        StreamingExtractor& operator=(StreamingExtractor&&) = delete;
+
+        // the first `size` bytes of the file can be read
+        void set_available(std::size_t size);
+        // no more data will come, abandon the extraction if not `complete`
+        void finish(bool complete);
+        // waits for the extraction thread, returns whether it succeeded
+        bool wait();
+
+        const std::string& error() const;
+
+    private:
+        void run();
+        void extract_conda_stream(archive* a);
+        static la_ssize_t read_callback(archive* a, void* self, const void** buffer);
+
+        fs::path m_file, m_destination;
+        std::FILE* m_input = nullptr;
+        std::vector<char> m_buffer;
+        std::size_t m_read = 0;
+
+        std::size_t m_available = 0;
+        bool m_finished = false;
+        bool m_cancelled = false;
+        std::mutex m_mutex;
+        std::condition_variable m_data_cv;
+
+        bool m_success = false;
+        std::string m_error;
+        thread m_thread;
+    };
 }  // namespace mamba
 
 #endif  // MAMBA_PACKAGE_HANDLING_HPP
@@ -7,10 +7,17 @@
 #ifndef MAMBA_CORE_REPO_HPP
 #define MAMBA_CORE_REPO_HPP
 
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
 #include <string>
 #include <tuple>
+#include <utility>
+#include <vector>
 
 #include "prefix_data.hpp"
+#include "thread_utils.hpp"
 
 extern "C"
 {
@@ -24,6 +31,50 @@ extern "C"
 
 namespace mamba
 {
+    // version of mamba and libsolv that wrote a .solv file
+    const char* mamba_tool_version();
+
+    // identifies the repodata filters of the context, empty without filters
+    std::string repodata_filters_key();
+
+    // writes the repo in .solv format, without the repodata_drop_fields
+    int write_solv(Repo* repo, std::FILE* fp);
+    // the same in memory, false when the repo could not be written
+    bool write_solv(Repo* repo, std::string& data);
+
+    /**
+     * Writes .solv files on a background thread, so that the solver does not
+     * wait for the disk. The repos are serialized by the caller as the pool
+     * is not thread safe. Each file is written to a temporary file of its
+     * directory that is then renamed over it, and the files of a path are
+     * written in the order they are queued. The destructor, at the latest at
+     * exit, waits for the queued files.
+     */
+    class SolvWriter
+    {
+    public:
+        static SolvWriter& instance();
+
+        ~SolvWriter();
+
+        SolvWriter(const SolvWriter&) = delete;
+        SolvWriter& operator=(const SolvWriter&) = delete;
+
+        void write(const fs::path& path, std::string data);
+        // waits until all the queued files are written
+        void wait();
+
+    private:
+        SolvWriter() = default;
+        void run();
+
+        std::mutex m_mutex;
+        std::condition_variable m_idle;
+        std::deque<std::pair<fs::path, std::string>> m_queue;
+        bool m_running = false;
+        thread m_thread;
+    };
+
     /**
      * Represents a channel subdirectory
      * index.
@@ -31,13 +82,19 @@ namespace mamba
     struct RepoMetadata
     {
         std::string url;
-        bool pip_added;
+        bool pip_added = false;
         std::string etag;
         std::string mod;
+        // of the repodata file, when known it identifies the repo on its own
+        std::string sha256 = "";
     };
 
     inline bool operator==(const RepoMetadata& lhs, const RepoMetadata& rhs)
     {
+        if (!lhs.sha256.empty() && !rhs.sha256.empty())
+        {
+            return lhs.sha256 == rhs.sha256 && lhs.pip_added == rhs.pip_added;
+        }
         return lhs.url == rhs.url && lhs.pip_added == rhs.pip_added && lhs.etag == rhs.etag
                && lhs.mod == rhs.mod;
     }
@@ -82,6 +139,42 @@ namespace mamba
               const fs::path& filename,
               const RepoMetadata& meta);
 
+        /**
+         * Constructor.
+         * @param pool ``libsolv`` pool wrapper
+         * @param name Name of the subdirectory (<channel>/<subdir>)
+         * @param json_file Path to the JSON index file
+         * @param solv_files .solv caches to load from, the first one of the repo is used
+         * @param solv_cache Where to write the .solv cache when none of them is
+         * @param meta Metadata of the repo
+         */
+        MRepo(MPool& pool,
+              const std::string& name,
+              const std::string& json_file,
+              const std::vector<std::string>& solv_files,
+              const std::string& solv_cache,
+              const RepoMetadata& meta);
+
+        /**
+         * Constructor.
+         * @param pool ``libsolv`` pool wrapper
+         * @param solv_file File positioned at the repo in .solv format
+         * @param meta Metadata of the repo
+         */
+        MRepo(MPool& pool, std::FILE* solv_file, const RepoMetadata& meta);
+
+        /**
+         * Constructor.
+         * @param pool ``libsolv`` pool wrapper
+         * @param name Name of the repo
+         * @param solv_file File positioned at the repo in .solv format
+         * @param meta Metadata of the repo
+         */
+        MRepo(MPool& pool,
+              const std::string& name,
+              std::FILE* solv_file,
+              const RepoMetadata& meta);
+
         ~MRepo();
 
         void set_installed();
@@ -90,8 +183,11 @@ namespace mamba
         const std::string& index_file();
 
         std::string name() const;
+        // queues the .solv cache of the repo to the SolvWriter
         bool write() const;
         const std::string& url() const;
+        // empty url for the repos not made from a channel index
+        const RepoMetadata& metadata() const;
         Repo* repo();
         std::tuple<int, int> priority() const;
         std::size_t size() const;
@@ -100,6 +196,11 @@ namespace mamba
 
     private:
         bool read_file(const std::string& filename);
+        // false if the file is not a .solv of that repo
+        bool read_solv(const std::string& filename);
+        void read_json();
+        // drops the records excluded by the repodata filters of the context
+        void filter_records();
 
         std::string m_json_file, m_solv_file;
         std::string m_url;
@@ -108,6 +209,35 @@ namespace mamba
 
         Repo* m_repo;
     };
+
+    /**
+     * The repos of a pool serialized in memory, to load them in other pools.
+     * A pool is not thread safe, so that each thread solving the same
+     * problem needs a pool of its own.
+     */
+    class PoolCopy
+    {
+    public:
+        // serializes the repos, on the thread of their pool
+        explicit PoolCopy(const std::vector<MRepo*>& repos);
+
+        // adds the repos to the pool in order, with their names, priorities
+        // and the installed one
+        std::vector<MRepo> load(MPool& pool) const;
+
+    private:
+        struct RepoData
+        {
+            std::string name;
+            RepoMetadata metadata;
+            std::string solv;
+            int priority;
+            int subpriority;
+            bool installed;
+        };
+
+        std::vector<RepoData> m_repos;
+    };
 }  // namespace mamba
 
 #endif  // MAMBA_REPO_HPP
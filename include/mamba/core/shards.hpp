@@ -0,0 +1,86 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#ifndef MAMBA_CORE_SHARDS_HPP
+#define MAMBA_CORE_SHARDS_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+#include "mamba_fs.hpp"
+#include "subdirdata.hpp"
+
+namespace mamba
+{
+    /**
+     * Sharded index of a channel subdirectory. Its manifest,
+     * repodata_shards.json, maps each package name to the sha256 of a shard:
+     *
+     * {"info": {...}, "shards_base_url": "shards/", "shards": {<name>: <sha256>}}
+     *
+     * The shard, <shards_base_url><sha256>.json relative to the subdir, holds
+     * the records of that name like a repodata.json ("packages" and
+     * "packages.conda"). Shards never change, they are kept in the 'shards'
+     * directory of the index cache.
+     */
+    class SubdirShards
+    {
+    public:
+        /**
+         * Constructor.
+         * @param name Name of the subdirectory (<channel>/<subdir>)
+         * @param subdir_url URL of the subdirectory
+         * @param cache_dir Index cache
+         */
+        SubdirShards(const std::string& name,
+                     const std::string& subdir_url,
+                     const fs::path& cache_dir,
+                     bool is_noarch);
+
+        // the manifest is downloaded and cached like a repodata.json
+        MSubdirData& manifest();
+        // reads the loaded manifest, false if the channel has none
+        bool read_manifest();
+
+        const std::string& name() const;
+        const std::string& url() const;
+        bool is_noarch() const;
+        // sha256 of the shard of a package, empty if there is none
+        std::string shard_hash(const std::string& package) const;
+        std::string shard_url(const std::string& sha256) const;
+        // where the shard is cached
+        fs::path shard_path(const std::string& sha256) const;
+        // adds the records of the shard to the repodata, returns their dependencies
+        std::vector<std::string> add_shard(const fs::path& shard_fn);
+
+        // the subdir with the records of the shards added so far
+        std::shared_ptr<MSubdirData> subdir_data() const;
+
+    private:
+        std::string m_name;
+        std::string m_subdir_url;
+        fs::path m_cache_dir;
+        bool m_is_noarch;
+        MSubdirData m_manifest;
+        nlohmann::json m_shards;
+        std::string m_shards_base_url;
+        nlohmann::json m_repodata;
+    };
+
+    /**
+     * Fetches the shards of the packages reachable from `names` through the
+     * dependencies of their records, in all the subdirs at once, one level of
+     * the dependency graph per batch of downloads.
+     */
+    void fetch_shard_closure(const std::vector<std::shared_ptr<SubdirShards>>& subdirs,
+                             const std::vector<std::string>& names);
+
+}  // namespace mamba
+
+#endif  // MAMBA_CORE_SHARDS_HPP
@@ -7,15 +7,23 @@
 #ifndef MAMBA_CORE_SOLVER_HPP
 #define MAMBA_CORE_SOLVER_HPP
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "mamba_fs.hpp"
 #include "match_spec.hpp"
 #include "output.hpp"
 #include "pool.hpp"
 #include "prefix_data.hpp"
+#include "repo.hpp"
+#include "thread_utils.hpp"
 
 extern "C"
 {
@@ -23,6 +31,7 @@ extern "C"
 #include "solv/queue.h"
 #include "solv/solver.h"
 #include "solv/solverdebug.h"
+#include "solv/transaction.h"
 }
 
 #define MAMBA_NO_DEPS 0b0001
@@ -31,6 +40,37 @@ extern "C"
 
 namespace mamba
 {
+    /**
+     * Where the time of a solve goes, and the size of the problem.
+     * The rule counts and the propagation time are taken from the
+     * statistics that libsolv reports while solving, and stay at 0 when
+     * it does not report them.
+     */
+    struct SolveStats
+    {
+        double createwhatprovides_ms = 0;
+        // the solve time not spent in the SAT run, mostly rule creation
+        double rule_creation_ms = 0;
+        // the SAT run: propagation, decisions and learning
+        double propagation_ms = 0;
+        double solve_ms = 0;
+
+        std::size_t rules = 0;
+        std::size_t learned_rules = 0;
+        std::size_t decisions = 0;
+        std::size_t problems = 0;
+        std::size_t pruned_solvables = 0;
+        bool from_cache = false;
+
+        std::size_t pool_size = 0;
+        // the number of solvables by repo name
+        std::map<std::string, std::size_t> repo_sizes;
+        // the number of jobs by type (install, erase, update, lock...)
+        std::map<std::string, std::size_t> jobs;
+
+        nlohmann::json to_json() const;
+    };
+
     class MSolver
     {
     public:
@@ -54,6 +94,28 @@ namespace mamba
         bool solve();
         std::string problems_to_str();
 
+        /**
+         * Reuse the result of an earlier solve of the same problem. The
+         * decisions of successful solves are kept in ``cache_dir``, by a hash
+         * of the metadata of the channel repos in the pool, the content of the
+         * other repos (the installed packages), the jobs, the pins and the
+         * flags. ``solve`` then replays them when they are all the same.
+         * @param cache_dir The index cache
+         * @param repos The repos of the pool
+         */
+        void set_solve_cache(const fs::path& cache_dir, const std::vector<MRepo*>& repos);
+        // whether the last solve was replayed from the cache
+        bool from_cache() const;
+        // the transaction of the solve, to be freed by the caller
+        Transaction* create_transaction();
+
+        // the decisions of the solve, that replay_solution can replay in
+        // another pool with the same repos
+        nlohmann::json solution() const;
+        // takes the solution of the same problem solved in another pool, e.g.
+        // with other flags, false if this pool does not have its packages
+        bool replay_solution(const nlohmann::json& solution);
+
         const std::vector<MatchSpec>& install_specs() const;
         const std::vector<MatchSpec>& remove_specs() const;
         const std::vector<MatchSpec>& neuter_specs() const;
@@ -61,13 +123,28 @@ namespace mamba
 
         operator Solver*();
 
+        // the number of solvables left out of the last solve, see prune_unreachable
+        std::size_t pruned_solvables() const;
+        // the statistics of the last solve, also written to the JsonLogger
+        const SolveStats& stats() const;
+
         bool only_deps = false;
         bool no_deps = false;
         bool force_reinstall = false;
+        // only consider the solvables that the jobs and the installed packages
+        // can reach through their names and dependencies
+        bool prune_unreachable = false;
+        // write the result and the statistics of solve to the JsonLogger
+        bool log_json = true;
 
     private:
         void add_channel_specific_job(const MatchSpec& ms, int job_flag);
         void add_reinstall_job(MatchSpec& ms, int job_flag);
+        void prune_pool();
+        void collect_problem_stats();
+        std::string solve_cache_key() const;
+        bool load_cached_decisions(const fs::path& path);
+        void store_decisions(const fs::path& path) const;
 
         std::vector<std::pair<int, int>> m_flags;
         std::vector<MatchSpec> m_install_specs;
@@ -79,6 +156,80 @@ namespace mamba
         Pool* m_pool;
         Queue m_jobs;
         const PrefixData* m_prefix_data = nullptr;
+
+        // the jobs and pins as they were given, for the solve cache
+        std::vector<std::string> m_job_keys;
+        fs::path m_solve_cache_dir;
+        std::vector<std::pair<Repo*, RepoMetadata>> m_repo_metadata;
+        // the decisions of a replayed solve, from the cache or replay_solution
+        Queue m_cached_decisions;
+        bool m_replayed = false;
+        bool m_from_cache = false;
+
+        std::size_t m_pruned_solvables = 0;
+        // pool->considered was set by prune_pool
+        bool m_owns_considered = false;
+
+        SolveStats m_stats;
+    };
+
+    /**
+     * Solves a problem with several strategies at once, each on a thread
+     * with its own copy of the pool. The strategies are preferred in the
+     * order they are added: wait returns the first one that succeeds once
+     * the ones before it have failed, and cancels the others. libsolv cannot
+     * interrupt a solve, the strategies that were not started yet are
+     * skipped and the running ones are left to finish before the portfolio
+     * is destroyed.
+     */
+    class SolvePortfolio
+    {
+    public:
+        // adds the jobs and pins of the problem to the solver of a strategy
+        using setup_function = std::function<void(MSolver&)>;
+
+        /**
+         * @param repos The repos of the pool to copy, serialized by the caller
+         * @param prefix_data The installed packages, for reinstall jobs
+         */
+        SolvePortfolio(const std::vector<MRepo*>& repos, const PrefixData* prefix_data = nullptr);
+        ~SolvePortfolio();
+
+        SolvePortfolio(const SolvePortfolio&) = delete;
+        SolvePortfolio& operator=(const SolvePortfolio&) = delete;
+
+        void add(const std::string& name,
+                 const std::vector<std::pair<int, int>>& flags,
+                 setup_function setup);
+
+        /**
+         * Waits for the preferred strategy that succeeds.
+         * @param solution Its solution, see MSolver::replay_solution
+         * @return Its name, empty if none succeeds
+         */
+        std::string wait(nlohmann::json& solution);
+        void cancel();
+
+    private:
+        struct Result
+        {
+            std::string name;
+            bool done = false;
+            bool success = false;
+            nlohmann::json solution;
+        };
+
+        void run(std::size_t index,
+                 std::vector<std::pair<int, int>> flags,
+                 setup_function setup);
+
+        PoolCopy m_pool_copy;
+        const PrefixData* m_prefix_data;
+        std::mutex m_mutex;
+        std::condition_variable m_done;
+        std::vector<Result> m_results;
+        std::atomic<bool> m_cancelled{ false };
+        std::vector<thread> m_threads;
     };
 }  // namespace mamba
 
@@ -10,6 +10,8 @@
 #include <memory>
 #include <regex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "nlohmann/json.hpp"
 
@@ -18,6 +20,7 @@
 #include "mamba_fs.hpp"
 #include "output.hpp"
 #include "repo.hpp"
+#include "thread_utils.hpp"
 #include "util.hpp"
 
 
@@ -50,8 +53,22 @@ namespace mamba
         // TODO return seconds as double
         fs::file_time_type::duration check_cache(const fs::path& cache_file,
                                                  const fs::file_time_type::clock::time_point& ref);
+        // for an index file the channel may not have, like a shards manifest:
+        // requested as is, without .zst or patch log, and its absence is kept
+        // in the state sidecar. To call before load().
+        void set_optional(bool optional);
         bool load();
+        // use the repodata file, put together locally, as is. `etag` identifies
+        // its content for the .solv cache.
+        bool load_local(const std::string& etag);
         bool loaded();
+        // loaded from a cache past its time-to-live, within repodata_max_stale
+        bool stale() const;
+        // the optional file was recently found missing, load() did not request it
+        bool missing() const;
+        // downloads the repodata again, quietly, for the cache of this subdir.
+        // This one keeps the repodata it loaded.
+        std::unique_ptr<MSubdirData> revalidation() const;
 
         bool forbid_cache();
         void clear_cache();
@@ -63,12 +80,42 @@ namespace mamba
         bool finalize_transfer();
 
         MRepo create_repo(MPool& pool);
+        // parse the JSON repodata in a pool of its own and write the .solv cache,
+        // which create_repo then loads. Safe to call on another thread.
+        bool stage_repo();
+        RepoMetadata repo_metadata() const;
+        // identifies the content of the cached repodata
+        nlohmann::json cache_identity() const;
 
     private:
         bool decompress();
         void create_target(nlohmann::json& mod_etag);
+        // the cached repodata is up to date
+        void keep_cache();
+        // takes the repodata of a shared cache when it is fresher than this one,
+        // copied unless this one has the same content hash
+        bool use_shared_cache(const fs::file_time_type::duration& cache_age);
+        // the .solv caches to load the repo from, in order
+        std::vector<std::string> solv_files() const;
+        void show_progress(const std::string& postfix, bool completed);
+        // seconds past the time-to-live during which the cache can be used
+        std::size_t max_stale() const;
+        // update the cached repodata with the downloaded patch log
+        bool apply_patches();
+        // whether to request repodata.json.zst
+        bool use_zst() const;
+        // download the whole repodata instead of what the target just tried
+        void fall_back_to_full();
         std::size_t get_cache_control_max_age(const std::string& val);
+        // cache metadata of the repodata, in the .state.json sidecar
+        nlohmann::json read_state();
+        void write_state();
+        // the optional file is not on the server, for a while
+        bool read_missing_state() const;
+        void write_missing_state() const;
+        // old caches have it spliced at the start of the repodata
         nlohmann::json read_mod_and_etag();
+        std::unique_ptr<TemporaryFile> make_temp_file() const;
 
         std::unique_ptr<DownloadTarget> m_target;
 
@@ -81,10 +128,21 @@ namespace mamba
 
         bool m_loaded;
         bool m_download_complete;
+        bool m_stale = false;
+        bool m_has_progress_bar = true;
+        bool m_optional = false;
+        bool m_missing = false;
+        // the target downloads the patch log rather than the repodata
+        bool m_patching = false;
+        // the repodata is downloaded from repodata.json.zst
+        bool m_zst = false;
+        // whether the channel has repodata.json.zst: {"value", "last_checked"}
+        nlohmann::json m_has_zst;
         std::string m_repodata_url;
         std::string m_name;
         std::string m_json_fn;
         std::string m_solv_fn;
+        std::string m_state_fn;
         bool m_is_noarch;
         nlohmann::json m_mod_etag;
         std::unique_ptr<TemporaryFile> m_temp_file;
@@ -98,6 +156,88 @@ namespace mamba
     std::string cache_fn_url(const std::string& url);
     std::string create_cache_dir();
 
+    /**
+     * Stages the repos of the subdirs whose .solv cache is missing on parallel
+     * threads (see MSubdirData::stage_repo). Adding them to the pool, in order,
+     * is left to the caller so that the result is the same as without staging.
+     */
+    void stage_repos(const std::vector<std::shared_ptr<MSubdirData>>& subdirs,
+                     std::size_t max_threads = std::thread::hardware_concurrency());
+
+    /**
+     * Revalidates the subdirs loaded from a stale cache on a thread of its own,
+     * while the command goes on with what they loaded. The index cache is
+     * updated under its lock. Its transfers do not share the connections of
+     * the ones of the main thread. The destructor waits for the refresh to
+     * finish.
+     */
+    class RepodataRefresher
+    {
+    public:
+        RepodataRefresher(const fs::path& cache_dir,
+                          const std::vector<std::shared_ptr<MSubdirData>>& subdirs);
+        ~RepodataRefresher();
+
+        RepodataRefresher(const RepodataRefresher&) = delete;
+        RepodataRefresher& operator=(const RepodataRefresher&) = delete;
+
+        // the number of subdirs being revalidated
+        std::size_t size() const;
+        void wait();
+
+    private:
+        std::vector<std::unique_ptr<MSubdirData>> m_subdirs;
+        thread m_thread;
+    };
+
+    /**
+     * The repos of the loaded subdirs of an ordered channel set, with their
+     * priorities, in a single file of the index cache. It holds as long as the
+     * repodata of the subdirs and mamba_tool_version are the same, and then
+     * replaces loading a .solv file per subdir by reading one file. The
+     * snapshots of the few most recently used channel sets are kept.
+     */
+    class RepoSnapshot
+    {
+    public:
+        RepoSnapshot(const fs::path& cache_dir,
+                     const std::vector<std::shared_ptr<MSubdirData>>& subdirs,
+                     const std::vector<std::pair<int, int>>& priorities);
+
+        // adds the repos to the pool, nothing if the snapshot is missing or outdated
+        std::vector<MRepo> load(MPool& pool) const;
+        // the repos of the loaded subdirs, in order, written by the SolvWriter;
+        // removes the least recently used snapshots of other channel sets
+        bool write(std::vector<MRepo>& repos) const;
+
+        const fs::path& path() const;
+
+    private:
+        fs::path m_path;
+        std::string m_key;
+        std::vector<RepoMetadata> m_metadata;
+        std::vector<std::pair<int, int>> m_priorities;
+    };
+
+    /**
+     * Applies a repodata patch log to a repodata file, in place.
+     *
+     * The log (repodata.jlap) has one JSON object per line: patches
+     * {"from": <sha256>, "to": <sha256>, "patch": [<RFC 6902 operations>]}
+     * followed by {"latest": <sha256>}. The hashes are those of the repodata
+     * as published, which must be serialized compactly with sorted keys for
+     * the patched file to match them.
+     *
+     * @param repodata_fn Path of the repodata file
+     * @param patch_log_fn Path of the patch log
+     * @param sha256 Hash of the repodata file
+     * @return The hash of the updated repodata file, or an empty string if the
+     * log does not lead from that version to the latest one
+     */
+    std::string apply_repodata_patches(const fs::path& repodata_fn,
+                                       const fs::path& patch_log_fn,
+                                       const std::string& sha256);
+
 }  // namespace mamba
 
 #endif  // MAMBA_SUBDIRDATA_HPP
@@ -57,6 +57,9 @@ namespace mamba
         auto validation_result() const;
         void clear_cache() const;
 
+        void stream_extract(std::size_t available);
+        bool finish_streaming_extraction();
+
         DownloadTarget* target(const fs::path& cache_path, MultiPackageCache& cache);
 
         enum VALIDATION_RESULT
@@ -84,6 +87,11 @@ namespace mamba
         std::string m_url, m_name, m_channel, m_filename;
         fs::path m_tarball_path, m_cache_path;
 
+        // extraction while downloading
+        fs::path m_staging_path;
+        std::unique_ptr<StreamingExtractor> m_streaming_extractor;
+        bool m_streamed = false;
+
         std::future<bool> m_extract_future;
 
         VALIDATION_RESULT m_validation_result = VALIDATION_RESULT::UNDEFINED;
@@ -126,6 +134,9 @@ namespace mamba
         std::string find_python_version();
 
     private:
+        // priority of the download of each package of m_to_install
+        std::vector<std::size_t> download_priorities(DownloadOrder order);
+
         FilterType m_filter_type = FilterType::none;
         std::set<Id> m_filter_name_ids;
 
@@ -116,7 +116,10 @@ namespace mamba
     class TemporaryFile
     {
     public:
-        TemporaryFile(const std::string& prefix = "mambaf", const std::string& suffix = "");
+        // created in the system temporary directory unless a directory is given
+        TemporaryFile(const std::string& prefix = "mambaf",
+                      const std::string& suffix = "",
+                      const fs::path& directory = fs::path());
         ~TemporaryFile();
 
         TemporaryFile(const TemporaryFile&) = delete;
@@ -17,11 +17,42 @@
 #include <set>
 #include <stdexcept>
 
+// from OpenSSL, only used through a pointer
+struct evp_md_ctx_st;
 
 namespace validate
 {
     using nlohmann::json;
 
+    /**
+     * Hash of data fed chunk by chunk, e.g. while
+     * a file is being downloaded.
+     */
+    class Hasher
+    {
+    public:
+        enum class Algorithm
+        {
+            sha256,
+            md5
+        };
+
+        explicit Hasher(Algorithm algorithm);
+        ~Hasher();
+
+        Hasher(const Hasher&) = delete;
+        Hasher& operator=(const Hasher&) = delete;
+
+        void reset();
+        void update(const char* data, std::size_t size);
+        // Hex digest of the data fed since the last reset
+        std::string hex_digest();
+
+    private:
+        Algorithm m_algorithm;
+        ::evp_md_ctx_st* m_ctx;
+    };
+
     std::string sha256sum(const std::string& path);
     std::string md5sum(const std::string& path);
     bool sha256(const std::string& path, const std::string& validation);
@@ -8,6 +8,7 @@
 #include "mamba/api/configuration.hpp"
 
 #include "mamba/core/context.hpp"
+#include "mamba/core/fetch.hpp"
 #include "mamba/core/package_cache.hpp"
 
 
@@ -147,6 +148,8 @@ namespace mamba
                     for (auto& tbr : to_be_removed)
                     {
                         fs::remove(tbr);
+                        fs::remove(tbr.string() + MAMBA_RESUME_STATE_SUFFIX);
+                        fs::remove(tbr.string() + MAMBA_SEGMENTS_STATE_SUFFIX);
                     }
                 }
             }
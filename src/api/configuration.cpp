@@ -553,6 +553,20 @@ namespace mamba
                    .description("Custom channels")
                    .long_description("A dictionary with name: url to use for custom channels."));
 
+        insert(Configurable("mirrored_channels", &ctx.mirrored_channels)
+                   .group("Channels")
+                   .set_rc_configurable()
+                   .description("Mirrors of channels")
+                   .long_description(unindent(R"(
+                        A dictionary with name: list of base urls serving the same
+                        content as the channel, e.g.
+                          conda-forge:
+                            - https://conda.anaconda.org/conda-forge
+                            - https://mirror.example.com/conda-forge
+                        Downloads go to the fastest healthy mirror and fail over to
+                        the others. Latency and failures of the mirrors are kept in
+                        'mirrors.json' of the first package cache.)")));
+
         insert(Configurable("override_channels_enabled", &ctx.override_channels_enabled)
                    .group("Channels")
                    .set_rc_configurable()
@@ -583,12 +597,143 @@ namespace mamba
                         locally cache repodata before checking the remote server for
                         an update.)")));
 
+        insert(Configurable("repodata_max_stale", &ctx.repodata_max_stale)
+                   .group("Network")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Time during which expired repodata is still used")
+                   .long_description(unindent(R"(
+                        Number of seconds past 'local_repodata_ttl' during which the
+                        cached repodata is used as is. The command does not wait for
+                        the network, the cache is revalidated in the background while
+                        it runs. 0 disables it.)")));
+
+        insert(Configurable("channel_repodata_max_stale", &ctx.channel_repodata_max_stale)
+                   .group("Network")
+                   .set_rc_configurable()
+                   .description("'repodata_max_stale' of specific channels")
+                   .long_description(unindent(R"(
+                        A dictionary with channel name: seconds, overriding
+                        'repodata_max_stale' for these channels, e.g.
+                          conda-forge: 3600
+                          my-internal-channel: 0)")));
+
+        insert(Configurable("shared_index_caches", &ctx.shared_index_caches)
+                   .group("Network")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Read-only index caches to use before downloading")
+                   .long_description(unindent(R"(
+                        Index caches ('pkgs/cache' directories) kept up to date by
+                        someone else, e.g. for all the users of a machine. Repodata
+                        fresher than the own cache is copied from them instead of
+                        downloaded, and their .solv files are used when they were
+                        made from the same repodata. They are never written to.)")));
+
+        insert(Configurable("repodata_use_patches", &ctx.repodata_use_patches)
+                   .group("Network")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Update cached repodata with patches")
+                   .long_description(unindent(R"(
+                        When the cached repodata of a channel is stale, first fetch
+                        the patch log published next to it (repodata.jlap) and apply
+                        the patches from the cached version to the latest one. The
+                        full repodata is downloaded when there is no log, the cached
+                        version is not in it or the result does not match the
+                        expected content hash.)")));
+
+        insert(Configurable("repodata_use_zst", &ctx.repodata_use_zst)
+                   .group("Network")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Download zstd compressed repodata when available")
+                   .long_description(unindent(R"(
+                        Request repodata.json.zst and decompress it while it is
+                        downloaded. Whether a channel has it is remembered with its
+                        cached repodata, channels without it are checked again after
+                        two weeks.)")));
+
+        insert(Configurable("repodata_use_shards", &ctx.repodata_use_shards)
+                   .group("Network")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Fetch the repodata of the needed packages only")
+                   .long_description(unindent(R"(
+                        For channels publishing a sharded index (repodata_shards.json),
+                        download the records of the packages reachable from the
+                        requested and installed ones instead of the whole repodata.
+                        Shards are kept in the index cache by content hash. Other
+                        channels are loaded as usual.)")));
+
         insert(Configurable("offline", &ctx.offline)
                    .group("Network")
                    .set_rc_configurable()
                    .set_env_var_name()
                    .description("Force use cached repodata"));
 
+        insert(Configurable("max_retry_after", &ctx.max_retry_after)
+                   .group("Network")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Longest wait (in seconds) asked by a server that is honored")
+                   .long_description(unindent(R"(
+                        A server that is busy (429 or 503) can ask to be retried after
+                        some time with a Retry-After header. Longer waits than that are
+                        shortened to it, the download is retried as usual.)")));
+        insert(Configurable("mirror_racing", &ctx.mirror_racing)
+                   .group("Network")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Request repodata from two mirrors at once")
+                   .long_description(unindent(R"(
+                        For channels with mirrors ('mirrored_channels'), send the
+                        repodata requests to the two preferred mirrors and keep the
+                        first response.)")));
+
+        insert(Configurable("use_http2", &ctx.use_http2)
+                   .group("Network")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Use HTTP/2 when the server supports it")
+                   .long_description(unindent(R"(
+                        Multiplex all the transfers to a given host over a single
+                        HTTP/2 connection when libcurl and the server support it.
+                        Set to false to fall back to HTTP/1.1, with one connection
+                        per parallel transfer.)")));
+
+        insert(Configurable("download_order", &ctx.download_order)
+                   .group("Network")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Order of the package downloads ('largest_first', "
+                                "'critical_path' or 'fifo')")
+                   .long_description(unindent(R"(
+                        Order in which the packages of a transaction are downloaded:
+                        - 'largest_first' starts with the biggest packages so that a
+                          large download queued last does not set the total time
+                        - 'critical_path' starts with the packages at the bottom of
+                          the heaviest chain of dependencies
+                        - 'fifo' keeps the order of the transaction)")));
+
+        insert(Configurable("segmented_download_threshold", &ctx.segmented_download_threshold)
+                   .group("Network")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Size from which packages are downloaded in segments")
+                   .long_description(unindent(R"(
+                        Packages of at least that size (in bytes) are downloaded with
+                        'download_segments' parallel range requests, each over its own
+                        connection and possibly to different mirrors. Interrupted
+                        downloads continue where they stopped. 0, the default,
+                        disables it.)")));
+
+        insert(Configurable("download_segments", &ctx.download_segments)
+                   .group("Network")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Number of segments of a segmented download"));
+
         insert(Configurable("ssl_no_revoke", &ctx.ssl_no_revoke)
                    .group("Network")
                    .set_rc_configurable()
@@ -627,6 +772,55 @@ namespace mamba
                         previous versions of conda, this parameter was configured as either
                         True or False. True is now an alias to 'flexible'.)")));
 
+        insert(Configurable("repodata_keep_versions", &ctx.repodata_keep_versions)
+                   .group("Solver")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Number of versions per package name loaded from repodata")
+                   .long_description(unindent(R"(
+                        Only the records of the newest versions of each package name
+                        of a channel subdirectory are loaded, which makes the pool
+                        smaller. 0, the default, keeps all the versions.)")));
+
+        insert(Configurable("repodata_keep_builds", &ctx.repodata_keep_builds)
+                   .group("Solver")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Number of builds per package version loaded from repodata")
+                   .long_description(unindent(R"(
+                        Only the records of the newest build numbers of each version
+                        of a package are loaded, with all the variants that share them.
+                        0, the default, keeps all the builds.)")));
+
+        insert(Configurable("repodata_exclude_builds", &ctx.repodata_exclude_builds)
+                   .group("Solver")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Regular expressions of build strings not loaded from repodata")
+                   .long_description(unindent(R"(
+                        Records with a build string matching one of these regular
+                        expressions (e.g. '_pypy') are not loaded from the repodata.)")));
+
+        insert(Configurable("repodata_exclude_licenses", &ctx.repodata_exclude_licenses)
+                   .group("Solver")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Regular expressions of licenses not loaded from repodata")
+                   .long_description(unindent(R"(
+                        Records with a license matching one of these regular
+                        expressions (e.g. '^GPL') are not loaded from the repodata.)")));
+
+        insert(Configurable("repodata_drop_fields", &ctx.repodata_drop_fields)
+                   .group("Solver")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Repodata fields not kept in the .solv caches")
+                   .long_description(unindent(R"(
+                        Fields of the records that the solver does not use, left out
+                        of the .solv caches to save memory when they are loaded.
+                        Only 'license' can be dropped, the other fields are used
+                        by the solver or to check the packages.)")));
+
         insert(Configurable("explicit_install", false)
                    .group("Solver")
                    .description("Use explicit install instead of solving environment"));
@@ -661,6 +855,44 @@ namespace mamba
                    .group("Solver")
                    .description("Freeze already installed dependencies"));
 
+        insert(Configurable("use_solve_cache", &ctx.use_solve_cache)
+                   .group("Solver")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Reuse the result of an identical earlier solve")
+                   .long_description(unindent(R"(
+                        Keep the result of the solves in the index cache, and reuse
+                        it instead of solving again when the repodata, the installed
+                        packages, the specs, the pins and the solver flags are all
+                        the same as for an earlier solve.)")));
+
+        insert(Configurable("prune_pool", &ctx.prune_pool)
+                   .group("Solver")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Only give the solver the packages the request can reach")
+                   .long_description(unindent(R"(
+                        Before solving, find the packages that the specs, the pins
+                        and the installed packages can reach through package names
+                        and dependencies, and leave the others out of the solve.
+                        The result is the same, the solve is faster for small
+                        requests on large channels.)")));
+
+        insert(Configurable("solve_portfolio", &ctx.solve_portfolio)
+                   .group("Solver")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Fallback solve strategies, when the configured solve fails")
+                   .long_description(unindent(R"(
+                        Strategies solved when the configured solve fails, at once
+                        on other threads, each in its own copy of the pool. The
+                        first of them that succeeds, in this order, is used
+                        instead of failing. The strategies
+                        are 'flexible' (flexible channel priority), 'unfrozen'
+                        (installed packages not frozen), 'allow_uninstall'
+                        (installed packages can be removed) and 'relaxed' (all of
+                        them).)")));
+
         insert(Configurable("retry_clean_cache", false)
                    .group("Solver")
                    .set_env_var_name()
@@ -726,6 +958,18 @@ namespace mamba
                         Spend extra time validating package contents. Currently, runs sha256
                         verification on every file within each package during installation.)")));
 
+        insert(Configurable("extract_while_downloading", &ctx.extract_while_downloading)
+                   .group("Link & Install")
+                   .set_rc_configurable()
+                   .set_env_var_name()
+                   .description("Extract packages while they are downloaded")
+                   .long_description(unindent(R"(
+                        Decompress '.tar.bz2' and '.conda' packages into a staging
+                        directory as their data arrives. The extracted package is only
+                        moved into the package cache once the checksum of the complete
+                        download matches, otherwise it is discarded. Off by default, the
+                        packages are then extracted once they are downloaded.)")));
+
         insert(Configurable("verify_artifacts", &ctx.verify_artifacts)
                    .group("Link & Install")
                    .set_rc_configurable()
@@ -16,6 +16,7 @@
 #include "mamba/core/output.hpp"
 #include "mamba/core/package_cache.hpp"
 #include "mamba/core/pinning.hpp"
+#include "mamba/core/shards.hpp"
 #include "mamba/core/subdirdata.hpp"
 #include "mamba/core/thread_utils.hpp"
 #include "mamba/core/transaction.hpp"
@@ -278,6 +279,73 @@ namespace mamba
     int RETRY_SUBDIR_FETCH = 1 << 0;
     int RETRY_SOLVE_ERROR = 1 << 1;
 
+    namespace
+    {
+        // loads the subdirs of the channels with a sharded index from the shards
+        // reachable from `names`, and the others from their repodata.json
+        void load_shards(std::vector<std::shared_ptr<MSubdirData>>& subdirs,
+                         const std::vector<std::shared_ptr<SubdirShards>>& subdir_shards,
+                         const std::vector<std::string>& names,
+                         const fs::path& cache_dir)
+        {
+            auto load_full = [&](std::size_t i, MultiDownloadTarget& multi_dl) {
+                auto& shards = subdir_shards[i];
+                std::string repodata_full_url = concat(shards->url(), "/repodata.json");
+                subdirs[i] = std::make_shared<MSubdirData>(
+                    shards->name(),
+                    repodata_full_url,
+                    cache_dir / cache_fn_url(repodata_full_url),
+                    shards->is_noarch());
+                subdirs[i]->load();
+                multi_dl.add(subdirs[i]->target());
+            };
+
+            std::vector<std::shared_ptr<SubdirShards>> sharded;
+            MultiDownloadTarget multi_dl;
+            for (std::size_t i = 0; i < subdirs.size(); ++i)
+            {
+                if (subdirs[i])
+                {
+                    // the channel has no sharded index, its repodata.json is there
+                    continue;
+                }
+                if (subdir_shards[i]->read_manifest())
+                {
+                    sharded.push_back(subdir_shards[i]);
+                    continue;
+                }
+                load_full(i, multi_dl);
+            }
+            multi_dl.download(true);
+
+            try
+            {
+                fetch_shard_closure(sharded, names);
+            }
+            catch (const std::exception& e)
+            {
+                LOG_WARNING << "Could not load the repodata shards, using the full repodata: "
+                            << e.what();
+                MultiDownloadTarget full_dl;
+                for (std::size_t i = 0; i < subdirs.size(); ++i)
+                {
+                    if (!subdirs[i])
+                    {
+                        load_full(i, full_dl);
+                    }
+                }
+                full_dl.download(true);
+            }
+            for (std::size_t i = 0; i < subdirs.size(); ++i)
+            {
+                if (!subdirs[i])
+                {
+                    subdirs[i] = subdir_shards[i]->subdir_data();
+                }
+            }
+        }
+    }
+
     void install_specs(const std::vector<std::string>& specs,
                        bool create_env,
                        int solver_flag,
@@ -340,7 +408,65 @@ namespace mamba
         auto& ctx_channels = Context::instance().channels;
         std::copy(ctx_channels.begin(), ctx_channels.end(), std::back_inserter(channel_urls));
 
+        PrefixData prefix_data(ctx.target_prefix);
+        prefix_data.load();
+
+        std::vector<std::string> pins;
+        if (!no_pin)
+        {
+            pins = file_pins(prefix_data.path() / "conda-meta" / "pinned");
+            pins.insert(pins.end(), ctx.pinned_packages.begin(), ctx.pinned_packages.end());
+        }
+        if (!no_py_pin)
+        {
+            auto py_pin = python_pin(prefix_data, specs);
+            if (!py_pin.empty())
+            {
+                pins.push_back(py_pin);
+            }
+        }
+
+        // nothing to do for the solver, no need for the repodata
+        if (solver_flag == SOLVER_INSTALL && !create_env && !is_retry
+            && other_pkg_mgr_specs.empty())
+        {
+            if (detail::specs_already_installed(prefix_data, specs, pins))
+            {
+                LOG_INFO << "All the specs are installed, skipping the solve";
+                if (!ctx.json)
+                {
+                    Console::print("Transaction\n");
+                    Console::stream() << "  Prefix: " << ctx.target_prefix.string() << "\n";
+                    Console::print("  All requested packages already installed\n");
+                }
+                JsonLogger::instance().json_write({ { "success", true } });
+                JsonLogger::instance().json_write(
+                    { { "dry_run", ctx.dry_run }, { "prefix", ctx.target_prefix } });
+                JsonLogger::instance().json_write(
+                    { { "message", "All requested packages already installed" } });
+                if (ctx.json)
+                {
+                    Console::instance().print(
+                        JsonLogger::instance().json_log.unflatten().dump(4), true);
+                }
+                if (!ctx.dry_run)
+                {
+                    // as for an empty transaction
+                    auto entry = History::UserRequest::prefilled();
+                    for (const auto& spec : specs)
+                    {
+                        entry.update.push_back(MatchSpec(spec).str());
+                    }
+                    prefix_data.history().add_entry(entry);
+                }
+                return;
+            }
+        }
+
         std::vector<std::shared_ptr<MSubdirData>> subdirs;
+        // channels publishing a sharded index only get the records that can be needed
+        bool use_shards = ctx.repodata_use_shards && !ctx.offline;
+        std::vector<std::shared_ptr<SubdirShards>> subdir_shards;
         MultiDownloadTarget multi_dl;
         std::unique_ptr<LockFile> subdir_download_lock;
         if (!ctx.offline)
@@ -362,16 +488,33 @@ namespace mamba
             for (auto& [platform, url] : channel->platform_urls(true))
             {
                 std::string repodata_full_url = concat(url, "/repodata.json");
+                std::string name = concat(channel->canonical_name(), "/", platform);
 
-                auto sdir = std::make_shared<MSubdirData>(
-                    concat(channel->canonical_name(), "/", platform),
-                    repodata_full_url,
-                    cache_dir / cache_fn_url(repodata_full_url),
-                    platform == "noarch");
-
-                sdir->load();
-                multi_dl.add(sdir->target());
-                subdirs.push_back(sdir);
+                std::shared_ptr<SubdirShards> shards;
+                if (use_shards)
+                {
+                    shards = std::make_shared<SubdirShards>(
+                        name, url, cache_dir, platform == "noarch");
+                    shards->manifest().load();
+                    subdir_shards.push_back(shards);
+                }
+                if (shards && !shards->manifest().missing())
+                {
+                    multi_dl.add(shards->manifest().target());
+                    // loaded once the manifests are there
+                    subdirs.push_back(nullptr);
+                }
+                else
+                {
+                    // also for a channel known not to have a sharded index
+                    auto sdir = std::make_shared<MSubdirData>(
+                        name, repodata_full_url, cache_dir / cache_fn_url(repodata_full_url),
+                        platform == "noarch");
+
+                    sdir->load();
+                    multi_dl.add(sdir->target());
+                    subdirs.push_back(sdir);
+                }
                 if (ctx.channel_priority == ChannelPriority::kDisabled)
                 {
                     priorities.push_back(std::make_pair(0, max_prio--));
@@ -390,6 +533,23 @@ namespace mamba
         if (!ctx.offline)
         {
             multi_dl.download(true);
+            if (use_shards)
+            {
+                std::vector<std::string> names;
+                for (const auto& m : match_specs)
+                {
+                    names.push_back(m.name);
+                }
+                for (auto& it : prefix_data.m_package_records)
+                {
+                    names.push_back(it.first);
+                }
+                for (const auto& pin : ctx.pinned_packages)
+                {
+                    names.push_back(MatchSpec(pin).name);
+                }
+                load_shards(subdirs, subdir_shards, names, cache_dir);
+            }
             subdir_download_lock.reset();
         }
 
@@ -400,9 +560,6 @@ namespace mamba
             LOG_INFO << "Creating repo from pkgs_dir for offline";
             repos.push_back(detail::create_repo_from_pkgs_dir(pool, pkgs_dirs));
         }
-        PrefixData prefix_data(ctx.target_prefix);
-        prefix_data.load();
-
         std::vector<std::string> prefix_pkgs;
         for (auto& it : prefix_data.m_package_records)
             prefix_pkgs.push_back(it.first);
@@ -412,6 +569,16 @@ namespace mamba
         auto repo = MRepo(pool, prefix_data);
         repos.push_back(repo);
 
+        // the repos of all the channels in one read when their repodata did not change
+        RepoSnapshot snapshot(cache_dir, subdirs, priorities);
+        std::vector<MRepo> channel_repos = snapshot.load(pool);
+        bool from_snapshot = !channel_repos.empty();
+        if (!from_snapshot)
+        {
+            // parse the repodata in parallel, the repos are then added in order
+            stage_repos(subdirs);
+        }
+
         std::string prev_channel;
         bool loading_failed = false;
         for (std::size_t i = 0; i < subdirs.size(); ++i)
@@ -428,13 +595,17 @@ namespace mamba
                     throw std::runtime_error("Subdir " + subdir->name() + " not loaded!");
                 }
             }
+            if (from_snapshot)
+            {
+                continue;
+            }
 
             auto& prio = priorities[i];
             try
             {
                 MRepo repo = subdir->create_repo(pool);
                 repo.set_priority(prio.first, prio.second);
-                repos.push_back(repo);
+                channel_repos.push_back(repo);
             }
             catch (std::runtime_error& e)
             {
@@ -453,6 +624,7 @@ namespace mamba
                 loading_failed = true;
             }
         }
+        repos.insert(repos.end(), channel_repos.begin(), channel_repos.end());
 
         if (loading_failed)
         {
@@ -464,33 +636,38 @@ namespace mamba
             throw std::runtime_error("Could not load repodata. Cache corrupted?");
         }
 
+        // stale caches were used as they are, they are revalidated while the command runs
+        RepodataRefresher refresher(cache_dir, subdirs);
+
+        bool strict_priority = ctx.channel_priority == ChannelPriority::kStrict;
         MSolver solver(pool,
                        { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 },
-                         { SOLVER_FLAG_STRICT_REPO_PRIORITY,
-                           ctx.channel_priority == ChannelPriority::kStrict } });
+                         { SOLVER_FLAG_STRICT_REPO_PRIORITY, strict_priority } });
 
-        if (ctx.freeze_installed && !prefix_pkgs.empty())
+        std::vector<MRepo*> solve_repos;
+        for (auto& r : repos)
         {
-            LOG_INFO << "Locking environment: " << prefix_pkgs.size() << " packages freezed";
-            solver.add_jobs(prefix_pkgs, SOLVER_LOCK);
+            solve_repos.push_back(&r);
         }
-
-        solver.add_jobs(specs, solver_flag);
-
-        if (!no_pin)
+        if (ctx.use_solve_cache)
         {
-            solver.add_pins(file_pins(prefix_data.path() / "conda-meta" / "pinned"));
-            solver.add_pins(ctx.pinned_packages);
+            solver.set_solve_cache(cache_dir, solve_repos);
         }
 
-        if (!no_py_pin)
-        {
-            auto py_pin = python_pin(prefix_data, specs);
-            if (!py_pin.empty())
+        // the same problem for every solver, the strategies of the portfolio run it on threads
+        auto setup_solver = [specs, solver_flag, prefix_pkgs, pins, prune = ctx.prune_pool](
+                                MSolver& s, bool freeze_installed) {
+            s.prune_unreachable = prune;
+            if (freeze_installed && !prefix_pkgs.empty())
             {
-                solver.add_pin(py_pin);
+                LOG_INFO << "Locking environment: " << prefix_pkgs.size() << " packages freezed";
+                s.add_jobs(prefix_pkgs, SOLVER_LOCK);
             }
-        }
+            s.add_jobs(specs, solver_flag);
+            s.add_pins(pins);
+        };
+        setup_solver(solver, ctx.freeze_installed);
+
         if (!solver.pinned_specs().empty())
         {
             std::vector<std::string> pinned_str;
@@ -500,12 +677,46 @@ namespace mamba
         }
 
         bool success = solver.solve();
+
+        // the fallback strategies, and their copies of the pool, only when needed
+        std::unique_ptr<SolvePortfolio> portfolio;
+        auto strategies = detail::portfolio_strategies(
+            ctx.solve_portfolio, strict_priority, ctx.freeze_installed);
+        if (!success && !strategies.empty())
+        {
+            portfolio = std::make_unique<SolvePortfolio>(solve_repos, &prefix_data);
+            for (const auto& strategy : strategies)
+            {
+                portfolio->add(strategy.name,
+                               { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 },
+                                 { SOLVER_FLAG_STRICT_REPO_PRIORITY, strategy.strict_priority },
+                                 { SOLVER_FLAG_ALLOW_UNINSTALL, strategy.allow_uninstall } },
+                               [setup_solver, freeze = strategy.freeze_installed](MSolver& s) {
+                                   setup_solver(s, freeze);
+                               });
+            }
+
+            nlohmann::json solution;
+            std::string strategy = portfolio->wait(solution);
+            if (!strategy.empty() && solver.replay_solution(solution))
+            {
+                LOG_WARNING << "Solved with the '" << strategy
+                            << "' solve strategy, the configured one failed.\n"
+                            << solver.problems_to_str();
+                JsonLogger::instance().json_write(
+                    { { "success", true }, { "solve_strategy", strategy } });
+                success = true;
+            }
+        }
         if (!success)
         {
             std::cout << solver.problems_to_str() << std::endl;
             if (retry_clean_cache && !(is_retry & RETRY_SOLVE_ERROR))
             {
                 ctx.local_repodata_ttl = 2;
+                refresher.wait();
+                ctx.repodata_max_stale = 0;
+                ctx.channel_repodata_max_stale.clear();
                 return install_specs(specs, create_env, solver_flag, is_retry | RETRY_SOLVE_ERROR);
             }
             if (ctx.freeze_installed)
@@ -514,6 +725,12 @@ namespace mamba
             throw std::runtime_error("Could not solve for environment specs");
         }
 
+        // serializing the repos takes a while, the solve does not wait for it
+        if (!from_snapshot)
+        {
+            snapshot.write(channel_repos);
+        }
+
         MultiPackageCache package_caches({ pkgs_dirs });
         MTransaction trans(solver, package_caches, pkgs_dirs);
 
@@ -738,6 +955,94 @@ namespace mamba
             }
         }
 
+        bool specs_already_installed(const PrefixData& prefix_data,
+                                     const std::vector<std::string>& specs,
+                                     const std::vector<std::string>& pins)
+        {
+            // only the installed packages are in the pool
+            MPool pool;
+            MRepo installed(pool, prefix_data);
+            pool_createwhatprovides(pool);
+
+            // -1 if the name is not installed, else whether the installed package matches
+            auto installed_match = [&pool](const MatchSpec& ms) {
+                Pool* p = pool;
+                Id name_id = pool_str2id(p, ms.name.c_str(), 0);
+                if (!name_id || !*pool_whatprovides_ptr(p, name_id))
+                {
+                    return -1;
+                }
+                Id match = pool_conda_matchspec(p, ms.conda_build_form().c_str());
+                return match && *pool_whatprovides_ptr(p, match) ? 1 : 0;
+            };
+
+            for (const auto& spec : specs)
+            {
+                MatchSpec ms(spec);
+                // the channel of the installed packages is left to the solver
+                if (!ms.channel.empty() || installed_match(ms) != 1)
+                {
+                    return false;
+                }
+            }
+            for (const auto& pin : pins)
+            {
+                if (installed_match(MatchSpec(pin)) == 0)
+                {
+                    return false;
+                }
+            }
+            return !specs.empty();
+        }
+
+        std::vector<SolveStrategy> portfolio_strategies(const std::vector<std::string>& names,
+                                                        bool strict_priority,
+                                                        bool freeze_installed)
+        {
+            std::vector<SolveStrategy> strategies;
+            for (const auto& name : names)
+            {
+                SolveStrategy strategy{ name, strict_priority, freeze_installed, false };
+                if (name == "flexible")
+                {
+                    strategy.strict_priority = false;
+                }
+                else if (name == "unfrozen")
+                {
+                    strategy.freeze_installed = false;
+                }
+                else if (name == "allow_uninstall")
+                {
+                    strategy.allow_uninstall = true;
+                }
+                else if (name == "relaxed")
+                {
+                    strategy = { name, false, false, true };
+                }
+                else
+                {
+                    LOG_WARNING << "Ignoring unknown solve strategy '" << name << "'";
+                    continue;
+                }
+
+                // nothing to try that the configured solve does not
+                bool configured = strategy.strict_priority == strict_priority
+                                  && strategy.freeze_installed == freeze_installed
+                                  && !strategy.allow_uninstall;
+                bool duplicate = std::any_of(
+                    strategies.begin(), strategies.end(), [&strategy](const auto& other) {
+                        return other.strict_priority == strategy.strict_priority
+                               && other.freeze_installed == strategy.freeze_installed
+                               && other.allow_uninstall == strategy.allow_uninstall;
+                    });
+                if (!configured && !duplicate)
+                {
+                    strategies.push_back(strategy);
+                }
+            }
+            return strategies;
+        }
+
         MRepo create_repo_from_pkgs_dir(MPool& pool, const fs::path& pkgs_dir)
         {
             if (!fs::exists(pkgs_dir))
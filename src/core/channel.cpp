@@ -6,6 +6,7 @@
 
 #include <cassert>
 #include <iostream>
+#include <mutex>
 #include <regex>
 #include <set>
 #include <sstream>
@@ -37,6 +38,9 @@ namespace mamba
 
         const char LOCAL_CHANNELS_NAME[] = "local";
         const char DEFAULT_CHANNELS_NAME[] = "defaults";
+
+        // make_channel is also called by the solvers of a SolvePortfolio, on their threads
+        std::mutex channel_cache_mutex;
     }  // namespace
 
     /**************************
@@ -275,6 +279,7 @@ namespace mamba
 
     const Channel& ChannelInternal::make_cached_channel(const std::string& value)
     {
+        std::lock_guard<std::mutex> lock(channel_cache_mutex);
         auto res = get_cache().find(value);
         if (res == get_cache().end())
         {
@@ -297,6 +302,7 @@ namespace mamba
 
     void ChannelInternal::clear_cache()
     {
+        std::lock_guard<std::mutex> lock(channel_cache_mutex);
         get_cache().clear();
     }
 
@@ -629,6 +635,131 @@ namespace mamba
         return result;
     }
 
+    namespace
+    {
+        // the url without its token and user:password, which it returns
+        std::string split_credentials(const std::string& url,
+                                      std::string& auth,
+                                      std::string& token)
+        {
+            std::string cleaned_url;
+            split_anaconda_token(url, cleaned_url, token);
+            URLHandler handler(cleaned_url);
+            auth = handler.auth();
+            handler.set_user("");
+            handler.set_password("");
+            return std::string(rstrip(handler.url(), "/"));
+        }
+
+        // puts back what split_credentials took, the token right after the host
+        std::string add_credentials(const std::string& url,
+                                    const std::string& auth,
+                                    const std::string& token)
+        {
+            if (auth.empty() && token.empty())
+            {
+                return url;
+            }
+            URLHandler handler(url);
+            if (!auth.empty())
+            {
+                auto colon = auth.find(':');
+                handler.set_user(auth.substr(0, colon));
+                if (colon != std::string::npos)
+                {
+                    handler.set_password(auth.substr(colon + 1));
+                }
+            }
+            if (!token.empty())
+            {
+                handler.set_path("/t/" + token + handler.path());
+            }
+            return handler.url();
+        }
+
+        // a mirror as configured: its url without credentials, and its own ones
+        struct MirrorBase
+        {
+            std::string url;
+            std::string auth;
+            std::string token;
+        };
+
+        // the base urls of each mirrored channel: the channel first, then its
+        // mirrors. Resolved again when the setting changes.
+        std::vector<std::vector<MirrorBase>> mirror_base_urls(
+            const std::map<std::string, std::vector<std::string>>& mirrored_channels)
+        {
+            static std::mutex mutex;
+            static std::map<std::string, std::vector<std::string>> resolved_config;
+            static std::vector<std::vector<MirrorBase>> resolved;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (mirrored_channels == resolved_config)
+            {
+                return resolved;
+            }
+
+            resolved.clear();
+            for (const auto& [name, mirrors] : mirrored_channels)
+            {
+                std::vector<MirrorBase> base_urls(1);
+                base_urls[0].url = split_credentials(
+                    make_channel(name).base_url(), base_urls[0].auth, base_urls[0].token);
+                for (const auto& mirror : mirrors)
+                {
+                    MirrorBase base;
+                    base.url = split_credentials(mirror, base.auth, base.token);
+                    if (!base.url.empty()
+                        && std::none_of(base_urls.begin(),
+                                        base_urls.end(),
+                                        [&base](const auto& b) { return b.url == base.url; }))
+                    {
+                        base_urls.push_back(std::move(base));
+                    }
+                }
+                resolved.push_back(std::move(base_urls));
+            }
+            resolved_config = mirrored_channels;
+            return resolved;
+        }
+    }  // namespace
+
+    std::vector<std::string> get_mirror_urls(const std::string& url)
+    {
+        const auto& mirrored_channels = Context::instance().mirrored_channels;
+        if (mirrored_channels.empty())
+        {
+            return {};
+        }
+
+        // the credentials of the url are for its host only, a mirror gets those
+        // configured with it
+        std::string auth, token;
+        std::string cleaned_url = split_credentials(url, auth, token);
+        for (const auto& base_urls : mirror_base_urls(mirrored_channels))
+        {
+            for (const auto& base : base_urls)
+            {
+                if (!base.url.empty() && starts_with(cleaned_url, base.url + "/"))
+                {
+                    std::string path = cleaned_url.substr(base.url.size());
+                    std::vector<std::string> result = { url };
+                    for (const auto& other : base_urls)
+                    {
+                        if (other.url != base.url && !other.url.empty())
+                        {
+                            result.push_back(
+                                add_credentials(other.url + path, other.auth, other.token));
+                        }
+                    }
+                    return result;
+                }
+            }
+        }
+        return {};
+    }
+
     void check_whitelist(const std::vector<std::string>& urls)
     {
         const auto& whitelist = ChannelContext::instance().get_whitelist_channels();
@@ -57,6 +57,20 @@ namespace mamba
         return { platform, "noarch" };
     }
 
+    std::string download_order_str(DownloadOrder order)
+    {
+        switch (order)
+        {
+            case DownloadOrder::kFifo:
+                return "fifo";
+            case DownloadOrder::kLargestFirst:
+                return "largest_first";
+            case DownloadOrder::kCriticalPath:
+                return "critical_path";
+        }
+        return "";
+    }
+
     std::string env_name(const fs::path& prefix)
     {
         if (prefix.empty())
@@ -128,19 +142,39 @@ namespace mamba
                   PRINT_CTX(retry_timeout)
                   PRINT_CTX(retry_backoff)
                   PRINT_CTX(max_retries)
+                  PRINT_CTX(max_retry_after)
                   PRINT_CTX(connect_timeout_secs)
                   PRINT_CTX(add_pip_as_python_dependency)
                   PRINT_CTX(override_channels_enabled)
                   PRINT_CTX(use_only_tar_bz2)
+                  PRINT_CTX(repodata_keep_versions)
+                  PRINT_CTX(repodata_keep_builds)
+                  PRINT_CTX(use_solve_cache)
+                  PRINT_CTX(prune_pool)
                   PRINT_CTX(auto_activate_base)
                   PRINT_CTX(extra_safety_checks)
                   PRINT_CTX(max_parallel_downloads)
+                  PRINT_CTX(use_http2)
+                  PRINT_CTX(mirror_racing)
+                  PRINT_CTX(repodata_max_stale)
+                  PRINT_CTX(repodata_use_patches)
+                  PRINT_CTX(repodata_use_zst)
+                  PRINT_CTX(repodata_use_shards)
+                  << "download_order: " << download_order_str(download_order) << "\n"
+                  PRINT_CTX(segmented_download_threshold)
+                  PRINT_CTX(download_segments)
+                  PRINT_CTX(extract_while_downloading)
                   PRINT_CTX(verbosity)
                   PRINT_CTX(channel_alias)
                   << "channel_priority: " << (int) channel_priority << "\n"
                   PRINT_CTX_VEC(default_channels)
                   PRINT_CTX_VEC(channels)
                   PRINT_CTX_VEC(pinned_packages)
+                  PRINT_CTX_VEC(shared_index_caches)
+                  PRINT_CTX_VEC(repodata_exclude_builds)
+                  PRINT_CTX_VEC(repodata_exclude_licenses)
+                  PRINT_CTX_VEC(repodata_drop_fields)
+                  PRINT_CTX_VEC(solve_portfolio)
                   << "platform: " << platform << "\n"
                   << ">>> END MAMBA CONTEXT <<< \n"
                   << std::endl;
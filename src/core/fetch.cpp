@@ -4,10 +4,26 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <random>
 #include <string_view>
 #include <thread>
 #include <regex>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+#include <zstd.h>
+
 #include "mamba/core/fetch.hpp"
 #include "mamba/core/context.hpp"
 #include "mamba/core/thread_utils.hpp"
@@ -16,6 +32,50 @@
 
 namespace mamba
 {
+    // user-space buffer of the downloaded files
+    static constexpr std::size_t WRITE_BUFFER_SIZE = 256 * 1024;
+    // a mirror that failed is tried again after that time
+    static constexpr std::time_t MIRROR_RECOVERY_SECONDS = 600;
+
+    // host[:port] of a url, empty if it has none or cannot be parsed
+    static std::string url_host(const std::string& url)
+    {
+        try
+        {
+            URLHandler parsed_url(url);
+            std::string host = parsed_url.host();
+            if (!host.empty() && !parsed_url.port().empty())
+            {
+                host += ":" + parsed_url.port();
+            }
+            return host;
+        }
+        catch (const std::runtime_error&)
+        {
+            // curl reports invalid urls when the transfer starts
+            return "";
+        }
+    }
+
+    // the longest Retry-After we wait for
+    static std::size_t max_retry_after()
+    {
+        return std::size_t(std::max(0, Context::instance().max_retry_after));
+    }
+
+    // the connections used by all the transfers
+    static std::size_t connection_budget()
+    {
+        return std::size_t(std::max(1L, Context::instance().max_parallel_downloads));
+    }
+
+    // the most concurrent transfers to a host: one per connection, or
+    // several streams per connection when they are multiplexed
+    static double max_host_transfers()
+    {
+        return connection_budget() * (use_http2() ? MAMBA_HTTP2_STREAMS_PER_CONNECTION : 1);
+    }
+
     void init_curl_ssl()
     {
         auto& ctx = Context::instance();
@@ -133,6 +193,208 @@ namespace mamba
         }
     }
 
+    bool use_http2()
+    {
+        static const bool http2_available
+            = curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2;
+        return Context::instance().use_http2 && http2_available;
+    }
+
+    /**********************************
+     * DownloadSession implementation *
+     **********************************/
+
+    namespace
+    {
+        CURLSH* init_share(void* self,
+                           curl_lock_function lock_callback,
+                           curl_unlock_function unlock_callback)
+        {
+            CURLSH* share = curl_share_init();
+            curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock_callback);
+            curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock_callback);
+            curl_share_setopt(share, CURLSHOPT_USERDATA, self);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            return share;
+        }
+
+        void cleanup_share(CURLSH* share)
+        {
+            if (curl_share_cleanup(share) != CURLSHE_OK)
+            {
+                // some handles are still alive, let the process exit clean it
+                LOG_DEBUG << "cURL share handle still in use at exit";
+            }
+        }
+    }  // namespace
+
+    DownloadSession::DownloadSession()
+    {
+        m_share = init_share(
+            this, &DownloadSession::lock_callback, &DownloadSession::unlock_callback);
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        m_share_no_connections = init_share(
+            this, &DownloadSession::lock_callback, &DownloadSession::unlock_callback);
+    }
+
+    DownloadSession::~DownloadSession()
+    {
+        cleanup_share(m_share);
+        cleanup_share(m_share_no_connections);
+    }
+
+    DownloadSession& DownloadSession::instance()
+    {
+        static DownloadSession session;
+        return session;
+    }
+
+    CURLSH* DownloadSession::share_handle(bool share_connections)
+    {
+        return share_connections ? m_share : m_share_no_connections;
+    }
+
+    void DownloadSession::lock_callback(CURL*, curl_lock_data data, curl_lock_access, void* self)
+    {
+        reinterpret_cast<DownloadSession*>(self)->m_mutexes[data].lock();
+    }
+
+    void DownloadSession::unlock_callback(CURL*, curl_lock_data data, void* self)
+    {
+        reinterpret_cast<DownloadSession*>(self)->m_mutexes[data].unlock();
+    }
+
+    /*******************************
+     * MirrorHealth implementation *
+     *******************************/
+
+    MirrorHealth::MirrorHealth()
+    {
+        const auto& pkgs_dirs = Context::instance().pkgs_dirs;
+        if (pkgs_dirs.empty())
+        {
+            return;
+        }
+        m_path = pkgs_dirs[0] / "cache" / "mirrors.json";
+        if (!fs::exists(m_path))
+        {
+            return;
+        }
+
+        try
+        {
+            std::ifstream health_file(m_path);
+            nlohmann::json health;
+            health_file >> health;
+            for (const auto& [host, entry] : health.items())
+            {
+                auto& h = m_hosts[host];
+                h.latency = entry.value("latency", 0.);
+                h.failures = entry.value("failures", std::size_t(0));
+                h.last_failure = entry.value("last_failure", std::time_t(0));
+            }
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARNING << "Could not read mirror health " << m_path << ": " << e.what();
+            m_hosts.clear();
+        }
+    }
+
+    MirrorHealth& MirrorHealth::instance()
+    {
+        static MirrorHealth health;
+        return health;
+    }
+
+    void MirrorHealth::record_success(const std::string& host, double latency)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto& h = m_hosts[host];
+        // smoothed, a single slow response does not demote a mirror
+        h.latency = h.latency == 0 ? latency : 0.7 * h.latency + 0.3 * latency;
+        h.failures = 0;
+        m_dirty = true;
+    }
+
+    void MirrorHealth::record_failure(const std::string& host)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto& h = m_hosts[host];
+        h.failures++;
+        h.last_failure = std::time(nullptr);
+        m_dirty = true;
+    }
+
+    std::vector<std::string> MirrorHealth::rank(const std::vector<std::string>& urls)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto now = std::time(nullptr);
+
+        std::vector<std::pair<std::pair<bool, double>, std::string>> keyed;
+        for (const auto& url : urls)
+        {
+            bool failing = false;
+            double latency = 0;
+            auto it = m_hosts.find(url_host(url));
+            if (it != m_hosts.end())
+            {
+                failing = it->second.failures > 0
+                          && now - it->second.last_failure < MIRROR_RECOVERY_SECONDS;
+                latency = it->second.latency;
+            }
+            keyed.push_back({ { failing, latency }, url });
+        }
+        std::stable_sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) {
+            return a.first < b.first;
+        });
+
+        std::vector<std::string> result;
+        for (auto& [key, url] : keyed)
+        {
+            result.push_back(std::move(url));
+        }
+        return result;
+    }
+
+    void MirrorHealth::save()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_dirty || m_path.empty())
+        {
+            return;
+        }
+        m_dirty = false;
+
+        nlohmann::json health;
+        for (const auto& [host, h] : m_hosts)
+        {
+            health[host] = { { "latency", h.latency },
+                             { "failures", h.failures },
+                             { "last_failure", h.last_failure } };
+        }
+
+        try
+        {
+            fs::create_directories(m_path.parent_path());
+            fs::path tmp_path = m_path.string() + ".tmp";
+            {
+                std::ofstream health_file(tmp_path);
+                health_file << health.dump(4);
+                if (!health_file)
+                {
+                    throw std::runtime_error("write failed");
+                }
+            }
+            fs::rename(tmp_path, m_path);
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARNING << "Could not write mirror health " << m_path << ": " << e.what();
+        }
+    }
+
     /*********************************
      * DownloadTarget implementation *
      *********************************/
@@ -143,6 +405,7 @@ namespace mamba
         : m_name(name)
         , m_filename(filename)
         , m_url(unc_url(url))
+        , m_host(url_host(m_url))
     {
         m_handle = curl_easy_init();
 
@@ -153,6 +416,7 @@ namespace mamba
     void DownloadTarget::init_curl_handle(CURL* handle, const std::string& url)
     {
         curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(handle, CURLOPT_SHARE, DownloadSession::instance().share_handle());
         curl_easy_setopt(handle, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
         curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
 
@@ -160,11 +424,18 @@ namespace mamba
         // it's just wrong curl_easy_setopt(m_handle, CURLOPT_TIMEOUT,
         // Context::instance().read_timeout_secs);
 
-        // TODO while libcurl in conda now _has_ http2 support we need to fix mamba to
-        // work properly with it this includes:
-        // - setting the cache stuff correctly
-        // - fixing how the progress bar works
-        curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+        if (use_http2())
+        {
+            // HTTP/2 is only negotiated over TLS (plain http:// stays on HTTP/1.1), and
+            // PIPEWAIT makes new transfers wait for an existing connection to the host
+            // to be multiplexed on instead of opening a new one
+            curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+            curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+        }
+        else
+        {
+            curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+        }
 
         // if the request is slower than 30b/s for 60 seconds, cancel.
         curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, 60L);
@@ -212,6 +483,8 @@ namespace mamba
         init_curl_handle(m_handle, url);
 
         curl_easy_setopt(m_handle, CURLOPT_ERRORBUFFER, m_errbuf);
+        // lets the multi handle map a finished transfer back to its target in O(1)
+        curl_easy_setopt(m_handle, CURLOPT_PRIVATE, this);
 
         curl_easy_setopt(m_handle, CURLOPT_HEADERFUNCTION, &DownloadTarget::header_callback);
         curl_easy_setopt(m_handle, CURLOPT_HEADERDATA, this);
@@ -219,6 +492,7 @@ namespace mamba
         curl_easy_setopt(m_handle, CURLOPT_WRITEFUNCTION, &DownloadTarget::write_callback);
         curl_easy_setopt(m_handle, CURLOPT_WRITEDATA, this);
 
+        curl_slist_free_all(m_headers);
         m_headers = nullptr;
         if (ends_with(url, ".json"))
         {
@@ -232,8 +506,22 @@ namespace mamba
 
     bool DownloadTarget::can_retry()
     {
-        return m_retries < size_t(Context::instance().max_retries) && http_status >= 500
-               && !starts_with(m_url, "file://");
+        // a failed segmented download is tried once more in one piece, a
+        // fallback url right away
+        if (m_segments_failed || m_fall_back)
+        {
+            return true;
+        }
+        if (m_retries >= size_t(Context::instance().max_retries))
+        {
+            return false;
+        }
+        // another mirror may have the file, or be up
+        if (http_status >= 400 && has_untried_mirror())
+        {
+            return true;
+        }
+        return (http_status >= 500 || http_status == 429) && !starts_with(m_url, "file://");
     }
 
     CURL* DownloadTarget::retry()
@@ -241,11 +529,38 @@ namespace mamba
         auto now = std::chrono::steady_clock::now();
         if (now >= m_next_retry)
         {
-            if (fs::exists(m_filename))
+            close_file();
+            m_segments_failed = false;
+            m_fall_back = false;
+            m_decompressing = false;
+            m_zstd_pending = 0;
+            if (m_segment_parent)
             {
-                fs::remove(m_filename);
+                // continue after the data of the segment that is already there
+                m_resume_from = m_file_size;
+            }
+            else if (m_resumable && fs::exists(m_filename) && fs::exists(resume_state_path())
+                     && can_resume_from(fs::file_size(m_filename)))
+            {
+                m_resume_from = fs::file_size(m_filename);
+                LOG_INFO << "Resuming download of " << m_name << " from byte " << m_resume_from;
+            }
+            else
+            {
+                if (fs::exists(m_filename))
+                {
+                    fs::remove(m_filename);
+                }
+                m_resume_from = 0;
             }
+            m_retry_after = 0;
+            select_mirror();
             init_curl_target(m_url);
+            if (!m_mod_etag.empty())
+            {
+                set_mod_etag_headers(m_mod_etag);
+            }
+            set_resume_options();
             if (m_has_progress_bar)
             {
                 curl_easy_setopt(
@@ -263,55 +578,186 @@ namespace mamba
         }
     }
 
+    std::chrono::steady_clock::time_point DownloadTarget::next_retry() const
+    {
+        return m_next_retry;
+    }
+
+    std::size_t DownloadTarget::retry_after() const
+    {
+        return std::min(m_retry_after, max_retry_after());
+    }
+
+    void DownloadTarget::schedule_next_retry()
+    {
+        using namespace std::chrono;
+        auto now = steady_clock::now();
+        if (has_untried_mirror())
+        {
+            // fail over right away
+            m_next_retry = now;
+            return;
+        }
+        if (m_retry_after > 0)
+        {
+            m_next_retry = now + seconds(retry_after());
+            return;
+        }
+
+        // jitter, so that the transfers that failed together don't all
+        // come back to the server at the same time
+        static thread_local std::mt19937 generator{ std::random_device{}() };
+        std::uniform_real_distribution<double> jitter(0.5, 1.5);
+        m_next_retry = now
+                       + duration_cast<steady_clock::duration>(
+                           duration<double>(m_retry_wait_seconds * jitter(generator)));
+    }
+
     DownloadTarget::~DownloadTarget()
     {
+        close_file();
         curl_easy_cleanup(m_handle);
         curl_slist_free_all(m_headers);
+        ZSTD_freeDStream(m_zstd_stream);
     }
 
     size_t DownloadTarget::write_callback(char* ptr, size_t size, size_t nmemb, void* self)
     {
         auto* s = reinterpret_cast<DownloadTarget*>(self);
-        if (!s->m_file.is_open())
+        if (!s->m_file)
         {
-            s->m_file = std::ofstream(s->m_filename, std::ios::binary);
-            if (!s->m_file)
+            long status = 0;
+            curl_easy_getinfo(s->m_handle, CURLINFO_RESPONSE_CODE, &status);
+            // never let an error page end up in the partial file we resume from
+            if ((s->m_resumable || s->m_segment_parent) && status >= 400)
+            {
+                return size * nmemb;
+            }
+
+            if (s->m_segment_parent)
+            {
+                if (!s->open_segment_file(status))
+                {
+                    // aborts the transfer
+                    return 0;
+                }
+            }
+            else
             {
-                LOG_ERROR << "Could not open file for download " << s->m_filename << ": "
-                          << strerror(errno);
-                exit(1);
+                if (s->m_resume_from > 0 && status == 200)
+                {
+                    // the server ignored the range or the file changed (If-Range)
+                    LOG_INFO << "Server sent the full file, restarting download of "
+                             << s->m_name;
+                    s->m_resume_from = 0;
+                }
+
+                if (!s->open_file(s->m_resume_from > 0))
+                {
+                    LOG_ERROR << "Could not open file for download " << s->m_filename << ": "
+                              << strerror(errno);
+                    exit(1);
+                }
+                if (s->m_resumable)
+                {
+                    s->write_resume_state();
+                }
+                // error pages are not compressed
+                s->m_decompressing = s->m_zstd_stream && status < 400;
+                if (s->m_decompressing)
+                {
+                    ZSTD_DCtx_reset(s->m_zstd_stream, ZSTD_reset_session_only);
+                }
             }
         }
 
-        s->m_file.write(ptr, size * nmemb);
+        std::size_t offset = s->m_segment_begin + s->m_file_size;
+        bool written = s->m_decompressing ? s->write_decompressed(ptr, size * nmemb)
+                                          : s->write_data(ptr, size * nmemb);
+        if (!written)
+        {
+            // aborts the transfer
+            return 0;
+        }
 
-        if (!s->m_file)
+        if (s->m_segment_parent)
         {
-            LOG_ERROR << "Could not write to file " << s->m_filename << ": " << strerror(errno);
-            exit(1);
+            s->m_segment_parent->segment_written(s, offset, ptr, size * nmemb);
+        }
+        if (s->m_write_observer && s->m_file_size - s->m_reported_size >= WRITE_BUFFER_SIZE)
+        {
+            std::fflush(s->m_file);
+            s->m_reported_size = s->m_file_size;
+            s->m_write_observer(s->m_reported_size);
         }
         return size * nmemb;
     }
 
+    bool DownloadTarget::write_data(const char* data, std::size_t size)
+    {
+        if (std::fwrite(data, 1, size, m_file) != size)
+        {
+            LOG_ERROR << "Could not write to file " << m_filename << ": " << strerror(errno);
+            exit(1);
+        }
+
+        if (m_sha256_hasher)
+        {
+            m_sha256_hasher->update(data, size);
+        }
+        if (m_md5_hasher)
+        {
+            m_md5_hasher->update(data, size);
+        }
+
+        m_file_size += size;
+        return true;
+    }
+
+    bool DownloadTarget::write_decompressed(const char* data, std::size_t size)
+    {
+        ZSTD_inBuffer input = { data, size, 0 };
+        while (input.pos < input.size)
+        {
+            ZSTD_outBuffer output = { m_zstd_buffer.get(), ZSTD_DStreamOutSize(), 0 };
+            m_zstd_pending = ZSTD_decompressStream(m_zstd_stream, &output, &input);
+            if (ZSTD_isError(m_zstd_pending))
+            {
+                LOG_WARNING << "Could not decompress " << m_url << ": "
+                            << ZSTD_getErrorName(m_zstd_pending);
+                return false;
+            }
+            write_data(static_cast<const char*>(output.dst), output.pos);
+        }
+        return true;
+    }
+
     size_t DownloadTarget::header_callback(char* buffer, size_t size, size_t nitems, void* self)
     {
         auto* s = reinterpret_cast<DownloadTarget*>(self);
 
         std::string_view header(buffer, size * nitems);
+
+        // A status line starts the headers of a new response (after a redirect, or
+        // an upgrade to HTTP/2), forget what the previous response told us so that
+        // we never store the cache headers of an intermediate hop
+        if (starts_with(header, "HTTP/"))
+        {
+            s->etag.clear();
+            s->mod.clear();
+            s->cache_control.clear();
+            s->m_retry_after = 0;
+            return nitems * size;
+        }
+
         auto colon_idx = header.find(':');
         if (colon_idx != std::string_view::npos)
         {
             std::string_view key, value;
             key = header.substr(0, colon_idx);
-            colon_idx++;
-            // remove spaces
-            while (std::isspace(header[colon_idx]))
-            {
-                ++colon_idx;
-            }
-
-            // remove \r\n header ending
-            value = header.substr(colon_idx, header.size() - colon_idx - 2);
+            // remove surrounding spaces and the line ending, which is not
+            // guaranteed to be \r\n for HTTP/2 responses
+            value = strip(header.substr(colon_idx + 1));
             // http headers are case insensitive!
             std::string lkey = to_lower(key);
             if (lkey == "etag")
@@ -326,6 +772,27 @@ namespace mamba
             {
                 s->mod = value;
             }
+            else if (lkey == "retry-after")
+            {
+                // either a number of seconds or an HTTP date
+                std::string retry_after(value);
+                if (!retry_after.empty()
+                    && std::all_of(retry_after.begin(), retry_after.end(), [](char c) {
+                           return std::isdigit(static_cast<unsigned char>(c));
+                       }))
+                {
+                    // ULLONG_MAX when out of range, never throw through curl
+                    unsigned long long seconds = std::strtoull(retry_after.c_str(), nullptr, 10);
+                    s->m_retry_after = std::size_t(std::min<unsigned long long>(
+                        seconds, std::numeric_limits<std::size_t>::max()));
+                }
+                else
+                {
+                    std::time_t date = curl_getdate(retry_after.c_str(), nullptr);
+                    std::time_t now = std::time(nullptr);
+                    s->m_retry_after = date > now ? std::size_t(date - now) : 0;
+                }
+            }
         }
         return nitems * size;
     }
@@ -345,12 +812,28 @@ namespace mamba
         }
         m_progress_throttle_time = now;
 
+        // curl only counts the bytes of the current range request
+        if (m_resume_from > 0)
+        {
+            now_downloaded += m_resume_from;
+            if (total_to_download != 0)
+            {
+                total_to_download += m_resume_from;
+            }
+        }
+
         if (total_to_download != 0 && now_downloaded == 0 && m_expected_size != 0)
         {
             now_downloaded = total_to_download;
             total_to_download = m_expected_size;
         }
 
+        // HTTP/2 servers commonly omit the Content-Length header
+        if (total_to_download == 0 && m_expected_size != 0)
+        {
+            total_to_download = m_expected_size;
+        }
+
         if ((total_to_download != 0 || m_expected_size != 0) && now_downloaded != 0)
         {
             std::stringstream postfix;
@@ -366,6 +849,16 @@ namespace mamba
             m_progress_bar.set_progress(now_downloaded, total_to_download);
             m_progress_bar.set_postfix(postfix.str());
         }
+        if (now_downloaded != 0 && total_to_download == 0)
+        {
+            std::stringstream postfix;
+            to_human_readable_filesize(postfix, now_downloaded);
+            postfix << " / ?? (";
+            to_human_readable_filesize(postfix, get_speed(), 2);
+            postfix << "/s)";
+            m_progress_bar.set_progress(SIZE_MAX, SIZE_MAX);
+            m_progress_bar.set_postfix(postfix.str());
+        }
         if (now_downloaded == 0 && total_to_download != 0)
         {
             std::stringstream postfix;
@@ -381,6 +874,8 @@ namespace mamba
 
     void DownloadTarget::set_mod_etag_headers(const nlohmann::json& mod_etag)
     {
+        m_mod_etag = mod_etag;
+
         auto to_header = [](const std::string& key, const std::string& value) {
             return std::string(key + ": " + value);
         };
@@ -395,6 +890,23 @@ namespace mamba
             m_headers = curl_slist_append(m_headers,
                                           to_header("If-Modified-Since", mod_etag["_mod"]).c_str());
         }
+        curl_easy_setopt(m_handle, CURLOPT_HTTPHEADER, m_headers);
+    }
+
+    void DownloadTarget::set_zstd_decompression(bool yes)
+    {
+        if (yes && !m_zstd_stream)
+        {
+            m_zstd_stream = ZSTD_createDStream();
+            m_zstd_buffer.reset(new char[ZSTD_DStreamOutSize()]);
+        }
+        else if (!yes && m_zstd_stream)
+        {
+            ZSTD_freeDStream(m_zstd_stream);
+            m_zstd_stream = nullptr;
+            m_zstd_buffer.reset();
+        }
+        m_zstd_pending = 0;
     }
 
     void DownloadTarget::set_progress_bar(ProgressProxy progress_proxy)
@@ -411,165 +923,1476 @@ namespace mamba
         m_expected_size = size;
     }
 
-    const std::string& DownloadTarget::name() const
+    void DownloadTarget::compute_checksums(bool sha256, bool md5)
     {
-        return m_name;
+        m_sha256_hasher.reset(sha256 ? new validate::Hasher(validate::Hasher::Algorithm::sha256)
+                                     : nullptr);
+        m_md5_hasher.reset(md5 ? new validate::Hasher(validate::Hasher::Algorithm::md5) : nullptr);
     }
 
-    static size_t discard(char* ptr, size_t size, size_t nmemb, void*)
+    void DownloadTarget::set_write_observer(std::function<void(std::size_t)> observer)
     {
-        return size * nmemb;
+        m_write_observer = std::move(observer);
     }
 
-
-    bool DownloadTarget::resource_exists()
+    bool DownloadTarget::open_file(bool append)
     {
-        auto handle = curl_easy_init();
+        // a previous attempt may have been read up to any size, even if the
+        // last one did not report anything: start the observer over whenever
+        // the file does
+        if (!append && m_write_observer)
+        {
+            m_write_observer(0);
+        }
+        m_reported_size = 0;
 
-        init_curl_ssl();
-        init_curl_handle(handle, m_url);
+        m_file = std::fopen(m_filename.c_str(), append ? "ab" : "wb");
+        if (!m_file)
+        {
+            return false;
+        }
+        if (!append && fs::exists(segments_state_path()))
+        {
+            // the file is not that of an earlier segmented download anymore
+            fs::remove(segments_state_path());
+        }
+        m_file_size = append ? std::size_t(m_resume_from) : 0;
 
-        curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
-        curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
-        if (curl_easy_perform(handle) == CURLE_OK)
-            return true;
+        // fewer, larger writes than the default stdio buffer
+        m_file_buffer.reset(new char[WRITE_BUFFER_SIZE]);
+        std::setvbuf(m_file, m_file_buffer.get(), _IOFBF, WRITE_BUFFER_SIZE);
 
-        // Some servers don't support HEAD, try a GET if the HEAD fails
-        curl_easy_setopt(handle, CURLOPT_NOBODY, 0L);
-        // Prevent output of data
-        curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &discard);
+#ifdef __linux__
+        // reserve the space upfront to limit fragmentation, KEEP_SIZE so that the
+        // size of a partial file remains the number of bytes actually downloaded.
+        // Not all filesystems support it, this is only a hint.
+        if (m_expected_size > std::size_t(m_resume_from))
+        {
+            fallocate(fileno(m_file),
+                      FALLOC_FL_KEEP_SIZE,
+                      m_resume_from,
+                      m_expected_size - std::size_t(m_resume_from));
+        }
+#endif
+
+        for (auto* hasher : { m_sha256_hasher.get(), m_md5_hasher.get() })
+        {
+            if (hasher)
+            {
+                hasher->reset();
+            }
+        }
+        if (append && (m_sha256_hasher || m_md5_hasher))
+        {
+            // the checksums cover the whole file, including what a previous
+            // attempt already downloaded
+            std::ifstream partial(m_filename, std::ios::binary);
+            std::vector<char> buffer(32768);
+            while (partial)
+            {
+                partial.read(buffer.data(), buffer.size());
+                std::size_t count = partial.gcount();
+                if (m_sha256_hasher)
+                {
+                    m_sha256_hasher->update(buffer.data(), count);
+                }
+                if (m_md5_hasher)
+                {
+                    m_md5_hasher->update(buffer.data(), count);
+                }
+            }
+        }
+        return true;
+    }
+
+    bool DownloadTarget::close_file()
+    {
+        if (!m_file)
+        {
+            return true;
+        }
+        bool success = std::fclose(m_file) == 0;
+        m_file = nullptr;
+        m_file_buffer.reset();
+        return success;
+    }
+
+    fs::path DownloadTarget::resume_state_path() const
+    {
+        return m_filename + MAMBA_RESUME_STATE_SUFFIX;
+    }
+
+    void DownloadTarget::set_resumable(bool yes)
+    {
+        m_resumable = yes;
+        m_resume_from = 0;
+        if (!m_resumable)
+        {
+            return;
+        }
+
+        auto state_path = resume_state_path();
+        if (fs::exists(m_filename) && fs::exists(state_path))
+        {
+            try
+            {
+                std::ifstream state_file(state_path);
+                nlohmann::json state;
+                state_file >> state;
+
+                // only resume the very same file, partial data of another build
+                // of the package is useless
+                auto size = fs::file_size(m_filename);
+                if (state.value("url", "") == origin_url()
+                    && state.value("expected_size", std::size_t(0)) == m_expected_size
+                    && can_resume_from(size))
+                {
+                    m_resume_from = size;
+                    m_resume_etag = state.value("etag", "");
+                    m_resume_mod = state.value("mod", "");
+                    m_resume_url = state.value("validator_url", "");
+                    LOG_INFO << "Resuming download of " << m_name << " from byte "
+                             << m_resume_from;
+                }
+            }
+            catch (const std::exception& e)
+            {
+                LOG_WARNING << "Could not read download state " << state_path << ": "
+                            << e.what();
+            }
+        }
+
+        if (m_resume_from == 0 && fs::exists(state_path))
+        {
+            fs::remove(state_path);
+        }
+        set_resume_options();
+    }
+
+    bool DownloadTarget::can_resume_from(std::size_t size) const
+    {
+        // a file of the expected size or more is not a partial download of it
+        return size > 0 && (m_expected_size == 0 || size < m_expected_size);
+    }
+
+    void DownloadTarget::set_resume_options()
+    {
+        if (m_segment_parent)
+        {
+            std::string range = std::to_string(m_segment_begin + m_resume_from) + "-"
+                                 + std::to_string(m_segment_end);
+            curl_easy_setopt(m_handle, CURLOPT_RANGE, range.c_str());
+            // the parts already on disk must be of the same file. The validators
+            // of another mirror differ even for the same file, the segments sent
+            // there rely on the checksum of the whole file instead.
+            std::string validator = m_segment_parent->m_resume_etag;
+            if (validator.empty() || starts_with(validator, "W/"))
+            {
+                validator = m_segment_parent->m_resume_mod;
+            }
+            if (!validator.empty() && m_url == m_segment_parent->m_resume_url)
+            {
+                m_headers = curl_slist_append(m_headers, ("If-Range: " + validator).c_str());
+                curl_easy_setopt(m_handle, CURLOPT_HTTPHEADER, m_headers);
+            }
+            // one connection per segment, multiplexed over HTTP/2 they would
+            // share the throughput of a single one
+            curl_easy_setopt(m_handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+            curl_easy_setopt(m_handle, CURLOPT_PIPEWAIT, 0L);
+            return;
+        }
+
+        // unlike CURLOPT_RESUME_FROM, a range still accepts a full 200 response
+        if (m_resume_from == 0)
+        {
+            curl_easy_setopt(m_handle, CURLOPT_RANGE, nullptr);
+            return;
+        }
+        curl_easy_setopt(m_handle, CURLOPT_RANGE, (std::to_string(m_resume_from) + "-").c_str());
+
+        // If-Range makes the server send the whole file instead of a range
+        // when it changed since the partial data was downloaded. Weak
+        // etags are not allowed there, fall back to the modification date.
+        std::string validator = m_resume_etag;
+        if (validator.empty() || starts_with(validator, "W/"))
+        {
+            validator = m_resume_mod;
+        }
+        if (!validator.empty())
+        {
+            m_headers = curl_slist_append(m_headers, ("If-Range: " + validator).c_str());
+            curl_easy_setopt(m_handle, CURLOPT_HTTPHEADER, m_headers);
+        }
+    }
+
+    void DownloadTarget::write_resume_state()
+    {
+        // a 206 response carries the validators of the file we already have
+        // part of, a 200 response those of the new file
+        m_resume_etag = etag;
+        m_resume_mod = mod;
+        m_resume_url = m_url;
+
+        nlohmann::json state;
+        state["url"] = origin_url();
+        state["expected_size"] = m_expected_size;
+        state["etag"] = m_resume_etag;
+        state["mod"] = m_resume_mod;
+        state["validator_url"] = m_resume_url;
+
+        std::ofstream state_file(resume_state_path());
+        state_file << state.dump(4);
+        if (!state_file)
+        {
+            LOG_WARNING << "Could not write download state " << resume_state_path();
+        }
+    }
+
+    void DownloadTarget::set_priority(std::size_t priority)
+    {
+        m_priority = priority;
+    }
+
+    std::size_t DownloadTarget::priority() const
+    {
+        return m_priority;
+    }
+
+    void DownloadTarget::set_mirrors(const std::vector<std::string>& urls)
+    {
+        m_mirrors = { m_url };
+        for (const auto& url : urls)
+        {
+            std::string mirror = unc_url(url);
+            if (std::find(m_mirrors.begin(), m_mirrors.end(), mirror) == m_mirrors.end())
+            {
+                m_mirrors.push_back(mirror);
+            }
+        }
+        if (m_mirrors.size() < 2)
+        {
+            m_mirrors.clear();
+        }
+        select_mirror();
+    }
+
+    void DownloadTarget::select_mirror()
+    {
+        if (m_mirrors.empty())
+        {
+            return;
+        }
+        // segments are spread over the mirrors, they only move away from a failed one
+        if (m_segment_parent
+            && std::find(m_failed_mirrors.begin(), m_failed_mirrors.end(), m_url)
+                   == m_failed_mirrors.end())
+        {
+            return;
+        }
+
+        std::vector<std::string> candidates;
+        for (const auto& mirror : m_mirrors)
+        {
+            if (std::find(m_failed_mirrors.begin(), m_failed_mirrors.end(), mirror)
+                == m_failed_mirrors.end())
+            {
+                candidates.push_back(mirror);
+            }
+        }
+        if (candidates.empty())
+        {
+            // all of them failed once, start over
+            m_failed_mirrors.clear();
+            candidates = m_mirrors;
+        }
+
+        std::string best = MirrorHealth::instance().rank(candidates).front();
+        if (best != m_url)
+        {
+            LOG_INFO << "Using mirror " << best << " for " << m_name;
+            m_url = best;
+            m_host = url_host(m_url);
+            curl_easy_setopt(m_handle, CURLOPT_URL, m_url.c_str());
+        }
+    }
+
+    void DownloadTarget::fall_back_to(const std::string& url)
+    {
+        LOG_INFO << "Falling back to " << url << " for " << m_name;
+        m_url = unc_url(url);
+        m_host = url_host(m_url);
+        m_mirrors.clear();
+        m_failed_mirrors.clear();
+        m_fall_back = true;
+        m_next_retry = std::chrono::steady_clock::now();
+    }
+
+    const std::string& DownloadTarget::origin_url() const
+    {
+        return m_mirrors.empty() ? m_url : m_mirrors.front();
+    }
+
+    bool DownloadTarget::has_untried_mirror() const
+    {
+        return std::any_of(m_mirrors.begin(), m_mirrors.end(), [&](const std::string& mirror) {
+            return mirror != m_url
+                   && std::find(m_failed_mirrors.begin(), m_failed_mirrors.end(), mirror)
+                          == m_failed_mirrors.end();
+        });
+    }
+
+    void DownloadTarget::record_mirror_result(bool success)
+    {
+        // local mirrors are not worth remembering
+        if (m_mirrors.empty() || m_host.empty())
+        {
+            if (!success && !m_mirrors.empty())
+            {
+                m_failed_mirrors.push_back(m_url);
+            }
+            return;
+        }
+
+        if (success)
+        {
+            curl_off_t latency = 0;
+            curl_easy_getinfo(m_handle, CURLINFO_STARTTRANSFER_TIME_T, &latency);
+            MirrorHealth::instance().record_success(m_host, latency / 1e6);
+        }
+        else
+        {
+            MirrorHealth::instance().record_failure(m_host);
+            m_failed_mirrors.push_back(m_url);
+        }
+    }
+
+    void DownloadTarget::set_race_mirrors(bool yes)
+    {
+        m_race_mirrors = yes;
+    }
+
+    DownloadTarget* DownloadTarget::start_race()
+    {
+        // the racer only writes the body to its own file, nothing else
+        if (!m_race_mirrors || m_mirrors.empty() || m_resumable || m_write_observer
+            || m_sha256_hasher || m_md5_hasher)
+        {
+            return nullptr;
+        }
+
+        std::string other;
+        for (const auto& mirror : MirrorHealth::instance().rank(m_mirrors))
+        {
+            if (mirror != m_url
+                && std::find(m_failed_mirrors.begin(), m_failed_mirrors.end(), mirror)
+                       == m_failed_mirrors.end())
+            {
+                other = mirror;
+                break;
+            }
+        }
+        if (other.empty())
+        {
+            return nullptr;
+        }
+
+        LOG_INFO << "Requesting " << m_name << " from " << m_url << " and " << other;
+        m_racer = std::make_unique<DownloadTarget>(m_name, other, m_filename + ".race");
+        m_racer->m_race_primary = this;
+        m_racer->set_mod_etag_headers(m_mod_etag);
+        m_racer->set_zstd_decompression(m_zstd_stream != nullptr);
+        return m_racer.get();
+    }
+
+    void DownloadTarget::end_race(bool adopt_racer)
+    {
+        if (!m_racer)
+        {
+            return;
+        }
+
+        const std::string& race_file = m_racer->m_filename;
+        if (!adopt_racer)
+        {
+            m_racer->close_file();
+            if (fs::exists(race_file))
+            {
+                fs::remove(race_file);
+            }
+            m_racer.reset();
+            return;
+        }
+
+        close_file();
+        if (!m_racer->close_file())
+        {
+            throw std::runtime_error("Could not write to file " + race_file + ": "
+                                     + strerror(errno));
+        }
+        if (fs::exists(race_file))
+        {
+            fs::rename(race_file, m_filename);
+        }
+        else if (fs::exists(m_filename))
+        {
+            // no body (e.g. 304), don't keep what we received so far
+            fs::remove(m_filename);
+        }
+
+        // finalize() reads the response from the handle
+        std::swap(m_handle, m_racer->m_handle);
+        std::swap(m_headers, m_racer->m_headers);
+        std::copy(std::begin(m_racer->m_errbuf), std::end(m_racer->m_errbuf), m_errbuf);
+        curl_easy_setopt(m_handle, CURLOPT_ERRORBUFFER, m_errbuf);
+        curl_easy_setopt(m_handle, CURLOPT_PRIVATE, this);
+
+        m_url = m_racer->m_url;
+        m_host = m_racer->m_host;
+        m_file_size = m_racer->m_file_size;
+        m_zstd_pending = m_racer->m_zstd_pending;
+        m_retry_after = m_racer->m_retry_after;
+        etag = m_racer->etag;
+        mod = m_racer->mod;
+        cache_control = m_racer->cache_control;
+        m_racer.reset();
+    }
+
+    DownloadTarget* DownloadTarget::racer() const
+    {
+        return m_racer.get();
+    }
+
+    DownloadTarget* DownloadTarget::race_primary() const
+    {
+        return m_race_primary;
+    }
+
+    fs::path DownloadTarget::segments_state_path() const
+    {
+        return m_filename + MAMBA_SEGMENTS_STATE_SUFFIX;
+    }
+
+    std::vector<DownloadTarget*> DownloadTarget::split()
+    {
+        const auto& ctx = Context::instance();
+        if (m_split_done || m_segment_parent || ctx.segmented_download_threshold == 0
+            || ctx.download_segments < 2 || m_expected_size < ctx.segmented_download_threshold
+            || starts_with(m_url, "file://") || m_zstd_stream)
+        {
+            return {};
+        }
+        m_split_done = true;
+
+        // begin, inclusive end and bytes on disk of each segment
+        std::vector<std::array<std::size_t, 3>> ranges;
+        auto state_path = segments_state_path();
+        if (fs::exists(state_path) && fs::exists(m_filename)
+            && fs::file_size(m_filename) == m_expected_size)
+        {
+            try
+            {
+                std::ifstream state_file(state_path);
+                nlohmann::json state;
+                state_file >> state;
+                if (state.at("url") == origin_url()
+                    && state.at("expected_size") == m_expected_size)
+                {
+                    std::size_t next = 0;
+                    bool complete = true;
+                    for (const auto& range : state.at("segments"))
+                    {
+                        std::array<std::size_t, 3> r = range;
+                        if (r[0] != next || r[1] < r[0] || r[2] > r[1] - r[0] + 1)
+                        {
+                            throw std::runtime_error("invalid ranges");
+                        }
+                        complete = complete && r[2] == r[1] - r[0] + 1;
+                        next = r[1] + 1;
+                        ranges.push_back(r);
+                    }
+                    if (next != m_expected_size || complete)
+                    {
+                        ranges.clear();
+                    }
+                    m_resume_etag = state.value("etag", "");
+                    m_resume_mod = state.value("mod", "");
+                    m_resume_url = state.value("validator_url", "");
+                }
+            }
+            catch (const std::exception& e)
+            {
+                LOG_WARNING << "Could not read download state " << state_path << ": "
+                            << e.what();
+                ranges.clear();
+            }
+        }
+        if (ranges.empty())
+        {
+            // what a single stream download left is the start of the first segments
+            std::size_t count = static_cast<std::size_t>(ctx.download_segments);
+            std::size_t length = (m_expected_size + count - 1) / count;
+            std::size_t resume_from = std::size_t(m_resume_from);
+            for (std::size_t begin = 0; begin < m_expected_size; begin += length)
+            {
+                std::size_t end = std::min(m_expected_size, begin + length) - 1;
+                std::size_t written = resume_from > begin ? resume_from - begin : 0;
+                ranges.push_back({ begin, end, std::min(written, end - begin + 1) });
+            }
+        }
+
+        // the segments are written in place, keeping what is already there
+        std::FILE* file = std::fopen(m_filename.c_str(), fs::exists(m_filename) ? "r+b" : "wb");
+        if (!file)
+        {
+            LOG_WARNING << "Could not create " << m_filename << ": " << strerror(errno);
+            return {};
+        }
+#ifdef __linux__
+        // only a hint, not all filesystems support it
+        fallocate(fileno(file), 0, 0, m_expected_size);
+#endif
+        std::fclose(file);
+        fs::resize_file(m_filename, m_expected_size);
+
+        // the state of the segments replaces that of a single stream download
+        m_resume_from = 0;
+        if (fs::exists(resume_state_path()))
+        {
+            fs::remove(resume_state_path());
+        }
+
+        std::vector<std::string> urls = { m_url };
+        if (!m_mirrors.empty())
+        {
+            urls = MirrorHealth::instance().rank(m_mirrors);
+        }
+
+        std::vector<DownloadTarget*> segments;
+        m_segments_finished = 0;
+        for (std::size_t i = 0; i < ranges.size(); ++i)
+        {
+            auto segment = std::make_unique<DownloadTarget>(
+                m_name + " (segment " + std::to_string(i + 1) + ")",
+                urls[i % urls.size()],
+                m_filename);
+            segment->m_segment_parent = this;
+            segment->m_segment_begin = ranges[i][0];
+            segment->m_segment_end = ranges[i][1];
+            segment->m_resume_from = ranges[i][2];
+            segment->m_file_size = ranges[i][2];
+            segment->m_mirrors = m_mirrors;
+            segment->m_priority = m_priority;
+            segment->set_ignore_failure(true);
+            if (segment->m_file_size == ranges[i][1] - ranges[i][0] + 1)
+            {
+                segment->http_status = 206;
+                ++m_segments_finished;
+            }
+            else
+            {
+                segment->set_resume_options();
+                segments.push_back(segment.get());
+            }
+            m_segments.push_back(std::move(segment));
+        }
+
+        // what is already there is hashed once, the rest as it arrives
+        for (auto* hasher : { m_sha256_hasher.get(), m_md5_hasher.get() })
+        {
+            if (hasher)
+            {
+                hasher->reset();
+            }
+        }
+        m_prefix_size = 0;
+        advance_prefix();
+        write_segments_state();
+
+        LOG_INFO << "Downloading " << m_name << " in " << m_segments.size() << " segments, "
+                 << segments.size() << " left";
+        return segments;
+    }
+
+    void DownloadTarget::write_segments_state()
+    {
+        nlohmann::json state;
+        state["url"] = origin_url();
+        state["expected_size"] = m_expected_size;
+        state["etag"] = m_resume_etag;
+        state["mod"] = m_resume_mod;
+        state["validator_url"] = m_resume_url;
+        state["segments"] = nlohmann::json::array();
+        for (const auto& segment : m_segments)
+        {
+            // only count what is on disk
+            if (segment->m_file)
+            {
+                std::fflush(segment->m_file);
+            }
+            std::size_t length = segment->m_segment_end - segment->m_segment_begin + 1;
+            state["segments"].push_back({ segment->m_segment_begin,
+                                          segment->m_segment_end,
+                                          std::min(segment->m_file_size, length) });
+        }
+        m_segments_state_time = std::chrono::steady_clock::now();
+
+        std::ofstream state_file(segments_state_path());
+        state_file << state.dump();
+        if (!state_file)
+        {
+            LOG_WARNING << "Could not write download state " << segments_state_path();
+        }
+    }
+
+    DownloadTarget* DownloadTarget::segment_parent() const
+    {
+        return m_segment_parent;
+    }
+
+    bool DownloadTarget::segment_finished()
+    {
+        advance_prefix();
+        write_segments_state();
+        return ++m_segments_finished == m_segments.size();
+    }
+
+    bool DownloadTarget::own_connection() const
+    {
+        // one connection per segment, see set_resume_options
+        return m_segment_parent || !use_http2() || !starts_with(m_url, "https://");
+    }
+
+    bool DownloadTarget::open_segment_file(long status)
+    {
+        std::size_t offset = m_segment_begin + std::size_t(m_resume_from);
+        // a full response only fits the segment at the start of the file
+        if (status != 206 && offset > 0)
+        {
+            LOG_INFO << "No range in the response for " << m_name;
+            // not worth a retry on that server
+            http_status = status;
+            return false;
+        }
+
+        m_file = std::fopen(m_filename.c_str(), "r+b");
+        if (!m_file)
+        {
+            LOG_ERROR << "Could not open file for download " << m_filename << ": "
+                      << strerror(errno);
+            return false;
+        }
+#ifdef _WIN32
+        int seek_failed = _fseeki64(m_file, offset, SEEK_SET);
+#else
+        int seek_failed = fseeko(m_file, offset, SEEK_SET);
+#endif
+        if (seek_failed)
+        {
+            LOG_ERROR << "Could not seek in " << m_filename << ": " << strerror(errno);
+            close_file();
+            return false;
+        }
+        m_file_size = std::size_t(m_resume_from);
+
+        m_file_buffer.reset(new char[WRITE_BUFFER_SIZE]);
+        std::setvbuf(m_file, m_file_buffer.get(), _IOFBF, WRITE_BUFFER_SIZE);
+
+        // all the segments must be of the file of the first response
+        DownloadTarget* parent = m_segment_parent;
+        if (parent->m_resume_etag.empty() && parent->m_resume_mod.empty())
+        {
+            parent->m_resume_etag = etag;
+            parent->m_resume_mod = mod;
+            parent->m_resume_url = m_url;
+        }
+        return true;
+    }
+
+    void DownloadTarget::segment_written(DownloadTarget* segment,
+                                         std::size_t offset,
+                                         const char* data,
+                                         std::size_t size)
+    {
+        // data that extends the start of the file is hashed right away, the
+        // segments after it are read back once the ones before are complete
+        if (offset <= m_prefix_size && offset + size > m_prefix_size)
+        {
+            std::size_t skip = m_prefix_size - offset;
+            hash_prefix(data + skip, size - skip);
+            if (m_write_observer && m_prefix_size - m_reported_size >= WRITE_BUFFER_SIZE)
+            {
+                std::fflush(segment->m_file);
+                m_reported_size = m_prefix_size;
+                m_write_observer(m_reported_size);
+            }
+        }
+
+        update_segment_progress();
+        if (std::chrono::steady_clock::now() - m_segments_state_time >= std::chrono::seconds(1))
+        {
+            write_segments_state();
+        }
+    }
+
+    void DownloadTarget::hash_prefix(const char* data, std::size_t size)
+    {
+        if (m_sha256_hasher)
+        {
+            m_sha256_hasher->update(data, size);
+        }
+        if (m_md5_hasher)
+        {
+            m_md5_hasher->update(data, size);
+        }
+        m_prefix_size += size;
+    }
+
+    void DownloadTarget::advance_prefix()
+    {
+        std::ifstream file;
+        std::vector<char> buffer;
+        while (m_prefix_size < m_expected_size)
+        {
+            auto it = std::find_if(m_segments.begin(), m_segments.end(), [this](auto& segment) {
+                return segment->m_segment_begin <= m_prefix_size
+                       && m_prefix_size <= segment->m_segment_end;
+            });
+            if (it == m_segments.end())
+            {
+                break;
+            }
+            DownloadTarget* segment = it->get();
+            std::size_t written_end = std::min(
+                m_expected_size, segment->m_segment_begin + segment->m_file_size);
+            if (written_end <= m_prefix_size)
+            {
+                break;
+            }
+
+            if (segment->m_file)
+            {
+                std::fflush(segment->m_file);
+            }
+            if (!file.is_open())
+            {
+                file.open(m_filename, std::ios::binary);
+                buffer.resize(WRITE_BUFFER_SIZE);
+            }
+            file.seekg(m_prefix_size);
+            while (m_prefix_size < written_end && file)
+            {
+                file.read(buffer.data(), std::min(buffer.size(), written_end - m_prefix_size));
+                hash_prefix(buffer.data(), std::size_t(file.gcount()));
+            }
+            if (!file)
+            {
+                LOG_WARNING << "Could not read " << m_filename;
+                break;
+            }
+        }
+
+        if (m_write_observer && m_prefix_size > m_reported_size)
+        {
+            for (const auto& segment : m_segments)
+            {
+                if (segment->m_file)
+                {
+                    std::fflush(segment->m_file);
+                }
+            }
+            m_reported_size = m_prefix_size;
+            m_write_observer(m_reported_size);
+        }
+    }
+
+    void DownloadTarget::update_segment_progress()
+    {
+        if (!m_has_progress_bar || Context::instance().quiet || Context::instance().json)
+        {
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - m_progress_throttle_time < std::chrono::milliseconds(150))
+        {
+            return;
+        }
+        m_progress_throttle_time = now;
+
+        std::size_t downloaded = 0;
+        curl_off_t speed = 0;
+        for (const auto& segment : m_segments)
+        {
+            downloaded += segment->m_file_size;
+            speed += segment->get_speed();
+        }
+
+        std::stringstream postfix;
+        postfix << std::setw(6);
+        to_human_readable_filesize(postfix, downloaded);
+        postfix << " / ";
+        postfix << std::setw(6);
+        to_human_readable_filesize(postfix, m_expected_size);
+        postfix << " (";
+        postfix << std::setw(6);
+        to_human_readable_filesize(postfix, speed, 2);
+        postfix << "/s)";
+        m_progress_bar.set_progress(downloaded, m_expected_size);
+        m_progress_bar.set_postfix(postfix.str());
+    }
+
+    bool DownloadTarget::finalize_segments()
+    {
+        result = CURLE_OK;
+        http_status = 200;
+        avg_speed = 0;
+        bool complete = true;
+        bool full_response = false;
+        for (const auto& segment : m_segments)
+        {
+            avg_speed += segment->avg_speed;
+            std::size_t length = segment->m_segment_end - segment->m_segment_begin + 1;
+            if (segment->result == CURLE_OK && segment->http_status == 200
+                && segment->m_file_size == m_expected_size)
+            {
+                // the first segment got the whole file
+                full_response = true;
+            }
+            else if (complete
+                     && (segment->result != CURLE_OK || segment->http_status != 206
+                         || segment->m_file_size != length))
+            {
+                complete = false;
+                result = segment->result;
+                http_status = segment->http_status;
+            }
+        }
+        complete = complete || full_response;
+        std::size_t count = m_segments.size();
+        if (complete)
+        {
+            advance_prefix();
+            complete = m_prefix_size == m_expected_size;
+        }
+        m_segments.clear();
+
+        LOG_INFO << "Transfer of " << count << " segments finalized, status: " << http_status
+                 << " [" << m_url << "]";
+
+        if (fs::exists(segments_state_path()))
+        {
+            fs::remove(segments_state_path());
+        }
+        if (!complete)
+        {
+            if (fs::exists(m_filename))
+            {
+                fs::remove(m_filename);
+            }
+            LOG_INFO << "Segmented download of " << m_name << " failed, downloading it in one piece";
+            m_segments_failed = true;
+            m_next_retry = std::chrono::steady_clock::now();
+            return false;
+        }
+
+        result = CURLE_OK;
+        http_status = 200;
+        downloaded_size = m_expected_size;
+        m_file_size = m_expected_size;
+
+        // the whole file went through the hashers, in order
+        if (m_sha256_hasher)
+        {
+            sha256sum = m_sha256_hasher->hex_digest();
+        }
+        if (m_md5_hasher)
+        {
+            md5sum = m_md5_hasher->hex_digest();
+        }
+
+        final_url = m_url;
+        if (m_finalize_callback)
+        {
+            return m_finalize_callback();
+        }
+        if (m_has_progress_bar)
+        {
+            m_progress_bar.mark_as_completed("Downloaded " + m_name);
+        }
+        return true;
+    }
+
+    const std::string& DownloadTarget::name() const
+    {
+        return m_name;
+    }
+
+    const std::string& DownloadTarget::host() const
+    {
+        return m_host;
+    }
+
+    static size_t discard(char* ptr, size_t size, size_t nmemb, void*)
+    {
+        return size * nmemb;
+    }
+
+
+    bool DownloadTarget::resource_exists()
+    {
+        auto handle = curl_easy_init();
+
+        init_curl_ssl();
+        init_curl_handle(handle, m_url);
+
+        curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+        bool exists = curl_easy_perform(handle) == CURLE_OK;
+
+        if (!exists)
+        {
+            // Some servers don't support HEAD, try a GET if the HEAD fails
+            curl_easy_setopt(handle, CURLOPT_NOBODY, 0L);
+            // Prevent output of data
+            curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &discard);
+            exists = curl_easy_perform(handle) == CURLE_OK;
+        }
+
+        curl_easy_cleanup(handle);
+        return exists;
+    }
+
+    bool DownloadTarget::perform()
+    {
+        LOG_INFO << "Downloading to filename: " << m_filename;
+
+        result = curl_easy_perform(m_handle);
+        set_result(result);
+        return m_finalize_callback ? m_finalize_callback() : true;
+    }
+
+    CURL* DownloadTarget::handle()
+    {
+        return m_handle;
+    }
+
+    curl_off_t DownloadTarget::get_speed()
+    {
+        curl_off_t speed;
+        CURLcode res = curl_easy_getinfo(m_handle, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+        return res == CURLE_OK ? speed : 0;
+    }
+
+    void DownloadTarget::set_result(CURLcode r)
+    {
+        result = r;
+        if (r != CURLE_OK)
+        {
+            char* effective_url = nullptr;
+            curl_easy_getinfo(m_handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+
+            std::stringstream err;
+            err << "Download error (" << result << ") " << curl_easy_strerror(result) << " ["
+                << effective_url << "]\n";
+            if (m_errbuf[0] != '\0')
+            {
+                err << m_errbuf;
+            }
+            LOG_INFO << err.str();
+
+            record_mirror_result(false);
+            schedule_next_retry();
+
+            if (m_has_progress_bar)
+            {
+                m_progress_bar.set_progress(0, 1);
+                m_progress_bar.set_postfix(curl_easy_strerror(result));
+            }
+            if (!m_ignore_failure && !can_retry())
+            {
+                throw std::runtime_error(err.str());
+            }
+        }
+    }
+
+    bool DownloadTarget::finalize()
+    {
+        if (!m_segments.empty())
+        {
+            return finalize_segments();
+        }
+
+        char* effective_url = nullptr;
+
+        auto cres = curl_easy_getinfo(m_handle, CURLINFO_SPEED_DOWNLOAD_T, &avg_speed);
+        if (cres != CURLE_OK)
+        {
+            avg_speed = 0;
+        }
+
+        curl_easy_getinfo(m_handle, CURLINFO_RESPONSE_CODE, &http_status);
+        curl_easy_getinfo(m_handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+        curl_easy_getinfo(m_handle, CURLINFO_SIZE_DOWNLOAD_T, &downloaded_size);
+        downloaded_size += m_resume_from;
+
+        LOG_INFO << "Transfer finalized, status: " << http_status << " [" << effective_url << "] "
+                 << downloaded_size << " bytes";
+
+        if (result == CURLE_OK && m_decompressing && m_zstd_pending != 0)
+        {
+            LOG_WARNING << "Truncated zstd data from " << effective_url;
+            result = CURLE_BAD_CONTENT_ENCODING;
+        }
+
+        if (result == CURLE_OK)
+        {
+            // transfer errors were recorded by set_result
+            record_mirror_result(http_status < 400);
+        }
+        if (http_status >= 400 && m_retry_after > max_retry_after())
+        {
+            LOG_INFO << "Server " << m_host << " asks to wait " << m_retry_after
+                     << "s before retrying " << m_name << ", waiting " << max_retry_after()
+                     << "s";
+        }
+
+        if (can_retry())
+        {
+            // this request didn't work!
+            schedule_next_retry();
+            std::stringstream msg;
+            msg << "Failed (" << http_status << "), retry in "
+                << std::chrono::duration_cast<std::chrono::seconds>(
+                       m_next_retry - std::chrono::steady_clock::now())
+                       .count()
+                << "s";
+            if (m_has_progress_bar)
+            {
+                m_progress_bar.set_progress(0, downloaded_size);
+                m_progress_bar.set_postfix(msg.str());
+            }
+            return false;
+        }
+
+        if (!close_file())
+        {
+            throw std::runtime_error("Could not write to file " + m_filename + ": "
+                                     + strerror(errno));
+        }
+        if (m_sha256_hasher)
+        {
+            sha256sum = m_sha256_hasher->hex_digest();
+        }
+        if (m_md5_hasher)
+        {
+            md5sum = m_md5_hasher->hex_digest();
+        }
+        if (m_write_observer)
+        {
+            m_reported_size = m_file_size;
+            m_write_observer(m_reported_size);
+        }
+        if (m_resumable && fs::exists(resume_state_path()))
+        {
+            fs::remove(resume_state_path());
+        }
+
+        final_url = effective_url;
+        if (m_finalize_callback)
+        {
+            return m_finalize_callback();
+        }
+        else
+        {
+            if (m_has_progress_bar)
+            {
+                m_progress_bar.mark_as_completed("Downloaded " + m_name);
+            }
+        }
+        return true;
+    }
+
+    /**************************************
+     * MultiDownloadTarget implementation *
+     **************************************/
+
+    MultiDownloadTarget::MultiDownloadTarget(bool share_connections)
+        : m_share(DownloadSession::instance().share_handle(share_connections))
+        , m_timeout(std::chrono::steady_clock::time_point::max())
+    {
+        // the number of transfers is limited per host below, and the number of
+        // connections overall by the user's maximum
+        m_handle = curl_multi_init();
+        curl_multi_setopt(
+            m_handle, CURLMOPT_MAX_TOTAL_CONNECTIONS, Context::instance().max_parallel_downloads);
+        curl_multi_setopt(
+            m_handle, CURLMOPT_PIPELINING, use_http2() ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+
+#ifdef __linux__
+        m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (m_epoll_fd < 0)
+        {
+            throw std::runtime_error(std::string("Could not create epoll instance: ")
+                                     + strerror(errno));
+        }
+        curl_multi_setopt(m_handle, CURLMOPT_SOCKETFUNCTION, &MultiDownloadTarget::socket_callback);
+        curl_multi_setopt(m_handle, CURLMOPT_SOCKETDATA, this);
+#endif
+        curl_multi_setopt(m_handle, CURLMOPT_TIMERFUNCTION, &MultiDownloadTarget::timer_callback);
+        curl_multi_setopt(m_handle, CURLMOPT_TIMERDATA, this);
+    }
+
+    MultiDownloadTarget::~MultiDownloadTarget()
+    {
+        curl_multi_cleanup(m_handle);
+#ifdef __linux__
+        close(m_epoll_fd);
+#endif
+    }
+
+    int MultiDownloadTarget::socket_callback(
+        CURL*, curl_socket_t s, int what, void* self, void*)
+    {
+#ifdef __linux__
+        auto* multi = reinterpret_cast<MultiDownloadTarget*>(self);
+        if (what == CURL_POLL_REMOVE)
+        {
+            epoll_ctl(multi->m_epoll_fd, EPOLL_CTL_DEL, s, nullptr);
+            return 0;
+        }
+
+        struct epoll_event ev = {};
+        ev.data.fd = s;
+        if (what & CURL_POLL_IN)
+            ev.events |= EPOLLIN;
+        if (what & CURL_POLL_OUT)
+            ev.events |= EPOLLOUT;
+
+        if (epoll_ctl(multi->m_epoll_fd, EPOLL_CTL_MOD, s, &ev) != 0)
+        {
+            if (errno != ENOENT || epoll_ctl(multi->m_epoll_fd, EPOLL_CTL_ADD, s, &ev) != 0)
+            {
+                LOG_ERROR << "Could not watch socket " << s << ": " << strerror(errno);
+                return -1;
+            }
+        }
+#endif
+        return 0;
+    }
 
-        return curl_easy_perform(handle) == CURLE_OK;
+    int MultiDownloadTarget::timer_callback(CURLM*, long timeout_ms, void* self)
+    {
+        auto* multi = reinterpret_cast<MultiDownloadTarget*>(self);
+        if (timeout_ms < 0)
+        {
+            multi->m_timeout = std::chrono::steady_clock::time_point::max();
+        }
+        else
+        {
+            multi->m_timeout
+                = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        }
+        return 0;
     }
 
-    bool DownloadTarget::perform()
+    void MultiDownloadTarget::add(DownloadTarget* target)
     {
-        LOG_INFO << "Downloading to filename: " << m_filename;
+        if (!target)
+            return;
+        m_targets.push_back(target);
+        auto segments = target->split();
+        if (!segments.empty())
+        {
+            // the segments take the place of the target in the queue
+            for (auto* segment : segments)
+            {
+                queue(segment, false);
+            }
+            return;
+        }
+        target->select_mirror();
+        queue(target, false);
+    }
 
-        result = curl_easy_perform(m_handle);
-        set_result(result);
-        return m_finalize_callback ? m_finalize_callback() : true;
+    bool MultiDownloadTarget::pending_target::operator<(const pending_target& other) const
+    {
+        if (retry != other.retry)
+        {
+            return retry;
+        }
+        if (priority != other.priority)
+        {
+            return priority > other.priority;
+        }
+        return order < other.order;
     }
 
-    CURL* DownloadTarget::handle()
+    void MultiDownloadTarget::queue(DownloadTarget* target, bool retry)
     {
-        return m_handle;
+        long long order = retry ? --m_requeued : ++m_queued;
+        pending_target entry{ retry, target->priority(), order, target };
+        auto& pending = host_of(target).pending;
+        pending.insert(std::upper_bound(pending.begin(), pending.end(), entry), entry);
+        ++m_pending_count;
     }
 
-    curl_off_t DownloadTarget::get_speed()
+    MultiDownloadTarget::host_state& MultiDownloadTarget::host_of(DownloadTarget* target)
     {
-        curl_off_t speed;
-        CURLcode res = curl_easy_getinfo(m_handle, CURLINFO_SPEED_DOWNLOAD_T, &speed);
-        return res == CURLE_OK ? speed : 0;
+        auto it = m_hosts.find(target->host());
+        if (it == m_hosts.end())
+        {
+            it = m_hosts.emplace(target->host(), host_state()).first;
+            it->second.limit = connection_budget();
+        }
+        return it->second;
     }
 
-    void DownloadTarget::set_result(CURLcode r)
+    void MultiDownloadTarget::throttle(DownloadTarget* target)
     {
-        result = r;
-        if (r != CURLE_OK)
+        auto& host = host_of(target);
+        if (!host.throttled && host.limit > 1)
         {
-            char* effective_url = nullptr;
-            curl_easy_getinfo(m_handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+            host.limit = std::max(1.0, std::floor(host.limit / 2));
+            LOG_INFO << "Server " << target->host() << " is throttling, reducing to "
+                     << host.limit << " parallel downloads";
+        }
+        host.throttled = true;
+        if (target->retry_after() > 0)
+        {
+            std::size_t wait = target->retry_after();
+            host.blocked_until = std::max(
+                host.blocked_until,
+                std::chrono::steady_clock::now() + std::chrono::seconds(wait));
+        }
+    }
 
-            std::stringstream err;
-            err << "Download error (" << result << ") " << curl_easy_strerror(result) << " ["
-                << effective_url << "]\n";
-            if (m_errbuf[0] != '\0')
-            {
-                err << m_errbuf;
-            }
-            LOG_INFO << err.str();
+    void MultiDownloadTarget::adapt_concurrency()
+    {
+        using namespace std::chrono;
 
-            m_next_retry
-                = std::chrono::steady_clock::now() + std::chrono::seconds(m_retry_wait_seconds);
+        auto now = steady_clock::now();
+        double elapsed = duration<double>(now - m_last_adaptation).count();
+        if (elapsed < 1.)
+        {
+            return;
+        }
+        m_last_adaptation = now;
 
-            if (m_has_progress_bar)
+        // the connections stay within the budget (CURLMOPT_MAX_TOTAL_CONNECTIONS),
+        // the streams multiplexed on them can grow past it
+        double max_limit = max_host_transfers();
+        for (auto& [name, host] : m_hosts)
+        {
+            curl_off_t bytes = host.finished_bytes;
+            for (auto* target : host.running)
             {
-                m_progress_bar.set_progress(0, 1);
-                m_progress_bar.set_postfix(curl_easy_strerror(result));
+                curl_off_t size = 0;
+                curl_easy_getinfo(target->handle(), CURLINFO_SIZE_DOWNLOAD_T, &size);
+                bytes += size;
             }
-            if (!m_ignore_failure && !can_retry())
+            double rate = (bytes - host.sampled_bytes) / elapsed;
+            host.sampled_bytes = bytes;
+
+            // only a host that had more work than allowed tells something
+            // about the effect of its limit
+            if (host.saturated && !host.throttled)
             {
-                throw std::runtime_error(err.str());
+                double limit = host.limit;
+                if (rate > host.rate * 1.05)
+                {
+                    host.limit = std::min(max_limit, host.limit + 1);
+                }
+                else if (rate < host.rate * 0.75)
+                {
+                    host.limit = std::max(1.0, host.limit - 1);
+                }
+                if (limit != host.limit)
+                {
+                    LOG_DEBUG << "Parallel downloads from " << name << ": " << host.limit
+                              << " (" << static_cast<long>(rate) << " B/s)";
+                }
             }
+            host.rate = rate;
+            host.saturated = false;
+            host.throttled = false;
         }
     }
 
-    bool DownloadTarget::finalize()
+    void MultiDownloadTarget::start_transfer(DownloadTarget* target)
     {
-        char* effective_url = nullptr;
-
-        auto cres = curl_easy_getinfo(m_handle, CURLINFO_SPEED_DOWNLOAD_T, &avg_speed);
-        if (cres != CURLE_OK)
+        // the target may have been created on another thread than the one
+        // running this multi handle
+        curl_easy_setopt(target->handle(), CURLOPT_SHARE, m_share);
+        CURLMcode code = curl_multi_add_handle(m_handle, target->handle());
+        if (code != CURLM_CALL_MULTI_PERFORM)
         {
-            avg_speed = 0;
+            if (code != CURLM_OK)
+            {
+                throw std::runtime_error(curl_multi_strerror(code));
+            }
+        }
+        auto& host = host_of(target);
+        host.running.push_back(target);
+        if (target->own_connection())
+        {
+            ++host.own_connections;
         }
+        // make sure we don't exit the loop before curl picks it up
+        m_running++;
 
-        curl_easy_getinfo(m_handle, CURLINFO_RESPONSE_CODE, &http_status);
-        curl_easy_getinfo(m_handle, CURLINFO_EFFECTIVE_URL, &effective_url);
-        curl_easy_getinfo(m_handle, CURLINFO_SIZE_DOWNLOAD_T, &downloaded_size);
+        if (DownloadTarget* racer = target->start_race())
+        {
+            start_transfer(racer);
+        }
+    }
 
-        LOG_INFO << "Transfer finalized, status: " << http_status << " [" << effective_url << "] "
-                 << downloaded_size << " bytes";
+    void MultiDownloadTarget::finish_transfer(DownloadTarget* target)
+    {
+        curl_multi_remove_handle(m_handle, target->handle());
 
-        if (http_status >= 500 && can_retry())
+        auto& host = host_of(target);
+        host.running.erase(std::remove(host.running.begin(), host.running.end(), target),
+                           host.running.end());
+        if (target->own_connection())
         {
-            // this request didn't work!
-            m_next_retry
-                = std::chrono::steady_clock::now() + std::chrono::seconds(m_retry_wait_seconds);
-            std::stringstream msg;
-            msg << "Failed (" << http_status << "), retry in " << m_retry_wait_seconds << "s";
-            m_progress_bar.set_progress(0, downloaded_size);
-            m_progress_bar.set_postfix(msg.str());
-            return false;
+            --host.own_connections;
         }
+        curl_off_t size = 0;
+        curl_easy_getinfo(target->handle(), CURLINFO_SIZE_DOWNLOAD_T, &size);
+        host.finished_bytes += size;
+    }
+
+    bool MultiDownloadTarget::is_running(DownloadTarget* target)
+    {
+        const auto& running = host_of(target).running;
+        return std::find(running.begin(), running.end(), target) != running.end();
+    }
 
-        m_file.close();
+    // One of the two requests of a race finished. Returns the target to
+    // finalize, with result set to the outcome of the response it took
+    // over, or nullptr while the other request is still running.
+    DownloadTarget* MultiDownloadTarget::settle_race(DownloadTarget* finished, CURLcode& result)
+    {
+        DownloadTarget* primary = finished->race_primary() ? finished->race_primary() : finished;
+        DownloadTarget* racer = primary->racer();
+        DownloadTarget* other = finished == racer ? primary : racer;
 
-        final_url = effective_url;
-        if (m_finalize_callback)
+        finish_transfer(finished);
+        long status = 0;
+        curl_easy_getinfo(finished->handle(), CURLINFO_RESPONSE_CODE, &status);
+        bool success = result == CURLE_OK && status < 400;
+
+        if (is_running(other))
         {
-            return m_finalize_callback();
+            if (!success)
+            {
+                LOG_INFO << "Request of " << primary->name() << " to " << finished->host()
+                         << " failed, waiting for " << other->host();
+                if (!finished->host().empty())
+                {
+                    MirrorHealth::instance().record_failure(finished->host());
+                }
+                if (finished == racer)
+                {
+                    primary->end_race(false);
+                }
+                return nullptr;
+            }
+            finish_transfer(other);
+            // curl does not report the transfers that were removed while running
+            m_running--;
         }
-        else
+
+        // the primary failed earlier if the other one wasn't running anymore
+        LOG_INFO << "Using the response of " << finished->host() << " for " << primary->name();
+        primary->end_race(finished == racer);
+        return primary;
+    }
+
+    std::size_t MultiDownloadTarget::connections() const
+    {
+        std::size_t count = 0;
+        for (const auto& [name, host] : m_hosts)
         {
-            if (m_has_progress_bar)
+            // local files use none, multiplexed transfers share one per host
+            if (!name.empty())
             {
-                m_progress_bar.mark_as_completed("Downloaded " + m_name);
+                count += host.own_connections
+                         + (host.running.size() > host.own_connections ? 1 : 0);
             }
         }
-        return true;
+        return count;
     }
 
-    /**************************************
-     * MultiDownloadTarget implementation *
-     **************************************/
-
-    MultiDownloadTarget::MultiDownloadTarget()
+    void MultiDownloadTarget::start_pending()
     {
-        m_handle = curl_multi_init();
-        curl_multi_setopt(
-            m_handle, CURLMOPT_MAX_TOTAL_CONNECTIONS, Context::instance().max_parallel_downloads);
+        auto now = std::chrono::steady_clock::now();
+        std::size_t budget = std::max(1L, Context::instance().max_parallel_downloads);
+        while (m_pending_count > 0)
+        {
+            std::size_t used = connections();
+            // the first target of the hosts that have room for it
+            host_state* next = nullptr;
+            for (auto& [name, host] : m_hosts)
+            {
+                if (host.pending.empty() || now < host.blocked_until)
+                {
+                    continue;
+                }
+                if (host.running.size() >= static_cast<std::size_t>(host.limit))
+                {
+                    host.saturated = true;
+                    continue;
+                }
+                DownloadTarget* target = host.pending.front().target;
+                bool new_connection = target->own_connection()
+                                      || host.running.size() == host.own_connections;
+                if (!name.empty() && new_connection && used >= budget)
+                {
+                    continue;
+                }
+                if (!next || host.pending.front() < next->pending.front())
+                {
+                    next = &host;
+                }
+            }
+            if (!next)
+            {
+                return;
+            }
+
+            DownloadTarget* target = next->pending.front().target;
+            next->pending.pop_front();
+            --m_pending_count;
+            LOG_DEBUG << "Starting transfer of " << target->name() << " (priority "
+                      << target->priority() << ")";
+            start_transfer(target);
+        }
     }
 
-    MultiDownloadTarget::~MultiDownloadTarget()
+    void MultiDownloadTarget::schedule_retry(DownloadTarget* target)
     {
-        curl_multi_cleanup(m_handle);
+        m_retry_targets.push({ target->next_retry(), target });
     }
 
-    void MultiDownloadTarget::add(DownloadTarget* target)
+    void MultiDownloadTarget::start_due_retries()
     {
-        if (!target)
-            return;
-        CURLMcode code = curl_multi_add_handle(m_handle, target->handle());
-        if (code != CURLM_CALL_MULTI_PERFORM)
+        auto now = std::chrono::steady_clock::now();
+        while (!m_retry_targets.empty() && m_retry_targets.top().first <= now)
         {
-            if (code != CURLM_OK)
+            DownloadTarget* target = m_retry_targets.top().second;
+            m_retry_targets.pop();
+
+            // retries go before the targets that were not tried yet
+            if (target->retry() != nullptr)
             {
-                throw std::runtime_error(curl_multi_strerror(code));
+                queue(target, true);
+            }
+            else
+            {
+                schedule_retry(target);
             }
         }
-        m_targets.push_back(target);
     }
 
     bool MultiDownloadTarget::check_msgs(bool failfast)
@@ -579,54 +2402,84 @@ namespace mamba
 
         while ((msg = curl_multi_info_read(m_handle, &msgs_in_queue)))
         {
-            // TODO maybe refactor so that `msg` is passed to current target?
             DownloadTarget* current_target = nullptr;
-            for (const auto& target : m_targets)
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &current_target);
+
+            if (!current_target)
+            {
+                throw std::runtime_error("Could not find target associated with multi request");
+            }
+
+            // We are only interested in messages about finished transfers
+            if (msg->msg != CURLMSG_DONE)
+            {
+                continue;
+            }
+
+            // msg is released with the handle
+            CURLcode result = msg->data.result;
+            if (current_target->racer() || current_target->race_primary())
             {
-                if (target->handle() == msg->easy_handle)
+                current_target = settle_race(current_target, result);
+                if (!current_target)
                 {
-                    current_target = target;
-                    break;
+                    continue;
                 }
             }
-
-            if (!current_target)
+            else
             {
-                throw std::runtime_error("Could not find target associated with multi request");
+                finish_transfer(current_target);
             }
 
-            current_target->set_result(msg->data.result);
-            if (msg->data.result != CURLE_OK)
+            current_target->set_result(result);
+            if (result != CURLE_OK)
             {
                 if (current_target->can_retry())
                 {
-                    curl_multi_remove_handle(m_handle, current_target->handle());
-                    m_retry_targets.push_back(current_target);
+                    schedule_retry(current_target);
                     continue;
                 }
             }
 
-            if (msg->msg == CURLMSG_DONE)
+            if (DownloadTarget* parent = current_target->segment_parent())
             {
-                LOG_INFO << "Transfer done ...";
-                // We are only interested in messages about finished transfers
-                curl_multi_remove_handle(m_handle, current_target->handle());
-
-                // flush file & finalize transfer
-                if (!current_target->finalize())
+                if (!current_target->finalize() && current_target->can_retry())
                 {
-                    // transfer did not work! can we retry?
-                    if (current_target->can_retry())
+                    if (current_target->http_status == 429 || current_target->http_status == 503)
                     {
-                        LOG_INFO << "Adding target to retry!";
-                        m_retry_targets.push_back(current_target);
+                        throttle(current_target);
                     }
-                    else
+                    schedule_retry(current_target);
+                    continue;
+                }
+                if (!parent->segment_finished())
+                {
+                    continue;
+                }
+                // finalizes the whole file below
+                current_target = parent;
+            }
+
+            LOG_INFO << "Transfer done ...";
+
+            // flush file & finalize transfer
+            if (!current_target->finalize())
+            {
+                if (current_target->http_status == 429 || current_target->http_status == 503)
+                {
+                    throttle(current_target);
+                }
+                // transfer did not work! can we retry?
+                if (current_target->can_retry())
+                {
+                    LOG_INFO << "Adding target to retry!";
+                    schedule_retry(current_target);
+                }
+                else
+                {
+                    if (failfast && current_target->ignore_failure() == false)
                     {
-                        if (failfast && current_target->ignore_failure() == false)
-                        {
-                            throw std::runtime_error("Multi-download failed.");
-                        }
+                        throw std::runtime_error("Multi-download failed.");
                     }
                 }
             }
@@ -634,81 +2487,110 @@ namespace mamba
         return true;
     }
 
-    bool MultiDownloadTarget::download(bool failfast)
+    int MultiDownloadTarget::wait_for_activity(long max_wait_msecs)
     {
-        LOG_INFO << "Starting to download targets";
+        using namespace std::chrono;
 
-        int still_running, repeats = 0;
-        const long max_wait_msecs = 1000;
-        do
+        auto now = steady_clock::now();
+        auto deadline = now + milliseconds(max_wait_msecs);
+        if (m_timeout < deadline)
+        {
+            deadline = m_timeout;
+        }
+        if (!m_retry_targets.empty() && m_retry_targets.top().first < deadline)
+        {
+            deadline = m_retry_targets.top().first;
+        }
+        long wait_msecs
+            = deadline > now ? duration_cast<milliseconds>(deadline - now).count() : 0;
+
+        CURLMcode code = CURLM_OK;
+        int running = m_running;
+#ifdef __linux__
+        constexpr int max_events = 64;
+        struct epoll_event events[max_events];
+        int nfds = epoll_wait(m_epoll_fd, events, max_events, static_cast<int>(wait_msecs));
+        if (nfds < 0 && errno != EINTR)
         {
-            CURLMcode code = curl_multi_perform(m_handle, &still_running);
+            throw std::runtime_error(std::string("Could not wait for download activity: ")
+                                     + strerror(errno));
+        }
 
-            if (code != CURLM_OK)
-            {
-                throw std::runtime_error(curl_multi_strerror(code));
-            }
-            check_msgs(failfast);
+        for (int i = 0; i < nfds && code == CURLM_OK; ++i)
+        {
+            int flags = 0;
+            if (events[i].events & EPOLLIN)
+                flags |= CURL_CSELECT_IN;
+            if (events[i].events & EPOLLOUT)
+                flags |= CURL_CSELECT_OUT;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                flags |= CURL_CSELECT_ERR;
+            code = curl_multi_socket_action(m_handle, events[i].data.fd, flags, &running);
+        }
 
-            if (!m_retry_targets.empty())
-            {
-                auto it = m_retry_targets.begin();
-                while (it != m_retry_targets.end())
-                {
-                    CURL* curl_handle = (*it)->retry();
-                    if (curl_handle != nullptr)
-                    {
-                        curl_multi_add_handle(m_handle, curl_handle);
-                        it = m_retry_targets.erase(it);
-                        still_running = 1;
-                    }
-                    else
-                    {
-                        ++it;
-                    }
-                }
-            }
+        if (code == CURLM_OK && steady_clock::now() >= m_timeout)
+        {
+            // the timer is one-shot, curl sets it again if it needs to
+            m_timeout = steady_clock::time_point::max();
+            code = curl_multi_socket_action(m_handle, CURL_SOCKET_TIMEOUT, 0, &running);
+        }
+#else
+        code = curl_multi_poll(m_handle, NULL, 0, static_cast<int>(wait_msecs), nullptr);
+        if (code == CURLM_OK)
+        {
+            code = curl_multi_perform(m_handle, &running);
+        }
+#endif
+        if (code != CURLM_OK)
+        {
+            throw std::runtime_error(curl_multi_strerror(code));
+        }
+        return running;
+    }
 
-            long curl_timeout = -1;  // NOLINT(runtime/int)
-            code = curl_multi_timeout(m_handle, &curl_timeout);
-            if (code != CURLM_OK)
-            {
-                throw std::runtime_error(curl_multi_strerror(code));
-            }
+    bool MultiDownloadTarget::download(bool failfast)
+    {
+        LOG_INFO << "Starting to download targets";
 
-            if (curl_timeout == 0)  // No wait
-                continue;
+        const long max_wait_msecs = 1000;
 
-            if (curl_timeout < 0 || curl_timeout > max_wait_msecs)  // Wait no more than 1s
-                curl_timeout = max_wait_msecs;
+        // kick off the transfers that were added before
+        m_last_adaptation = std::chrono::steady_clock::now();
+        start_pending();
+        CURLMcode code = CURLM_OK;
+#ifdef __linux__
+        m_timeout = std::chrono::steady_clock::time_point::max();
+        code = curl_multi_socket_action(m_handle, CURL_SOCKET_TIMEOUT, 0, &m_running);
+#else
+        code = curl_multi_perform(m_handle, &m_running);
+#endif
+        if (code != CURLM_OK)
+        {
+            throw std::runtime_error(curl_multi_strerror(code));
+        }
 
-            int numfds;
-            code = curl_multi_wait(m_handle, NULL, 0, curl_timeout, &numfds);
-            if (code != CURLM_OK)
-            {
-                throw std::runtime_error(curl_multi_strerror(code));
-            }
+        do
+        {
+            check_msgs(failfast);
+            start_due_retries();
+            adapt_concurrency();
+            start_pending();
 
-            if (!numfds)
-            {
-                repeats++;  // count number of repeated zero numfds
-                if (repeats > 1)
-                {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                }
-            }
-            else
+            if (!m_running && m_retry_targets.empty() && m_pending_count == 0)
             {
-                repeats = 0;
+                break;
             }
-        } while ((still_running || !m_retry_targets.empty()) && !is_sig_interrupted());
+            m_running = wait_for_activity(max_wait_msecs);
+        } while (!is_sig_interrupted());
 
         if (is_sig_interrupted())
         {
             Console::print("Download interrupted");
             curl_multi_cleanup(m_handle);
+            m_handle = nullptr;
             return false;
         }
+        MirrorHealth::instance().save();
         return true;
     }
 }  // namespace mamba
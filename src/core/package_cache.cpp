@@ -6,6 +6,7 @@
 
 #include "mamba/core/package_cache.hpp"
 #include "nlohmann/json.hpp"
+#include "mamba/core/fetch.hpp"
 #include "mamba/core/package_handling.hpp"
 #include "mamba/core/validate.hpp"
 #include "mamba/core/url.hpp"
@@ -126,9 +127,16 @@ namespace mamba
         LOG_DEBUG << "Verify cache for package '" << pkg_name.string() << "'";
 
         bool valid = false, extract_dir_valid = false;
-        if (fs::exists(m_pkgs_dir / s.fn))
+        fs::path tarball_path = m_pkgs_dir / s.fn;
+        if (fs::exists(tarball_path.string() + MAMBA_RESUME_STATE_SUFFIX)
+            || fs::exists(tarball_path.string() + MAMBA_SEGMENTS_STATE_SUFFIX))
+        {
+            // an interrupted download, resumed when the package is fetched
+            LOG_INFO << "Package tarball '" << tarball_path.string() << "' is a partial download";
+            m_valid_cache[pkg] = false;
+        }
+        else if (fs::exists(tarball_path))
         {
-            fs::path tarball_path = m_pkgs_dir / s.fn;
             // validate that this tarball has the right size and MD5 sum
             valid = validate::file_size(tarball_path, s.size);
             valid = (valid || s.size == 0) && validate::md5(tarball_path, s.md5);
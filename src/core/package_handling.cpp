@@ -8,6 +8,10 @@
 #include <archive.h>
 #include <archive_entry.h>
 
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <memory>
 #include <sstream>
 
 #include "nlohmann/json.hpp"
@@ -488,4 +492,304 @@ namespace mamba
         }
         return true;
     }
+
+    /**********************
+     * StreamingExtractor *
+     **********************/
+
+    namespace
+    {
+        std::string archive_error(archive* a, const char* fallback = "unknown error")
+        {
+            const char* err = archive_error_string(a);
+            return err ? err : fallback;
+        }
+
+        // Same as the loop of extract_archive, except that entries are written
+        // below `destination` instead of the working directory. The latter is
+        // process wide, this can run on any thread.
+        void extract_entries(archive* a, const fs::path& destination)
+        {
+            int flags = ARCHIVE_EXTRACT_TIME;
+            flags |= ARCHIVE_EXTRACT_PERM;
+            flags |= ARCHIVE_EXTRACT_SECURE_NODOTDOT;
+            flags |= ARCHIVE_EXTRACT_SECURE_SYMLINKS;
+            flags |= ARCHIVE_EXTRACT_SPARSE;
+            flags |= ARCHIVE_EXTRACT_UNLINK;
+
+            std::unique_ptr<archive, decltype(&archive_write_free)> ext(archive_write_disk_new(),
+                                                                        &archive_write_free);
+            archive_write_disk_set_options(ext.get(), flags);
+            archive_write_disk_set_standard_lookup(ext.get());
+
+            // replaces ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS, the paths we
+            // hand to libarchive are absolute
+            auto prefixed = [&destination](const char* path) {
+                fs::path p(path);
+                if (p.is_absolute() || p.has_root_name())
+                {
+                    throw std::runtime_error(std::string("Absolute path in archive: ") + path);
+                }
+                return (destination / p).string();
+            };
+
+            archive_entry* entry;
+            for (;;)
+            {
+                if (is_sig_interrupted())
+                {
+                    throw std::runtime_error("Extraction interrupted");
+                }
+
+                int r = archive_read_next_header(a, &entry);
+                if (r == ARCHIVE_EOF)
+                {
+                    break;
+                }
+                if (r < ARCHIVE_OK)
+                {
+                    throw std::runtime_error(archive_error(a));
+                }
+
+                archive_entry_copy_pathname(entry,
+                                            prefixed(archive_entry_pathname(entry)).c_str());
+                if (const char* hardlink = archive_entry_hardlink(entry))
+                {
+                    archive_entry_copy_hardlink(entry, prefixed(hardlink).c_str());
+                }
+
+                r = archive_write_header(ext.get(), entry);
+                if (r < ARCHIVE_OK)
+                {
+                    throw std::runtime_error(archive_error(ext.get()));
+                }
+                else if (archive_entry_size(entry) > 0)
+                {
+                    copy_data(a, ext.get());
+                }
+                r = archive_write_finish_entry(ext.get());
+                if (r == ARCHIVE_WARN)
+                {
+                    LOG_WARNING << "libarchive warning: " << archive_error(ext.get());
+                }
+                else if (r < ARCHIVE_OK)
+                {
+                    throw std::runtime_error(archive_error(ext.get()));
+                }
+            }
+
+            if (archive_write_close(ext.get()) < ARCHIVE_OK)
+            {
+                throw std::runtime_error(archive_error(ext.get()));
+            }
+        }
+
+        // Feeds the data of the current entry of `outer` to a nested archive
+        la_ssize_t read_entry_data(archive*, void* outer, const void** buffer)
+        {
+            std::size_t size;
+            la_int64_t offset;
+            int r = archive_read_data_block(static_cast<archive*>(outer), buffer, &size, &offset);
+            if (r == ARCHIVE_EOF)
+            {
+                return 0;
+            }
+            return r < ARCHIVE_OK ? -1 : la_ssize_t(size);
+        }
+    }
+
+    StreamingExtractor::StreamingExtractor(const fs::path& file, const fs::path& destination)
+        : m_file(file)
+        , m_buffer(65536)
+    {
+        fs::create_directories(destination);
+        // libarchive refuses to extract through symlinks, which would include
+        // a symlinked package cache once paths are absolute
+        m_destination = fs::canonical(destination);
+        m_thread = thread(&StreamingExtractor::run, this);
+    }
+
+    StreamingExtractor::~StreamingExtractor()
+    {
+        finish(false);
+        wait();
+    }
+
+    void StreamingExtractor::set_available(std::size_t size)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_available = std::max(m_available, size);
+        }
+        m_data_cv.notify_one();
+    }
+
+    void StreamingExtractor::finish(bool complete)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_finished = true;
+            m_cancelled = m_cancelled || !complete;
+        }
+        m_data_cv.notify_one();
+    }
+
+    bool StreamingExtractor::wait()
+    {
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+        return m_success;
+    }
+
+    const std::string& StreamingExtractor::error() const
+    {
+        return m_error;
+    }
+
+    la_ssize_t StreamingExtractor::read_callback(archive* a, void* self, const void** buffer)
+    {
+        auto* s = static_cast<StreamingExtractor*>(self);
+
+        std::size_t count = 0;
+        {
+            std::unique_lock<std::mutex> lock(s->m_mutex);
+            while (s->m_read == s->m_available && !s->m_finished && !s->m_cancelled)
+            {
+                if (is_sig_interrupted())
+                {
+                    s->m_cancelled = true;
+                    break;
+                }
+                s->m_data_cv.wait_for(lock, std::chrono::milliseconds(100));
+            }
+            if (s->m_cancelled)
+            {
+                archive_set_error(a, ECANCELED, "Extraction cancelled");
+                return -1;
+            }
+            count = std::min(s->m_available - s->m_read, s->m_buffer.size());
+        }
+
+        // the data up to m_available is on disk, reading it needs no lock
+        if (count && std::fread(s->m_buffer.data(), 1, count, s->m_input) != count)
+        {
+            archive_set_error(a, errno, "Could not read %s", s->m_file.string().c_str());
+            return -1;
+        }
+        s->m_read += count;
+        *buffer = s->m_buffer.data();
+        return la_ssize_t(count);
+    }
+
+    void StreamingExtractor::extract_conda_stream(archive* a)
+    {
+        archive_entry* entry;
+        for (;;)
+        {
+            int r = archive_read_next_header(a, &entry);
+            if (r == ARCHIVE_EOF)
+            {
+                break;
+            }
+            if (r < ARCHIVE_OK)
+            {
+                throw std::runtime_error(archive_error(a));
+            }
+
+            std::string name = archive_entry_pathname(entry);
+            if (name == "metadata.json")
+            {
+                std::string metadata;
+                std::array<char, 4096> chunk;
+                la_ssize_t size;
+                while ((size = archive_read_data(a, chunk.data(), chunk.size())) > 0)
+                {
+                    metadata.append(chunk.data(), size);
+                }
+                if (size < 0)
+                {
+                    throw std::runtime_error(archive_error(a));
+                }
+                if (!metadata.empty())
+                {
+                    auto j = nlohmann::json::parse(metadata);
+                    if (j.find("conda_pkg_format_version") != j.end()
+                        && j["conda_pkg_format_version"] != 2)
+                    {
+                        throw std::runtime_error("Can only read conda version 2 files.");
+                    }
+                }
+            }
+            else if (ends_with(name, ".tar.zst")
+                     && (starts_with(name, "info-") || starts_with(name, "pkg-")))
+            {
+                std::unique_ptr<archive, decltype(&archive_read_free)> inner(archive_read_new(),
+                                                                             &archive_read_free);
+                archive_read_support_format_tar(inner.get());
+                archive_read_support_filter_all(inner.get());
+                if (archive_read_open(inner.get(), a, nullptr, &read_entry_data, nullptr)
+                    != ARCHIVE_OK)
+                {
+                    throw std::runtime_error(archive_error(inner.get()));
+                }
+                extract_entries(inner.get(), m_destination);
+            }
+            else
+            {
+                archive_read_data_skip(a);
+            }
+        }
+    }
+
+    void StreamingExtractor::run()
+    {
+        std::unique_ptr<archive, decltype(&archive_read_free)> a(archive_read_new(),
+                                                                 &archive_read_free);
+        try
+        {
+            m_input = std::fopen(m_file.string().c_str(), "rb");
+            if (!m_input)
+            {
+                throw std::runtime_error("Could not open " + m_file.string());
+            }
+
+            bool is_conda = ends_with(m_file.string(), ".conda");
+            if (is_conda)
+            {
+                // the zip central directory is at the end, read the local headers instead
+                archive_read_support_format_zip_streamable(a.get());
+            }
+            else
+            {
+                archive_read_support_format_tar(a.get());
+                archive_read_support_filter_all(a.get());
+            }
+            if (archive_read_open(a.get(), this, nullptr, &read_callback, nullptr) != ARCHIVE_OK)
+            {
+                throw std::runtime_error(archive_error(a.get()));
+            }
+
+            if (is_conda)
+            {
+                extract_conda_stream(a.get());
+            }
+            else
+            {
+                extract_entries(a.get(), m_destination);
+            }
+            m_success = true;
+        }
+        catch (const std::exception& e)
+        {
+            m_error = e.what();
+        }
+
+        if (m_input)
+        {
+            std::fclose(m_input);
+            m_input = nullptr;
+        }
+    }
 }  // namespace mamba
@@ -4,28 +4,233 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <regex>
+
 #include "mamba/core/repo.hpp"
 #include "mamba/core/output.hpp"
 #include "mamba/core/package_info.hpp"
+#include "mamba/core/util.hpp"
+#include "mamba/core/version.hpp"
 
 extern "C"
 {
+#include "solv/evr.h"
 #include "solv/repo_write.h"
+#include "solv/solv_xfopen.h"
 }
 
-#define MAMBA_TOOL_VERSION "1.1"
+#define MAMBA_TOOL_VERSION "1.2"
 
-#define MAMBA_SOLV_VERSION MAMBA_TOOL_VERSION "_" LIBSOLV_VERSION_STRING
+#define MAMBA_SOLV_VERSION                                                                         \
+    MAMBA_TOOL_VERSION "_" MAMBA_VERSION_STRING "_" LIBSOLV_VERSION_STRING
 
 namespace mamba
 {
     const char* mamba_tool_version()
     {
-        const size_t bufferSize = 30;
-        static char MTV[bufferSize];
-        MTV[0] = '\0';
-        snprintf(MTV, bufferSize, MAMBA_SOLV_VERSION);
-        return MTV;
+        // a literal, the repos are read and written from several threads
+        return MAMBA_SOLV_VERSION;
+    }
+
+    std::string repodata_filters_key()
+    {
+        const auto& ctx = Context::instance();
+        std::string key;
+        if (ctx.use_only_tar_bz2)
+        {
+            key += "use_only_tar_bz2;";
+        }
+        if (ctx.repodata_keep_versions)
+        {
+            key += "keep_versions=" + std::to_string(ctx.repodata_keep_versions) + ";";
+        }
+        if (ctx.repodata_keep_builds)
+        {
+            key += "keep_builds=" + std::to_string(ctx.repodata_keep_builds) + ";";
+        }
+        for (const auto& build : ctx.repodata_exclude_builds)
+        {
+            key += "exclude_build=" + build + ";";
+        }
+        for (const auto& license : ctx.repodata_exclude_licenses)
+        {
+            key += "exclude_license=" + license + ";";
+        }
+        for (const auto& field : ctx.repodata_drop_fields)
+        {
+            key += "drop_field=" + field + ";";
+        }
+        return key;
+    }
+
+    namespace
+    {
+        // the fields that can be left out of .solv files, the solver does not use them
+        const std::map<std::string, Id>& droppable_fields()
+        {
+            static const std::map<std::string, Id> fields = { { "license", SOLVABLE_LICENSE } };
+            return fields;
+        }
+
+        int drop_fields_keyfilter(Repo* repo, Repokey* key, void* kfdata)
+        {
+            const auto* dropped = static_cast<const std::vector<Id>*>(kfdata);
+            if (std::find(dropped->begin(), dropped->end(), key->name) != dropped->end())
+            {
+                return KEY_STORAGE_DROPPED;
+            }
+            return repo_write_stdkeyfilter(repo, key, nullptr);
+        }
+
+        bool matches_any(const std::vector<std::regex>& patterns, const char* str)
+        {
+            return str
+                   && std::any_of(patterns.begin(), patterns.end(), [str](const auto& pattern) {
+                          return std::regex_search(str, pattern);
+                      });
+        }
+
+        std::vector<std::regex> compile_patterns(const std::vector<std::string>& patterns)
+        {
+            std::vector<std::regex> res;
+            for (const auto& pattern : patterns)
+            {
+                try
+                {
+                    res.emplace_back(pattern);
+                }
+                catch (const std::regex_error& e)
+                {
+                    LOG_WARNING << "Ignoring invalid repodata filter '" << pattern
+                                << "': " << e.what();
+                }
+            }
+            return res;
+        }
+    }  // namespace
+
+    int write_solv(Repo* repo, std::FILE* fp)
+    {
+        std::vector<Id> dropped;
+        for (const auto& field : Context::instance().repodata_drop_fields)
+        {
+            auto it = droppable_fields().find(field);
+            if (it != droppable_fields().end())
+            {
+                dropped.push_back(it->second);
+            }
+            else
+            {
+                LOG_WARNING << "Repodata field '" << field << "' cannot be dropped";
+            }
+        }
+        if (dropped.empty())
+        {
+            return repo_write(repo, fp);
+        }
+        return repo_write_filtered(repo, fp, drop_fields_keyfilter, &dropped, nullptr);
+    }
+
+    bool write_solv(Repo* repo, std::string& data)
+    {
+        char* buf = nullptr;
+        std::size_t len = 0;
+        // the name only tells that it is not compressed
+        std::FILE* fp = solv_xfopen_buf("repo.solv", &buf, &len, "w");
+        if (!fp)
+        {
+            return false;
+        }
+        bool ok = write_solv(repo, fp) == 0;
+        // buf and len are set when the stream is closed
+        ok = std::fclose(fp) == 0 && ok;
+        if (ok)
+        {
+            data.assign(buf, len);
+        }
+        solv_free(buf);
+        return ok;
+    }
+
+    SolvWriter& SolvWriter::instance()
+    {
+        static SolvWriter writer;
+        return writer;
+    }
+
+    SolvWriter::~SolvWriter()
+    {
+        wait();
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+    }
+
+    void SolvWriter::write(const fs::path& path, std::string data)
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_queue.emplace_back(path, std::move(data));
+        if (!m_running)
+        {
+            // the previous thread has emptied the queue and is exiting
+            if (m_thread.joinable())
+            {
+                m_thread.join();
+            }
+            m_running = true;
+            m_thread = thread([this]() { run(); });
+        }
+    }
+
+    void SolvWriter::wait()
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_idle.wait(lk, [this]() { return !m_running; });
+    }
+
+    void SolvWriter::run()
+    {
+        while (true)
+        {
+            std::pair<fs::path, std::string> file;
+            {
+                std::unique_lock<std::mutex> lk(m_mutex);
+                if (m_queue.empty())
+                {
+                    m_running = false;
+                    m_idle.notify_all();
+                    return;
+                }
+                file = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+
+            const auto& [path, data] = file;
+            try
+            {
+                TemporaryFile temp_file("mambaf", "", path.parent_path());
+                std::FILE* fp = std::fopen(temp_file.path().string().c_str(), "wb");
+                if (!fp)
+                {
+                    throw std::runtime_error(strerror(errno));
+                }
+                std::size_t written = std::fwrite(data.data(), 1, data.size(), fp);
+                if (std::fclose(fp) != 0 || written != data.size())
+                {
+                    throw std::runtime_error(strerror(errno));
+                }
+                fs::rename(temp_file.path(), path);
+                LOG_INFO << "Wrote " << path;
+            }
+            catch (const std::exception& e)
+            {
+                LOG_ERROR << "Could not write " << path << ": " << e.what();
+            }
+        }
     }
 
     MRepo::MRepo(MPool& pool,
@@ -39,6 +244,50 @@ namespace mamba
         read_file(index);
     }
 
+    MRepo::MRepo(MPool& pool,
+                 const std::string& name,
+                 const std::string& json_file,
+                 const std::vector<std::string>& solv_files,
+                 const std::string& solv_cache,
+                 const RepoMetadata& metadata)
+        : m_json_file(json_file)
+        , m_solv_file(solv_cache)
+        , m_metadata(metadata)
+    {
+        m_url = rsplit(metadata.url, "/", 1)[0];
+        m_repo = repo_create(pool, m_url.c_str());
+        for (const auto& solv_file : solv_files)
+        {
+            if (fs::exists(solv_file) && read_solv(solv_file))
+            {
+                return;
+            }
+        }
+        read_json();
+    }
+
+    MRepo::MRepo(MPool& pool, std::FILE* solv_file, const RepoMetadata& metadata)
+        : MRepo(pool, rsplit(metadata.url, "/", 1)[0], solv_file, metadata)
+    {
+    }
+
+    MRepo::MRepo(MPool& pool,
+                 const std::string& name,
+                 std::FILE* solv_file,
+                 const RepoMetadata& metadata)
+        : m_metadata(metadata)
+    {
+        m_url = rsplit(metadata.url, "/", 1)[0];
+        m_repo = repo_create(pool, name.c_str());
+        if (repo_add_solv(m_repo, solv_file, 0) != 0)
+        {
+            std::string error = pool_errstr(m_repo->pool);
+            repo_free(m_repo, /*reuseids*/ 0);
+            throw std::runtime_error("Could not read repo " + name + ": " + error);
+        }
+        repo_internalize(m_repo);
+    }
+
     MRepo::MRepo(MPool& pool,
                  const std::string& name,
                  const std::string& index,
@@ -143,6 +392,11 @@ namespace mamba
         return m_url;
     }
 
+    const RepoMetadata& MRepo::metadata() const
+    {
+        return m_metadata;
+    }
+
     Repo* MRepo::repo()
     {
         return m_repo;
@@ -180,77 +434,94 @@ namespace mamba
             m_solv_file = filename.substr(0, filename.size() - strlen(".json")) + ".solv";
         }
 
-        if (is_solv)
+        if (is_solv && read_solv(m_solv_file))
         {
-            auto fp = fopen(m_solv_file.c_str(), "rb");
-            if (!fp)
-            {
-                throw std::runtime_error("Could not open repository file " + filename);
-            }
+            return true;
+        }
+        read_json();
+        return true;
+    }
+
+    bool MRepo::read_solv(const std::string& filename)
+    {
+        auto fp = fopen(filename.c_str(), "rb");
+        if (!fp)
+        {
+            throw std::runtime_error("Could not open repository file " + filename);
+        }
 
-            LOG_INFO << "Attempt load from solv " << m_solv_file;
+        LOG_INFO << "Attempt load from solv " << filename;
 
-            int ret = repo_add_solv(m_repo, fp, 0);
-            if (ret != 0)
+        int ret = repo_add_solv(m_repo, fp, 0);
+        if (ret != 0)
+        {
+            LOG_ERROR << "Could not load .solv file, falling back to JSON: "
+                      << pool_errstr(m_repo->pool);
+        }
+        else
+        {
+            auto* repodata = repo_last_repodata(m_repo);
+            if (!repodata)
             {
-                LOG_ERROR << "Could not load .solv file, falling back to JSON: "
-                          << pool_errstr(m_repo->pool);
+                LOG_ERROR << "Could not find valid repodata attached to solv file";
             }
             else
             {
-                auto* repodata = repo_last_repodata(m_repo);
-                if (!repodata)
+                Id url_id = pool_str2id(m_repo->pool, "mamba:url", 1);
+                Id etag_id = pool_str2id(m_repo->pool, "mamba:etag", 1);
+                Id mod_id = pool_str2id(m_repo->pool, "mamba:mod", 1);
+                Id pip_added_id = pool_str2id(m_repo->pool, "mamba:pip_added", 1);
+                Id sha256_id = pool_str2id(m_repo->pool, "mamba:sha256", 1);
+                Id filters_id = pool_str2id(m_repo->pool, "mamba:filters", 1);
+
+                const char* url = repodata_lookup_str(repodata, SOLVID_META, url_id);
+                int pip_added = repodata_lookup_num(repodata, SOLVID_META, pip_added_id, -1);
+                const char* etag = repodata_lookup_str(repodata, SOLVID_META, etag_id);
+                const char* mod = repodata_lookup_str(repodata, SOLVID_META, mod_id);
+                const char* sha256 = repodata_lookup_str(repodata, SOLVID_META, sha256_id);
+                const char* filters = repodata_lookup_str(repodata, SOLVID_META, filters_id);
+                const char* tool_version
+                    = repodata_lookup_str(repodata, SOLVID_META, REPOSITORY_TOOLVERSION);
+                bool metadata_valid
+                    = !(!url || !etag || !mod || !tool_version || pip_added == -1);
+
+                if (metadata_valid)
                 {
-                    LOG_ERROR << "Could not find valid repodata attached to solv file";
+                    RepoMetadata read_metadata{
+                        url, pip_added == 1, etag, mod, sha256 ? sha256 : ""
+                    };
+                    metadata_valid = (read_metadata == m_metadata)
+                                     && (std::strcmp(tool_version, mamba_tool_version()) == 0)
+                                     && (filters ? filters : "") == repodata_filters_key();
                 }
-                else
-                {
-                    Id url_id = pool_str2id(m_repo->pool, "mamba:url", 1);
-                    Id etag_id = pool_str2id(m_repo->pool, "mamba:etag", 1);
-                    Id mod_id = pool_str2id(m_repo->pool, "mamba:mod", 1);
-                    Id pip_added_id = pool_str2id(m_repo->pool, "mamba:pip_added", 1);
-
-                    const char* url = repodata_lookup_str(repodata, SOLVID_META, url_id);
-                    int pip_added = repodata_lookup_num(repodata, SOLVID_META, pip_added_id, -1);
-                    const char* etag = repodata_lookup_str(repodata, SOLVID_META, etag_id);
-                    const char* mod = repodata_lookup_str(repodata, SOLVID_META, mod_id);
-                    const char* tool_version
-                        = repodata_lookup_str(repodata, SOLVID_META, REPOSITORY_TOOLVERSION);
-                    bool metadata_valid
-                        = !(!url || !etag || !mod || !tool_version || pip_added == -1);
-
-                    if (metadata_valid)
-                    {
-                        RepoMetadata read_metadata{ url, pip_added == 1, etag, mod };
-                        metadata_valid = (read_metadata == m_metadata)
-                                         && (std::strcmp(tool_version, mamba_tool_version()) == 0);
-                    }
 
-                    LOG_INFO << "Metadata from .solv is "
-                             << (metadata_valid ? "valid" : "NOT valid");
+                LOG_INFO << "Metadata from .solv is " << (metadata_valid ? "valid" : "NOT valid");
 
-                    if (!metadata_valid)
-                    {
-                        LOG_INFO << "solv file was written with a previous version of "
-                                    "libsolv or mamba "
-                                 << (tool_version != nullptr ? tool_version : "<NULL>")
-                                 << ", updating it now!";
-                    }
-                    else
-                    {
-                        LOG_INFO << "Loaded from solv " << m_solv_file;
-                        repo_internalize(m_repo);
-                        fclose(fp);
-                        return true;
-                    }
+                if (!metadata_valid)
+                {
+                    LOG_INFO << "solv file was written with a previous version of "
+                                "libsolv or mamba, or other repodata filters "
+                             << (tool_version != nullptr ? tool_version : "<NULL>")
+                             << ", updating it now!";
+                }
+                else
+                {
+                    LOG_INFO << "Loaded from solv " << filename;
+                    repo_internalize(m_repo);
+                    fclose(fp);
+                    return true;
                 }
             }
-
-            // fallback to JSON file
-            repo_empty(m_repo, /*reuseids*/ 0);
-            fclose(fp);
         }
 
+        // fallback to JSON file
+        repo_empty(m_repo, /*reuseids*/ 0);
+        fclose(fp);
+        return false;
+    }
+
+    void MRepo::read_json()
+    {
         auto fp = fopen(m_json_file.c_str(), "r");
         if (!fp)
         {
@@ -265,6 +536,7 @@ namespace mamba
             throw std::runtime_error("Could not read JSON repodata file (" + m_json_file + ") "
                                      + std::string(pool_errstr(m_repo->pool)));
         }
+        filter_records();
 
         // TODO move this to a more structured approach for repodata patching?
         if (Context::instance().add_pip_as_python_dependency)
@@ -300,15 +572,99 @@ namespace mamba
         {
             write();
         }
+    }
 
-        return true;
+    void MRepo::filter_records()
+    {
+        const auto& ctx = Context::instance();
+        auto exclude_builds = compile_patterns(ctx.repodata_exclude_builds);
+        auto exclude_licenses = compile_patterns(ctx.repodata_exclude_licenses);
+        if (exclude_builds.empty() && exclude_licenses.empty() && !ctx.repodata_keep_versions
+            && !ctx.repodata_keep_builds)
+        {
+            return;
+        }
+
+        Pool* pool = m_repo->pool;
+        std::vector<Id> dropped;
+        std::map<Id, std::vector<Id>> by_name;
+        Id p;
+        Solvable* s;
+        FOR_REPO_SOLVABLES(m_repo, p, s)
+        {
+            if (matches_any(exclude_builds, solvable_lookup_str(s, SOLVABLE_BUILDFLAVOR))
+                || matches_any(exclude_licenses, solvable_lookup_str(s, SOLVABLE_LICENSE)))
+            {
+                dropped.push_back(p);
+            }
+            else
+            {
+                by_name[s->name].push_back(p);
+            }
+        }
+
+        if (ctx.repodata_keep_versions || ctx.repodata_keep_builds)
+        {
+            auto build_number = [pool](Id id) {
+                const char* str = solvable_lookup_str(pool_id2solvable(pool, id),
+                                                      SOLVABLE_BUILDVERSION);
+                return str ? std::strtoull(str, nullptr, 10) : 0;
+            };
+            for (auto& [name, ids] : by_name)
+            {
+                // newest first
+                std::sort(ids.begin(), ids.end(), [&](Id a, Id b) {
+                    int cmp = pool_evrcmp(pool,
+                                          pool_id2solvable(pool, a)->evr,
+                                          pool_id2solvable(pool, b)->evr,
+                                          EVRCMP_COMPARE);
+                    if (cmp != 0)
+                    {
+                        return cmp > 0;
+                    }
+                    return build_number(a) > build_number(b);
+                });
+
+                // a build number counts once for all its variants and archive formats
+                std::size_t versions = 0, builds = 0;
+                for (std::size_t i = 0; i < ids.size(); ++i)
+                {
+                    if (i == 0
+                        || pool_evrcmp(pool,
+                                       pool_id2solvable(pool, ids[i - 1])->evr,
+                                       pool_id2solvable(pool, ids[i])->evr,
+                                       EVRCMP_COMPARE)
+                               != 0)
+                    {
+                        ++versions;
+                        builds = 1;
+                    }
+                    else if (build_number(ids[i - 1]) != build_number(ids[i]))
+                    {
+                        ++builds;
+                    }
+                    if ((ctx.repodata_keep_versions && versions > ctx.repodata_keep_versions)
+                        || (ctx.repodata_keep_builds && builds > ctx.repodata_keep_builds))
+                    {
+                        dropped.push_back(ids[i]);
+                    }
+                }
+            }
+        }
+
+        for (Id id : dropped)
+        {
+            repo_free_solvable(m_repo, id, /*reuseids*/ 0);
+        }
+        LOG_INFO << m_repo->name << ": " << dropped.size() << " records filtered out, "
+                 << m_repo->nsolvables << " kept";
     }
 
     bool MRepo::write() const
     {
         Repodata* info;
 
-        LOG_INFO << "writing solv file: " << m_solv_file;
+        LOG_INFO << "queuing solv file: " << m_solv_file;
 
         info = repo_add_repodata(m_repo, 0);  // add new repodata for our meta info
         repodata_set_str(info, SOLVID_META, REPOSITORY_TOOLVERSION, mamba_tool_version());
@@ -322,25 +678,30 @@ namespace mamba
         repodata_set_num(info, SOLVID_META, pip_added_id, m_metadata.pip_added);
         repodata_set_str(info, SOLVID_META, etag_id, m_metadata.etag.c_str());
         repodata_set_str(info, SOLVID_META, mod_id, m_metadata.mod.c_str());
+        if (!m_metadata.sha256.empty())
+        {
+            Id sha256_id = pool_str2id(m_repo->pool, "mamba:sha256", 1);
+            repodata_set_str(info, SOLVID_META, sha256_id, m_metadata.sha256.c_str());
+        }
+        std::string filters = repodata_filters_key();
+        if (!filters.empty())
+        {
+            Id filters_id = pool_str2id(m_repo->pool, "mamba:filters", 1);
+            repodata_set_str(info, SOLVID_META, filters_id, filters.c_str());
+        }
 
-        auto solv_f = fopen(m_solv_file.c_str(), "wb");
         repodata_internalize(info);
 
-        if (repo_write(m_repo, solv_f) != 0)
+        // serialized here as the pool is not thread safe, written in the background
+        std::string data;
+        bool ok = write_solv(m_repo, data);
+        repodata_free(info);  // delete meta info repodata again
+        if (!ok)
         {
             LOG_ERROR << "Failed to write .solv:" << pool_errstr(m_repo->pool);
             return false;
         }
-
-        if (fflush(solv_f))
-        {
-            LOG_ERROR << "Failed to flush .solv file.";
-            fclose(solv_f);
-            return false;
-        }
-
-        fclose(solv_f);
-        repodata_free(info);  // delete meta info repodata again
+        SolvWriter::instance().write(m_solv_file, std::move(data));
         return true;
     }
 
@@ -350,4 +711,55 @@ namespace mamba
         m_repo = nullptr;
         return true;
     }
+
+    PoolCopy::PoolCopy(const std::vector<MRepo*>& repos)
+    {
+        for (auto* repo : repos)
+        {
+            Repo* r = repo->repo();
+            RepoData data;
+            data.name = repo->name();
+            data.metadata = repo->metadata();
+            data.priority = r->priority;
+            data.subpriority = r->subpriority;
+            data.installed = r == r->pool->installed;
+            if (!write_solv(r, data.solv))
+            {
+                throw std::runtime_error("Could not copy repo " + data.name);
+            }
+            m_repos.push_back(std::move(data));
+        }
+    }
+
+    std::vector<MRepo> PoolCopy::load(MPool& pool) const
+    {
+        std::vector<MRepo> repos;
+        for (const auto& data : m_repos)
+        {
+            // only read, the buffer is shared by the threads loading the copy
+            char* buf = const_cast<char*>(data.solv.data());
+            std::size_t len = data.solv.size();
+            std::FILE* fp = solv_xfopen_buf("repo.solv", &buf, &len, "r");
+            if (!fp)
+            {
+                throw std::runtime_error("Could not read repo " + data.name);
+            }
+            try
+            {
+                repos.push_back(MRepo(pool, data.name, fp, data.metadata));
+            }
+            catch (...)
+            {
+                std::fclose(fp);
+                throw;
+            }
+            std::fclose(fp);
+            repos.back().set_priority(data.priority, data.subpriority);
+            if (data.installed)
+            {
+                repos.back().set_installed();
+            }
+        }
+        return repos;
+    }
 }  // namespace mamba
@@ -0,0 +1,270 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <set>
+
+#include "mamba/core/match_spec.hpp"
+#include "mamba/core/output.hpp"
+#include "mamba/core/shards.hpp"
+#include "mamba/core/util.hpp"
+#include "mamba/core/validate.hpp"
+
+namespace mamba
+{
+    namespace
+    {
+        std::string cache_stem(const std::string& url)
+        {
+            std::string fn = cache_fn_url(url);
+            return fn.substr(0, fn.size() - 5);
+        }
+
+        // the hashes of the manifest end up in paths of the cache
+        bool is_sha256(const nlohmann::json& hash)
+        {
+            if (!hash.is_string())
+            {
+                return false;
+            }
+            const auto& str = hash.get_ref<const std::string&>();
+            return str.size() == 64 && std::all_of(str.begin(), str.end(), [](char c) {
+                       return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+                   });
+        }
+    }
+
+    SubdirShards::SubdirShards(const std::string& name,
+                               const std::string& subdir_url,
+                               const fs::path& cache_dir,
+                               bool is_noarch)
+        : m_name(name)
+        , m_subdir_url(subdir_url)
+        , m_cache_dir(cache_dir)
+        , m_is_noarch(is_noarch)
+        , m_manifest(name,
+                     concat(subdir_url, "/repodata_shards.json"),
+                     cache_dir / cache_fn_url(concat(subdir_url, "/repodata_shards.json")),
+                     false)
+        , m_repodata({ { "packages", nlohmann::json::object() },
+                       { "packages.conda", nlohmann::json::object() } })
+    {
+        m_manifest.set_optional(true);
+    }
+
+    MSubdirData& SubdirShards::manifest()
+    {
+        return m_manifest;
+    }
+
+    bool SubdirShards::read_manifest()
+    {
+        if (!m_manifest.loaded())
+        {
+            LOG_INFO << "No sharded index for " << m_name;
+            return false;
+        }
+        try
+        {
+            nlohmann::json j;
+            std::ifstream manifest_file(m_manifest.cache_path());
+            manifest_file >> j;
+            m_shards = j.at("shards");
+            m_shards_base_url = j.value("shards_base_url", "shards/");
+            m_repodata["info"] = j.value("info", nlohmann::json::object());
+            for (const auto& [name, hash] : m_shards.items())
+            {
+                if (!is_sha256(hash))
+                {
+                    throw std::runtime_error("invalid hash for " + name);
+                }
+            }
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARNING << "Could not read the sharded index of " << m_name << ": " << e.what();
+            m_shards = nlohmann::json();
+            m_manifest.clear_cache();
+            return false;
+        }
+        return m_shards.is_object();
+    }
+
+    const std::string& SubdirShards::name() const
+    {
+        return m_name;
+    }
+
+    const std::string& SubdirShards::url() const
+    {
+        return m_subdir_url;
+    }
+
+    bool SubdirShards::is_noarch() const
+    {
+        return m_is_noarch;
+    }
+
+    std::string SubdirShards::shard_hash(const std::string& package) const
+    {
+        auto it = m_shards.find(package);
+        return it != m_shards.end() ? it->get<std::string>() : "";
+    }
+
+    std::string SubdirShards::shard_url(const std::string& sha256) const
+    {
+        return concat(m_subdir_url, "/", m_shards_base_url, sha256, ".json");
+    }
+
+    fs::path SubdirShards::shard_path(const std::string& sha256) const
+    {
+        return m_cache_dir / "shards" / (sha256 + ".json");
+    }
+
+    std::vector<std::string> SubdirShards::add_shard(const fs::path& shard_fn)
+    {
+        nlohmann::json shard;
+        std::ifstream shard_file(shard_fn);
+        shard_file >> shard;
+
+        std::vector<std::string> depends;
+        for (auto key : { "packages", "packages.conda" })
+        {
+            if (!shard.contains(key))
+            {
+                continue;
+            }
+            for (auto& [fn, record] : shard[key].items())
+            {
+                for (auto& dep : record.value("depends", nlohmann::json::array()))
+                {
+                    depends.push_back(MatchSpec(dep.get<std::string>()).name);
+                }
+                m_repodata[key][fn] = std::move(record);
+            }
+        }
+        return depends;
+    }
+
+    std::shared_ptr<MSubdirData> SubdirShards::subdir_data() const
+    {
+        // stable for a given set of shards, which keeps its .solv cache valid
+        std::string repodata = m_repodata.dump();
+        validate::Hasher hasher(validate::Hasher::Algorithm::sha256);
+        hasher.update(repodata.data(), repodata.size());
+        std::string sha256 = hasher.hex_digest();
+
+        std::string repodata_url = concat(m_subdir_url, "/repodata.json");
+        fs::path repodata_fn = m_cache_dir / (cache_stem(repodata_url) + ".shards.json");
+        if (!fs::exists(repodata_fn) || validate::sha256sum(repodata_fn.string()) != sha256)
+        {
+            TemporaryFile temp_file("mambaf", "", m_cache_dir);
+            {
+                std::ofstream out(temp_file.path());
+                out << repodata;
+                if (!out)
+                {
+                    throw std::runtime_error("Could not write " + temp_file.path().string());
+                }
+            }
+            fs::rename(temp_file.path(), repodata_fn);
+        }
+
+        auto sdir = std::make_shared<MSubdirData>(
+            m_name, repodata_url, repodata_fn.string(), m_is_noarch);
+        sdir->load_local(sha256);
+        return sdir;
+    }
+
+    void fetch_shard_closure(const std::vector<std::shared_ptr<SubdirShards>>& subdirs,
+                             const std::vector<std::string>& names)
+    {
+        bool pip_added = Context::instance().add_pip_as_python_dependency;
+        std::set<std::string> seen;
+        std::vector<std::string> level;
+        std::function<void(const std::string&)> visit = [&](const std::string& name) {
+            // virtual packages are not in channels
+            if (!name.empty() && !starts_with(name, "__") && seen.insert(name).second)
+            {
+                level.push_back(name);
+                if (pip_added && name == "python")
+                {
+                    visit("pip");
+                }
+            }
+        };
+        for (auto& name : names)
+        {
+            visit(name);
+        }
+
+        std::size_t n_shards = 0;
+        while (!level.empty())
+        {
+            struct shard
+            {
+                SubdirShards* subdir;
+                std::string sha256;
+                fs::path path;
+                std::unique_ptr<DownloadTarget> target;
+            };
+            std::vector<shard> shards;
+            std::set<std::string> downloading;
+            MultiDownloadTarget multi_dl;
+            for (auto& subdir : subdirs)
+            {
+                for (auto& name : level)
+                {
+                    std::string sha256 = subdir->shard_hash(name);
+                    if (sha256.empty())
+                    {
+                        continue;
+                    }
+                    shard s{ subdir.get(), sha256, subdir->shard_path(sha256), nullptr };
+                    // identical shards of several subdirs are downloaded once
+                    if (!fs::exists(s.path) && downloading.insert(sha256).second)
+                    {
+                        fs::create_directories(s.path.parent_path());
+                        s.target = std::make_unique<DownloadTarget>(
+                            name, subdir->shard_url(sha256), s.path.string() + ".part");
+                        s.target->compute_checksums(true, false);
+                        s.target->set_ignore_failure(true);
+                        multi_dl.add(s.target.get());
+                    }
+                    shards.push_back(std::move(s));
+                }
+            }
+            multi_dl.download(false);
+
+            level.clear();
+            for (auto& s : shards)
+            {
+                if (s.target)
+                {
+                    fs::path part = s.path.string() + ".part";
+                    if (s.target->sha256sum != s.sha256)
+                    {
+                        if (fs::exists(part))
+                        {
+                            fs::remove(part);
+                        }
+                        throw std::runtime_error("Could not download shard "
+                                                 + s.subdir->shard_url(s.sha256));
+                    }
+                    fs::rename(part, s.path);
+                }
+                for (auto& dep : s.subdir->add_shard(s.path))
+                {
+                    visit(dep);
+                }
+                ++n_shards;
+            }
+        }
+        LOG_INFO << "Loaded " << n_shards << " shards for " << seen.size() << " package names";
+    }
+}  // namespace mamba
@@ -4,14 +4,125 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+
+#include "nlohmann/json.hpp"
+
 #include "mamba/core/solver.hpp"
 #include "mamba/core/channel.hpp"
 #include "mamba/core/output.hpp"
 #include "mamba/core/package_info.hpp"
 #include "mamba/core/util.hpp"
+#include "mamba/core/validate.hpp"
 
 namespace mamba
 {
+    namespace
+    {
+        // the solve cache keeps the results of that many problems, the most recently used
+        constexpr std::size_t MAX_CACHED_SOLVES = 256;
+
+        double elapsed_ms(std::chrono::steady_clock::time_point start)
+        {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()
+                                                             - start)
+                .count();
+        }
+
+        std::string job_type_name(Id how)
+        {
+            switch (how & SOLVER_JOBMASK)
+            {
+                case SOLVER_INSTALL:
+                    return "install";
+                case SOLVER_ERASE:
+                    return "erase";
+                case SOLVER_UPDATE:
+                    return "update";
+                case SOLVER_LOCK:
+                    return "lock";
+                case SOLVER_DISTUPGRADE:
+                    return "distupgrade";
+                case SOLVER_USERINSTALLED:
+                    return "userinstalled";
+                case SOLVER_FAVOR:
+                    return "favor";
+                case SOLVER_DISFAVOR:
+                    return "disfavor";
+                default:
+                    return "other";
+            }
+        }
+
+        struct LibsolvStats
+        {
+            // the debug mask of the pool before the solve
+            int debugmask;
+            SolveStats* stats;
+        };
+
+        // reads the statistics that libsolv reports, and passes on the
+        // messages that the debug level of the pool asks for
+        void collect_libsolv_stats(Pool*, void* data, int type, const char* str)
+        {
+            auto* collector = static_cast<LibsolvStats*>(data);
+            SolveStats& stats = *collector->stats;
+            int n[8];
+            if (std::sscanf(str,
+                            "%d pkg rules, 2 * %d update rules, %d job rules, %d infarch rules, "
+                            "%d dup rules, %d choice rules, %d best rules, %d yumobs rules",
+                            &n[0], &n[1], &n[2], &n[3], &n[4], &n[5], &n[6], &n[7])
+                == 8)
+            {
+                stats.rules += n[0] + 2 * n[1] + n[2] + n[3] + n[4] + n[5] + n[6] + n[7];
+            }
+            else if (std::sscanf(str,
+                                 "%d black rules, %d recommends rules, %d repo priority rules",
+                                 &n[0], &n[1], &n[2])
+                     == 3)
+            {
+                stats.rules += n[0] + n[1] + n[2];
+            }
+            else if (std::sscanf(str,
+                                 "final solver statistics: %d problems, %d learned rules",
+                                 &n[0], &n[1])
+                     == 2)
+            {
+                stats.learned_rules = n[1];
+            }
+            else if (std::sscanf(str, "solver took %d ms", &n[0]) == 1)
+            {
+                stats.propagation_ms = n[0];
+            }
+
+            if ((type & (SOLV_FATAL | SOLV_ERROR)) || (collector->debugmask & type))
+            {
+                std::fputs(str, stderr);
+            }
+        }
+    }  // namespace
+
+    nlohmann::json SolveStats::to_json() const
+    {
+        return { { "createwhatprovides_ms", createwhatprovides_ms },
+                 { "rule_creation_ms", rule_creation_ms },
+                 { "propagation_ms", propagation_ms },
+                 { "solve_ms", solve_ms },
+                 { "rules", rules },
+                 { "learned_rules", learned_rules },
+                 { "decisions", decisions },
+                 { "problems", problems },
+                 { "pruned_solvables", pruned_solvables },
+                 { "from_cache", from_cache },
+                 { "pool_size", pool_size },
+                 { "repo_sizes", repo_sizes },
+                 { "jobs", jobs } };
+    }
+
     MSolver::MSolver(MPool& pool,
                      const std::vector<std::pair<int, int>>& flags,
                      const PrefixData* prefix_data)
@@ -22,12 +133,22 @@ namespace mamba
         , m_prefix_data(prefix_data)
     {
         queue_init(&m_jobs);
+        queue_init(&m_cached_decisions);
+        auto start = std::chrono::steady_clock::now();
         pool_createwhatprovides(pool);
+        m_stats.createwhatprovides_ms = elapsed_ms(start);
     }
 
     MSolver::~MSolver()
     {
         LOG_INFO << "Freeing solver.";
+        queue_free(&m_cached_decisions);
+        if (m_owns_considered)
+        {
+            Pool* pool = m_pool;
+            map_free(pool->considered);
+            pool->considered = static_cast<Map*>(solv_free(pool->considered));
+        }
         if (m_solver != nullptr)
         {
             solver_free(m_solver);
@@ -139,6 +260,7 @@ namespace mamba
     {
         for (const auto& job : jobs)
         {
+            m_job_keys.push_back("job " + std::to_string(job_flag) + " " + job);
             MatchSpec ms(job);
             int job_type = job_flag & SOLVER_JOBMASK;
 
@@ -197,6 +319,7 @@ namespace mamba
 
     void MSolver::add_constraint(const std::string& job)
     {
+        m_job_keys.push_back("constraint " + job);
         MatchSpec ms(job);
         Id inst_id
             = pool_conda_matchspec(reinterpret_cast<Pool*>(m_pool), ms.conda_build_form().c_str());
@@ -217,6 +340,7 @@ namespace mamba
         // packages
         Pool* pool = m_pool;
         MatchSpec ms(pin);
+        m_job_keys.push_back("pin " + pin);
 
         // TODO
         // if (m_prefix_data)
@@ -345,15 +469,436 @@ namespace mamba
         bool success;
         m_solver = solver_create(m_pool);
         set_flags(m_flags);
+        collect_problem_stats();
+
+        fs::path cache_fn;
+        if (!m_solve_cache_dir.empty())
+        {
+            cache_fn = m_solve_cache_dir / "solves" / (solve_cache_key() + ".json");
+            m_from_cache = load_cached_decisions(cache_fn);
+        }
+        if (m_from_cache)
+        {
+            LOG_INFO << "Replaying solve from " << cache_fn;
+            m_is_solved = true;
+            m_stats.from_cache = true;
+            m_stats.decisions = m_cached_decisions.count;
+            if (log_json)
+            {
+                JsonLogger::instance().json_write({ { "success", true } });
+                JsonLogger::instance().json_write({ { "solver_stats", m_stats.to_json() } });
+            }
+            return true;
+        }
 
+        if (prune_unreachable)
+        {
+            prune_pool();
+            m_stats.pruned_solvables = m_pruned_solvables;
+        }
+
+        Pool* pool = m_pool;
+        LibsolvStats collector{ pool->debugmask, &m_stats };
+        pool->debugmask |= SOLV_DEBUG_STATS;
+        pool_setdebugcallback(pool, collect_libsolv_stats, &collector);
+        auto start = std::chrono::steady_clock::now();
         solver_solve(m_solver, &m_jobs);
+        m_stats.solve_ms = elapsed_ms(start);
+        pool_setdebugcallback(pool, nullptr, nullptr);
+        pool->debugmask = collector.debugmask;
+        m_stats.rule_creation_ms = std::max(0.0, m_stats.solve_ms - m_stats.propagation_ms);
+
         m_is_solved = true;
         LOG_INFO << "Problem count: " << solver_problem_count(m_solver) << std::endl;
+        m_stats.problems = solver_problem_count(m_solver);
+        Queue decisions;
+        queue_init(&decisions);
+        solver_get_decisionqueue(m_solver, &decisions);
+        m_stats.decisions = decisions.count;
+        queue_free(&decisions);
+        LOG_INFO << "Solved " << m_stats.pool_size << " solvables in " << m_stats.solve_ms
+                 << " ms: " << m_stats.rules << " rules, " << m_stats.decisions << " decisions";
+
         success = solver_problem_count(m_solver) == 0;
-        JsonLogger::instance().json_write({ { "success", success } });
+        if (success && !cache_fn.empty())
+        {
+            store_decisions(cache_fn);
+        }
+        if (log_json)
+        {
+            JsonLogger::instance().json_write({ { "success", success } });
+            JsonLogger::instance().json_write({ { "solver_stats", m_stats.to_json() } });
+        }
         return success;
     }
 
+    void MSolver::collect_problem_stats()
+    {
+        Pool* pool = m_pool;
+        m_stats.pool_size = 0;
+        m_stats.repo_sizes.clear();
+        int i;
+        Repo* repo;
+        FOR_REPOS(i, repo)
+        {
+            m_stats.repo_sizes[check_char(repo->name)] += repo->nsolvables;
+            m_stats.pool_size += repo->nsolvables;
+        }
+        m_stats.jobs.clear();
+        for (int j = 0; j < m_jobs.count; j += 2)
+        {
+            ++m_stats.jobs[job_type_name(m_jobs.elements[j])];
+        }
+    }
+
+    const SolveStats& MSolver::stats() const
+    {
+        return m_stats;
+    }
+
+    void MSolver::prune_pool()
+    {
+        Pool* pool = m_pool;
+        if (pool->considered)
+        {
+            LOG_INFO << "Not pruning the pool, it already has considered solvables";
+            return;
+        }
+
+        Map reachable;
+        map_init(&reachable, pool->nsolvables);
+        std::vector<Id> todo;
+        auto reach = [&reachable, &todo](Id p) {
+            if (!MAPTST(&reachable, p))
+            {
+                MAPSET(&reachable, p);
+                todo.push_back(p);
+            }
+        };
+
+        reach(SYSTEMSOLVABLE);
+        Id p, pp;
+        Solvable* s;
+        if (pool->installed)
+        {
+            FOR_REPO_SOLVABLES(pool->installed, p, s)
+            {
+                reach(p);
+            }
+        }
+        for (int i = 0; i < m_jobs.count; i += 2)
+        {
+            Id how = m_jobs.elements[i];
+            Id what = m_jobs.elements[i + 1];
+            Id select = how & SOLVER_SELECTMASK;
+            if (select == SOLVER_SOLVABLE_ALL || select == SOLVER_SOLVABLE_REPO)
+            {
+                // everything is reachable
+                map_free(&reachable);
+                return;
+            }
+            // locks only keep solvables out, the installed ones are reached anyway
+            if ((how & SOLVER_JOBMASK) == SOLVER_LOCK)
+            {
+                continue;
+            }
+            FOR_JOB_SELECT(p, pp, select, what)
+            {
+                reach(p);
+            }
+        }
+
+        // the other versions of a name can replace it, and dependencies can be
+        // installed along. Constraints cannot pull in what is not reached.
+        while (!todo.empty())
+        {
+            s = pool_id2solvable(pool, todo.back());
+            todo.pop_back();
+            if (!s->repo)
+            {
+                continue;
+            }
+            FOR_PROVIDES(p, pp, s->name)
+            {
+                reach(p);
+            }
+            for (Id* dep = s->repo->idarraydata + s->requires; s->requires && *dep; ++dep)
+            {
+                if (*dep == SOLVABLE_PREREQMARKER)
+                {
+                    continue;
+                }
+                FOR_PROVIDES(p, pp, *dep)
+                {
+                    reach(p);
+                }
+            }
+        }
+
+        m_pruned_solvables = 0;
+        FOR_POOL_SOLVABLES(p)
+        {
+            if (!MAPTST(&reachable, p))
+            {
+                ++m_pruned_solvables;
+            }
+        }
+        pool->considered = static_cast<Map*>(solv_calloc(1, sizeof(Map)));
+        *pool->considered = reachable;
+        m_owns_considered = true;
+        LOG_INFO << "Pruned " << m_pruned_solvables << " unreachable solvables out of "
+                 << pool->nsolvables;
+    }
+
+    std::size_t MSolver::pruned_solvables() const
+    {
+        return m_pruned_solvables;
+    }
+
+    void MSolver::set_solve_cache(const fs::path& cache_dir, const std::vector<MRepo*>& repos)
+    {
+        m_solve_cache_dir = cache_dir;
+        m_repo_metadata.clear();
+        for (auto* repo : repos)
+        {
+            m_repo_metadata.emplace_back(repo->repo(), repo->metadata());
+        }
+    }
+
+    bool MSolver::from_cache() const
+    {
+        return m_from_cache;
+    }
+
+    Transaction* MSolver::create_transaction()
+    {
+        if (m_replayed)
+        {
+            // what solver_create_transaction does with the decisions of the solver
+            return transaction_create_decisionq(m_pool, &m_cached_decisions, nullptr);
+        }
+        return solver_create_transaction(m_solver);
+    }
+
+    namespace
+    {
+        std::string solvable_key(Pool* pool, Solvable* s)
+        {
+            return std::string(pool_id2str(pool, s->name)) + " " + pool_id2str(pool, s->evr) + " "
+                   + check_char(solvable_lookup_str(s, SOLVABLE_BUILDFLAVOR)) + " "
+                   + check_char(solvable_lookup_str(s, SOLVABLE_MEDIAFILE));
+        }
+
+        // the identity of a decided solvable, that holds across pools
+        nlohmann::json decision_to_json(Pool* pool, Id p)
+        {
+            Solvable* s = pool_id2solvable(pool, p > 0 ? p : -p);
+            return { p > 0, check_char(s->repo->name), solvable_key(pool, s) };
+        }
+
+        // 0 if the pool does not have that solvable
+        Id decision_from_json(Pool* pool, const nlohmann::json& j)
+        {
+            std::string key = j.at(2);
+            Id name_id = pool_str2id(pool, key.substr(0, key.find(' ')).c_str(), 0);
+            if (!name_id)
+            {
+                return 0;
+            }
+            Id p, pp;
+            FOR_PROVIDES(p, pp, name_id)
+            {
+                Solvable* s = pool_id2solvable(pool, p);
+                if (s->name == name_id && check_char(s->repo->name) == j.at(1).get<std::string>()
+                    && solvable_key(pool, s) == key)
+                {
+                    return j.at(0).get<bool>() ? p : -p;
+                }
+            }
+            return 0;
+        }
+    }  // namespace
+
+    std::string MSolver::solve_cache_key() const
+    {
+        Pool* pool = m_pool;
+        nlohmann::json key = { { "tool_version", mamba_tool_version() },
+                               { "repos", nlohmann::json::array() },
+                               { "jobs", m_job_keys },
+                               { "flags", m_flags },
+                               { "postsolve_flags", { no_deps, only_deps, force_reinstall } } };
+
+        int i;
+        Repo* repo;
+        FOR_REPOS(i, repo)
+        {
+            nlohmann::json j = { { "name", repo->name ? repo->name : "" },
+                                 { "priority", { repo->priority, repo->subpriority } },
+                                 { "installed", repo == pool->installed } };
+            auto it = std::find_if(m_repo_metadata.begin(),
+                                   m_repo_metadata.end(),
+                                   [repo](const auto& m) { return m.first == repo; });
+            if (it != m_repo_metadata.end() && !it->second.url.empty())
+            {
+                const RepoMetadata& meta = it->second;
+                j["metadata"] = { meta.url, meta.pip_added, meta.etag, meta.mod, meta.sha256 };
+                j["filters"] = repodata_filters_key();
+            }
+            else
+            {
+                // the installed packages, or packages of the package caches
+                validate::Hasher hasher(validate::Hasher::Algorithm::sha256);
+                Id p;
+                Solvable* s;
+                FOR_REPO_SOLVABLES(repo, p, s)
+                {
+                    std::string solvable = solvable_key(pool, s);
+                    for (Id* dep = s->repo->idarraydata + s->requires; s->requires && *dep; ++dep)
+                    {
+                        solvable += std::string(" ") + pool_dep2str(pool, *dep);
+                    }
+                    Queue q;
+                    queue_init(&q);
+                    solvable_lookup_idarray(s, SOLVABLE_CONSTRAINS, &q);
+                    for (int k = 0; k < q.count; ++k)
+                    {
+                        solvable += std::string(" !") + pool_dep2str(pool, q.elements[k]);
+                    }
+                    queue_free(&q);
+                    solvable += "\n";
+                    hasher.update(solvable.data(), solvable.size());
+                }
+                j["content"] = hasher.hex_digest();
+            }
+            key["repos"].push_back(j);
+        }
+
+        std::string dump = key.dump();
+        validate::Hasher hasher(validate::Hasher::Algorithm::sha256);
+        hasher.update(dump.data(), dump.size());
+        return hasher.hex_digest();
+    }
+
+    bool MSolver::load_cached_decisions(const fs::path& path)
+    {
+        if (!fs::exists(path))
+        {
+            return false;
+        }
+        try
+        {
+            std::ifstream in(path);
+            nlohmann::json j;
+            in >> j;
+            if (!replay_solution(j))
+            {
+                LOG_INFO << "Solve cache " << path << " has a package not in the pool";
+                return false;
+            }
+            // its age tells when it was last used
+            std::error_code ec;
+            fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+            return true;
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARNING << "Could not read solve cache " << path << ": " << e.what();
+            queue_empty(&m_cached_decisions);
+            return false;
+        }
+    }
+
+    nlohmann::json MSolver::solution() const
+    {
+        Pool* pool = m_pool;
+        nlohmann::json j = { { "decisions", nlohmann::json::array() } };
+        Queue decisions;
+        if (m_replayed)
+        {
+            queue_init_clone(&decisions, const_cast<Queue*>(&m_cached_decisions));
+        }
+        else
+        {
+            queue_init(&decisions);
+            solver_get_decisionqueue(m_solver, &decisions);
+        }
+        for (int i = 0; i < decisions.count; ++i)
+        {
+            Id p = decisions.elements[i];
+            Solvable* s = pool_id2solvable(pool, p > 0 ? p : -p);
+            // the transaction only uses these
+            if (s->repo && (p > 0 || s->repo == pool->installed))
+            {
+                j["decisions"].push_back(decision_to_json(pool, p));
+            }
+        }
+        queue_free(&decisions);
+        return j;
+    }
+
+    bool MSolver::replay_solution(const nlohmann::json& solution)
+    {
+        queue_empty(&m_cached_decisions);
+        for (const auto& decision : solution.at("decisions"))
+        {
+            Id p = decision_from_json(m_pool, decision);
+            if (!p)
+            {
+                queue_empty(&m_cached_decisions);
+                return false;
+            }
+            queue_push(&m_cached_decisions, p);
+        }
+        if (!m_solver)
+        {
+            m_solver = solver_create(m_pool);
+        }
+        m_replayed = true;
+        m_is_solved = true;
+        return true;
+    }
+
+    void MSolver::store_decisions(const fs::path& path) const
+    {
+        try
+        {
+            fs::create_directories(path.parent_path());
+            TemporaryFile temp_file("mambaf", "", path.parent_path());
+            {
+                std::ofstream out(temp_file.path());
+                out << solution().dump();
+                if (!out)
+                {
+                    throw std::runtime_error("could not write " + temp_file.path().string());
+                }
+            }
+            fs::rename(temp_file.path(), path);
+            LOG_INFO << "Stored solve in " << path;
+
+            std::error_code ec;
+            std::vector<std::pair<fs::file_time_type, fs::path>> others;
+            for (const auto& entry : fs::directory_iterator(path.parent_path(), ec))
+            {
+                if (entry.path() != path && entry.path().extension() == ".json")
+                {
+                    others.emplace_back(fs::last_write_time(entry.path(), ec), entry.path());
+                }
+            }
+            if (others.size() >= MAX_CACHED_SOLVES)
+            {
+                std::sort(others.begin(), others.end(), std::greater<>());
+                for (std::size_t i = MAX_CACHED_SOLVES - 1; i < others.size(); ++i)
+                {
+                    fs::remove(others[i].second, ec);
+                }
+            }
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARNING << "Could not store solve in " << path << ": " << e.what();
+        }
+    }
+
     std::string MSolver::problems_to_str()
     {
         Queue problem_queue;
@@ -373,4 +918,103 @@ namespace mamba
     {
         return m_solver;
     }
+
+    SolvePortfolio::SolvePortfolio(const std::vector<MRepo*>& repos,
+                                   const PrefixData* prefix_data)
+        : m_pool_copy(repos)
+        , m_prefix_data(prefix_data)
+    {
+    }
+
+    SolvePortfolio::~SolvePortfolio()
+    {
+        cancel();
+        for (auto& t : m_threads)
+        {
+            if (t.joinable())
+            {
+                t.join();
+            }
+        }
+    }
+
+    void SolvePortfolio::add(const std::string& name,
+                             const std::vector<std::pair<int, int>>& flags,
+                             setup_function setup)
+    {
+        std::size_t index;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            index = m_results.size();
+            m_results.push_back({ name, false, false, nlohmann::json() });
+        }
+        m_threads.emplace_back([this, index, flags, setup]() { run(index, flags, setup); });
+    }
+
+    void SolvePortfolio::run(std::size_t index,
+                             std::vector<std::pair<int, int>> flags,
+                             setup_function setup)
+    {
+        std::string name;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            name = m_results[index].name;
+        }
+        bool success = false;
+        nlohmann::json solution;
+        try
+        {
+            if (!m_cancelled)
+            {
+                MPool pool;
+                auto repos = m_pool_copy.load(pool);
+                MSolver solver(pool, flags, m_prefix_data);
+                solver.log_json = false;
+                setup(solver);
+                if (!m_cancelled)
+                {
+                    success = solver.solve();
+                    if (success)
+                    {
+                        solution = solver.solution();
+                    }
+                    LOG_INFO << "Solve strategy '" << name << "' "
+                             << (success ? "succeeded" : "failed") << " in "
+                             << solver.stats().solve_ms << " ms";
+                }
+            }
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARNING << "Solve strategy '" << name << "' failed: " << e.what();
+            success = false;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_results[index].done = true;
+        m_results[index].success = success;
+        m_results[index].solution = std::move(solution);
+        m_done.notify_all();
+    }
+
+    std::string SolvePortfolio::wait(nlohmann::json& solution)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (std::size_t i = 0; i < m_results.size(); ++i)
+        {
+            m_done.wait(lock, [this, i]() { return m_results[i].done; });
+            if (m_results[i].success)
+            {
+                m_cancelled = true;
+                solution = m_results[i].solution;
+                return m_results[i].name;
+            }
+        }
+        return "";
+    }
+
+    void SolvePortfolio::cancel()
+    {
+        m_cancelled = true;
+    }
 }  // namespace mamba
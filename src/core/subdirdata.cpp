@@ -4,12 +4,23 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+
+#include "mamba/core/channel.hpp"
 #include "mamba/core/mamba_fs.hpp"
 #include "mamba/core/output.hpp"
 #include "mamba/core/package_cache.hpp"
 #include "mamba/core/subdirdata.hpp"
+#include "mamba/core/thread_utils.hpp"
 #include "mamba/core/url.hpp"
 
+extern "C"
+{
+#include "solv/repo_write.h"
+}
+
 
 namespace decompress
 {
@@ -63,6 +74,35 @@ namespace decompress
 
 namespace mamba
 {
+    // a channel without repodata.json.zst is checked again after that time
+    static constexpr std::time_t ZST_RECHECK_SECONDS = 14 * 24 * 3600;
+    // an optional index file found missing is requested again after that time
+    static constexpr std::time_t MISSING_RECHECK_SECONDS = 24 * 3600;
+    // a repo snapshot ends with the offset of its footer, in that many digits
+    static constexpr int SNAPSHOT_FOOTER_OFFSET_SIZE = 20;
+    // the repo snapshots of that many channel sets are kept, the most recently used
+    static constexpr std::size_t MAX_REPO_SNAPSHOTS = 4;
+
+    // the cache metadata of a .state.json sidecar, as the fields that used to
+    // be spliced at the start of the repodata
+    static nlohmann::json mod_etag_of_state(const nlohmann::json& state)
+    {
+        nlohmann::json result;
+        result["_url"] = state.value("url", "");
+        result["_etag"] = state.value("etag", "");
+        result["_mod"] = state.value("mod", "");
+        result["_cache_control"] = state.value("cache_control", "");
+        if (state.contains("sha256"))
+        {
+            result["_sha256"] = state["sha256"];
+        }
+        if (state.contains("has_zst"))
+        {
+            result["_has_zst"] = state["has_zst"];
+        }
+        return result;
+    }
+
     MSubdirData::MSubdirData(const std::string& name,
                              const std::string& repodata_url,
                              const std::string& repodata_fn,
@@ -73,6 +113,7 @@ namespace mamba
         , m_name(name)
         , m_json_fn(repodata_fn)
         , m_solv_fn(repodata_fn.substr(0, repodata_fn.size() - 4) + "solv")
+        , m_state_fn(repodata_fn.substr(0, repodata_fn.size() - 4) + "state.json")
         , m_is_noarch(is_noarch)
     {
     }
@@ -98,6 +139,110 @@ namespace mamba
         return m_loaded;
     }
 
+    bool MSubdirData::use_shared_cache(const fs::file_time_type::duration& cache_age)
+    {
+        auto now = fs::file_time_type::clock::now();
+        const auto& shared_caches = Context::instance().shared_index_caches;
+        if (shared_caches.empty())
+        {
+            return false;
+        }
+        std::string own_sha256;
+        if (fs::exists(m_json_fn))
+        {
+            own_sha256 = read_state().value("_sha256", "");
+        }
+
+        for (const auto& cache_dir : shared_caches)
+        {
+            fs::path json_fn = cache_dir / fs::path(m_json_fn).filename();
+            fs::path state_fn = cache_dir / fs::path(m_state_fn).filename();
+            auto age = check_cache(json_fn, now);
+            if (age >= cache_age || !fs::exists(state_fn))
+            {
+                continue;
+            }
+            try
+            {
+                std::ifstream state_file(state_fn);
+                nlohmann::json state;
+                state_file >> state;
+                // only a repodata whose state tells its content
+                std::string sha256 = state.value("sha256", "");
+                if (sha256.empty()
+                    || state.value("size", std::size_t(0)) != fs::file_size(json_fn))
+                {
+                    continue;
+                }
+
+                if (sha256 == own_sha256)
+                {
+                    LOG_INFO << "Shared cache " << json_fn << " has the same repodata";
+                }
+                else
+                {
+                    LOG_INFO << "Using shared cache " << json_fn;
+                    auto temp_file = make_temp_file();
+                    fs::copy_file(
+                        json_fn, temp_file->path(), fs::copy_options::overwrite_existing);
+                    // the copy is what gets loaded, its content must be what the state tells
+                    if (validate::sha256sum(temp_file->path()) != sha256)
+                    {
+                        LOG_WARNING << "Shared cache " << json_fn
+                                    << " does not match its state, ignoring it";
+                        continue;
+                    }
+                    fs::rename(temp_file->path(), m_json_fn);
+                }
+                // keeps its age, for the time-to-live
+                fs::last_write_time(m_json_fn, fs::last_write_time(json_fn));
+
+                m_mod_etag = mod_etag_of_state(state);
+                write_state();
+                return true;
+            }
+            catch (const std::exception& e)
+            {
+                LOG_WARNING << "Could not use the shared cache " << json_fn << ": " << e.what();
+            }
+        }
+        return false;
+    }
+
+    bool MSubdirData::stale() const
+    {
+        return m_stale;
+    }
+
+    void MSubdirData::set_optional(bool optional)
+    {
+        m_optional = optional;
+    }
+
+    bool MSubdirData::missing() const
+    {
+        return m_missing;
+    }
+
+    std::size_t MSubdirData::max_stale() const
+    {
+        const auto& ctx = Context::instance();
+        std::string channel = m_name.substr(0, m_name.rfind('/'));
+        auto it = ctx.channel_repodata_max_stale.find(channel);
+        return it != ctx.channel_repodata_max_stale.end() ? it->second : ctx.repodata_max_stale;
+    }
+
+    std::unique_ptr<MSubdirData> MSubdirData::revalidation() const
+    {
+        // not noarch: a failure leaves the cache as it is, without throwing
+        auto sdir = std::make_unique<MSubdirData>(m_name, m_repodata_url, m_json_fn, false);
+        sdir->m_has_progress_bar = false;
+        sdir->m_optional = m_optional;
+        sdir->m_mod_etag = m_mod_etag;
+        sdir->create_target(sdir->m_mod_etag);
+        return sdir;
+    }
+
     bool MSubdirData::forbid_cache()
     {
         return starts_with(m_repodata_url, "file://");
@@ -105,12 +250,27 @@ namespace mamba
 
     bool MSubdirData::load()
     {
+        if (m_optional && !forbid_cache() && !fs::exists(m_json_fn) && read_missing_state())
+        {
+            LOG_INFO << "Not requesting " << m_repodata_url << ", recently found missing";
+            m_missing = true;
+            return true;
+        }
+
         auto now = fs::file_time_type::clock::now();
         auto cache_age = check_cache(m_json_fn, now);
+        if (!forbid_cache() && use_shared_cache(cache_age))
+        {
+            cache_age = check_cache(m_json_fn, now);
+        }
         if (cache_age != fs::file_time_type::duration::max() && !forbid_cache())
         {
             LOG_INFO << "Found valid cache file.";
-            m_mod_etag = read_mod_and_etag();
+            m_mod_etag = read_state();
+            if (m_mod_etag.size() == 0)
+            {
+                m_mod_etag = read_mod_and_etag();
+            }
             if (m_mod_etag.size() != 0)
             {
                 int max_age = 0;
@@ -127,10 +287,14 @@ namespace mamba
 
                 auto cache_age_seconds
                     = std::chrono::duration_cast<std::chrono::seconds>(cache_age).count();
-                if ((max_age > cache_age_seconds || Context::instance().offline))
+                bool fresh = max_age > cache_age_seconds || Context::instance().offline;
+                // expired, but still good enough to not wait for the network
+                m_stale = !fresh
+                          && max_age + static_cast<std::int64_t>(max_stale()) > cache_age_seconds;
+                if (fresh || m_stale)
                 {
                     // cache valid!
-                    LOG_INFO << "Using cache " << m_repodata_url
+                    LOG_INFO << "Using " << (m_stale ? "stale cache " : "cache ") << m_repodata_url
                              << " age in seconds: " << cache_age_seconds << " / " << max_age;
                     std::string prefix = m_name;
                     prefix.resize(PREFIX_LENGTH - 1, ' ');
@@ -143,8 +307,10 @@ namespace mamba
                     auto solv_age = check_cache(m_solv_fn, now);
                     LOG_INFO << "Solv cache age in seconds: "
                              << std::chrono::duration_cast<std::chrono::seconds>(solv_age).count();
+                    // one made from known content is checked against it when read
                     if (solv_age != fs::file_time_type::duration::max()
-                        && solv_age.count() <= cache_age.count())
+                        && (m_mod_etag.contains("_sha256")
+                            || solv_age.count() <= cache_age.count()))
                     {
                         LOG_INFO << "Also using .solv cache file";
                         m_solv_cache_valid = true;
@@ -169,9 +335,29 @@ namespace mamba
         return true;
     }
 
+    bool MSubdirData::load_local(const std::string& etag)
+    {
+        auto now = fs::file_time_type::clock::now();
+        auto json_age = check_cache(m_json_fn, now);
+        if (json_age == fs::file_time_type::duration::max())
+        {
+            return false;
+        }
+        m_mod_etag = { { "_url", m_repodata_url },
+                       { "_etag", etag },
+                       { "_mod", "" },
+                       { "_cache_control", "" } };
+        m_loaded = true;
+        m_json_cache_valid = true;
+
+        auto solv_age = check_cache(m_solv_fn, now);
+        m_solv_cache_valid
+            = solv_age != fs::file_time_type::duration::max() && solv_age <= json_age;
+        return true;
+    }
+
     std::string MSubdirData::cache_path() const
     {
-        // TODO invalidate solv cache on version updates!!
         if (m_json_cache_valid && m_solv_cache_valid)
         {
             return m_solv_fn;
@@ -195,13 +381,43 @@ namespace mamba
 
     bool MSubdirData::finalize_transfer()
     {
+        if (m_patching)
+        {
+            m_patching = false;
+            if (m_target->result == 0 && m_target->http_status < 400 && apply_patches())
+            {
+                return true;
+            }
+            LOG_INFO << "Could not patch the cached repodata of " << m_name;
+            fall_back_to_full();
+            return false;
+        }
+
+        if (m_zst && (m_target->result != 0 || m_target->http_status >= 400))
+        {
+            LOG_INFO << "Could not get repodata.json.zst (response: " << m_target->http_status
+                     << ") for " << m_name;
+            // not an outage
+            if (m_target->http_status >= 400 && m_target->http_status < 500)
+            {
+                m_has_zst = { { "value", false }, { "last_checked", std::time(nullptr) } };
+            }
+            m_zst = false;
+            fall_back_to_full();
+            return false;
+        }
+
         if (m_target->result != 0 || m_target->http_status >= 400)
         {
             LOG_INFO << "Unable to retrieve repodata (response: " << m_target->http_status
                      << ") for " << m_repodata_url;
-            m_progress_bar.set_postfix(std::to_string(m_target->http_status) + " Failed");
-            m_progress_bar.set_full();
-            m_progress_bar.mark_as_completed();
+            // not an outage
+            if (m_optional && m_target->http_status >= 400 && m_target->http_status < 500)
+            {
+                clear_cache();
+                write_missing_state();
+            }
+            show_progress(std::to_string(m_target->http_status) + " Failed", true);
             m_loaded = false;
             return false;
         }
@@ -222,30 +438,7 @@ namespace mamba
 
         if (m_target->http_status == 304)
         {
-            // cache still valid
-            auto now = fs::file_time_type::clock::now();
-            auto cache_age = check_cache(m_json_fn, now);
-            auto solv_age = check_cache(m_solv_fn, now);
-
-            fs::last_write_time(m_json_fn, now);
-            LOG_INFO << "Solv age: "
-                     << std::chrono::duration_cast<std::chrono::seconds>(solv_age).count()
-                     << ", JSON age: "
-                     << std::chrono::duration_cast<std::chrono::seconds>(cache_age).count();
-            if (solv_age != fs::file_time_type::duration::max()
-                && solv_age.count() <= cache_age.count())
-            {
-                fs::last_write_time(m_solv_fn, now);
-                m_solv_cache_valid = true;
-            }
-
-            m_progress_bar.set_postfix("No change");
-            m_progress_bar.set_full();
-            m_progress_bar.mark_as_completed();
-
-            m_json_cache_valid = true;
-            m_loaded = true;
-            m_temp_file.reset(nullptr);
+            keep_cache();
             return true;
         }
 
@@ -256,67 +449,233 @@ namespace mamba
         m_mod_etag["_etag"] = m_target->etag;
         m_mod_etag["_mod"] = m_target->mod;
         m_mod_etag["_cache_control"] = m_target->cache_control;
-
-        LOG_INFO << "Opening: " << m_json_fn;
-        std::ofstream final_file(m_json_fn);
-
-        create_cache_dir();
-
-        if (!final_file.is_open())
+        if (m_zst)
+        {
+            m_has_zst = { { "value", true }, { "last_checked", std::time(nullptr) } };
+        }
+        if (!m_has_zst.is_null())
         {
-            LOG_ERROR << "Could not open file " << m_json_fn;
-            exit(1);
+            m_mod_etag["_has_zst"] = m_has_zst;
         }
 
         if (ends_with(m_repodata_url, ".bz2"))
         {
-            m_progress_bar.set_postfix("Decomp...");
+            show_progress("Decomp...", false);
             decompress();
         }
 
-        m_progress_bar.set_postfix("Finalizing...");
+        show_progress("Finalizing...", false);
+
+        // the repodata is published as is, readers see either the old or the new
+        // file. Its metadata follows, a crash in between only costs a download.
+        LOG_INFO << "Moving " << m_temp_file->path() << " to " << m_json_fn;
+        try
+        {
+            fs::rename(m_temp_file->path(), m_json_fn);
+        }
+        catch (const fs::filesystem_error& e)
+        {
+            // the download did not end up on the same filesystem
+            LOG_INFO << "Could not rename repodata (" << e.what() << "), copying it";
+            auto cache_temp_file = std::make_unique<TemporaryFile>(
+                "mambaf", "", fs::path(m_json_fn).parent_path());
+            fs::copy_file(m_temp_file->path(),
+                          cache_temp_file->path(),
+                          fs::copy_options::overwrite_existing);
+            fs::rename(cache_temp_file->path(), m_json_fn);
+        }
+        m_temp_file.reset(nullptr);
+        // identifies the content, for the .solv caches and in the patch log
+        m_mod_etag["_sha256"] = ends_with(m_repodata_url, ".bz2")
+                                    ? validate::sha256sum(m_json_fn)
+                                    : m_target->sha256sum;
+        write_state();
+
+        show_progress("Done", true);
+
+        m_json_cache_valid = true;
+        m_loaded = true;
+
+        fs::last_write_time(m_json_fn, fs::file_time_type::clock::now());
 
-        std::ifstream temp_file(m_temp_file->path());
-        std::stringstream temp_json;
-        temp_json << m_mod_etag.dump();
+        return true;
+    }
 
-        // replace `}` with `,`
-        temp_json.seekp(-1, temp_json.cur);
-        temp_json << ',';
-        final_file << temp_json.str();
-        temp_file.seekg(1);
-        std::copy(std::istreambuf_iterator<char>(temp_file),
-                  std::istreambuf_iterator<char>(),
-                  std::ostreambuf_iterator<char>(final_file));
+    void MSubdirData::keep_cache()
+    {
+        // cache still valid
+        auto now = fs::file_time_type::clock::now();
+        auto cache_age = check_cache(m_json_fn, now);
+        auto solv_age = check_cache(m_solv_fn, now);
 
-        if (!temp_file)
+        fs::last_write_time(m_json_fn, now);
+        if (m_mod_etag.is_object() && m_mod_etag.contains("_sha256"))
         {
-            LOG_ERROR << "Could not write out repodata file '" << m_json_fn
-                      << "': " << strerror(errno);
-            fs::remove(m_json_fn);
-            exit(1);
+            m_solv_cache_valid = solv_age != fs::file_time_type::duration::max();
+        }
+        LOG_INFO << "Solv age: "
+                 << std::chrono::duration_cast<std::chrono::seconds>(solv_age).count()
+                 << ", JSON age: "
+                 << std::chrono::duration_cast<std::chrono::seconds>(cache_age).count();
+        if (solv_age != fs::file_time_type::duration::max()
+            && solv_age.count() <= cache_age.count())
+        {
+            fs::last_write_time(m_solv_fn, now);
+            m_solv_cache_valid = true;
         }
 
-        m_progress_bar.set_postfix("Done");
-        m_progress_bar.set_full();
-        m_progress_bar.mark_as_completed();
+        show_progress("No change", true);
 
         m_json_cache_valid = true;
         m_loaded = true;
+        m_temp_file.reset(nullptr);
 
-        temp_file.close();
+        // remember what we learned about repodata.json.zst
+        if (!m_has_zst.is_null() && m_mod_etag.is_object()
+            && m_mod_etag.value("_has_zst", nlohmann::json()) != m_has_zst)
+        {
+            m_mod_etag["_has_zst"] = m_has_zst;
+            write_state();
+        }
+    }
+
+    bool MSubdirData::apply_patches()
+    {
+        std::string old_sha256 = m_mod_etag["_sha256"];
+        std::string sha256 = apply_repodata_patches(m_json_fn, m_temp_file->path(), old_sha256);
+        if (sha256.empty())
+        {
+            return false;
+        }
+        if (sha256 == old_sha256)
+        {
+            keep_cache();
+            return true;
+        }
+
+        LOG_INFO << "Patched " << m_json_fn << " to " << sha256;
+        m_download_complete = true;
+        m_mod_etag["_sha256"] = sha256;
         m_temp_file.reset(nullptr);
-        final_file.close();
+        write_state();
 
-        fs::last_write_time(m_json_fn, fs::file_time_type::clock::now());
+        show_progress("Patched", true);
 
+        m_json_cache_valid = true;
+        m_loaded = true;
         return true;
     }
 
+    nlohmann::json MSubdirData::read_state()
+    {
+        nlohmann::json result;
+        if (!fs::exists(m_state_fn))
+        {
+            return result;
+        }
+
+        try
+        {
+            std::ifstream state_file(m_state_fn);
+            nlohmann::json state;
+            state_file >> state;
+            // ignore the state of another repodata file (e.g. written by an
+            // older version that doesn't know about the sidecar)
+            if (state.value("size", std::size_t(0)) != fs::file_size(m_json_fn))
+            {
+                LOG_INFO << "Ignoring outdated " << m_state_fn;
+                return result;
+            }
+            result = mod_etag_of_state(state);
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARNING << "Could not read " << m_state_fn << ": " << e.what();
+            result.clear();
+        }
+        return result;
+    }
+
+    void MSubdirData::write_state()
+    {
+        nlohmann::json state;
+        state["url"] = m_mod_etag.value("_url", "");
+        state["etag"] = m_mod_etag.value("_etag", "");
+        state["mod"] = m_mod_etag.value("_mod", "");
+        state["cache_control"] = m_mod_etag.value("_cache_control", "");
+        state["size"] = fs::file_size(m_json_fn);
+        if (m_mod_etag.contains("_sha256"))
+        {
+            state["sha256"] = m_mod_etag["_sha256"];
+        }
+        if (m_mod_etag.contains("_has_zst"))
+        {
+            state["has_zst"] = m_mod_etag["_has_zst"];
+        }
+
+        std::string temp_fn = m_state_fn + ".tmp";
+        {
+            std::ofstream state_file(temp_fn);
+            state_file << state.dump(4);
+            if (!state_file)
+            {
+                LOG_WARNING << "Could not write " << m_state_fn << ": " << strerror(errno);
+                return;
+            }
+        }
+        fs::rename(temp_fn, m_state_fn);
+    }
+
+    bool MSubdirData::read_missing_state() const
+    {
+        try
+        {
+            std::ifstream state_file(m_state_fn);
+            nlohmann::json state;
+            state_file >> state;
+            return state.value("url", "") == m_repodata_url && state.value("missing", false)
+                   && std::time(nullptr) - state.value("last_checked", std::time_t(0))
+                          < MISSING_RECHECK_SECONDS;
+        }
+        catch (const std::exception&)
+        {
+            return false;
+        }
+    }
+
+    void MSubdirData::write_missing_state() const
+    {
+        nlohmann::json state = { { "url", m_repodata_url },
+                                 { "missing", true },
+                                 { "last_checked", std::time(nullptr) } };
+        std::string temp_fn = m_state_fn + ".tmp";
+        {
+            std::ofstream state_file(temp_fn);
+            state_file << state.dump(4);
+            if (!state_file)
+            {
+                LOG_WARNING << "Could not write " << m_state_fn << ": " << strerror(errno);
+                return;
+            }
+        }
+        fs::rename(temp_fn, m_state_fn);
+    }
+
+    std::unique_ptr<TemporaryFile> MSubdirData::make_temp_file() const
+    {
+        // next to the cache so that the download can be renamed into place
+        fs::path cache_dir = fs::path(m_json_fn).parent_path();
+        if (fs::is_directory(cache_dir))
+        {
+            return std::make_unique<TemporaryFile>("mambaf", "", cache_dir);
+        }
+        return std::make_unique<TemporaryFile>();
+    }
+
     bool MSubdirData::decompress()
     {
         LOG_INFO << "Decompressing metadata";
-        auto json_temp_file = std::make_unique<TemporaryFile>();
+        auto json_temp_file = make_temp_file();
         bool result = decompress::raw(m_temp_file->path(), json_temp_file->path());
         if (!result)
         {
@@ -328,18 +687,83 @@ namespace mamba
 
     void MSubdirData::create_target(nlohmann::json& mod_etag)
     {
-        m_temp_file = std::make_unique<TemporaryFile>();
-        m_progress_bar = Console::instance().add_progress_bar(m_name);
-        m_target = std::make_unique<DownloadTarget>(m_name, m_repodata_url, m_temp_file->path());
-        m_target->set_progress_bar(m_progress_bar);
+        if (mod_etag.contains("_has_zst"))
+        {
+            m_has_zst = mod_etag["_has_zst"];
+        }
+        m_zst = use_zst();
+        std::string url = m_zst ? m_repodata_url + ".zst" : m_repodata_url;
+
+        // a stale cache of known content can be brought up to date with patches
+        m_patching = Context::instance().repodata_use_patches && !m_optional
+                     && mod_etag.contains("_sha256") && ends_with(m_repodata_url, ".json")
+                     && fs::exists(m_json_fn);
+        if (m_patching)
+        {
+            url = m_repodata_url.substr(0, m_repodata_url.size() - 5) + ".jlap";
+        }
+
+        m_temp_file = make_temp_file();
+        m_target = std::make_unique<DownloadTarget>(m_name, url, m_temp_file->path());
+        m_target->set_zstd_decompression(m_zst && !m_patching);
+        m_target->compute_checksums(!m_patching, false);
+        if (m_has_progress_bar)
+        {
+            m_progress_bar = Console::instance().add_progress_bar(m_name);
+            m_target->set_progress_bar(m_progress_bar);
+        }
         // if we get something _other_ than the noarch, we DO NOT throw if the file
-        // can't be retrieved
-        if (!m_is_noarch)
+        // can't be retrieved. Neither when there is something to fall back to.
+        if (!m_is_noarch || m_zst || m_patching)
         {
             m_target->set_ignore_failure(true);
         }
         m_target->set_finalize_callback(&MSubdirData::finalize_transfer, this);
-        m_target->set_mod_etag_headers(mod_etag);
+        if (!m_patching)
+        {
+            m_target->set_mod_etag_headers(mod_etag);
+        }
+        m_target->set_mirrors(get_mirror_urls(url));
+        m_target->set_race_mirrors(Context::instance().mirror_racing);
+    }
+
+    void MSubdirData::show_progress(const std::string& postfix, bool completed)
+    {
+        if (!m_has_progress_bar)
+        {
+            return;
+        }
+        m_progress_bar.set_postfix(postfix);
+        if (completed)
+        {
+            m_progress_bar.set_full();
+            m_progress_bar.mark_as_completed();
+        }
+    }
+
+    bool MSubdirData::use_zst() const
+    {
+        if (!Context::instance().repodata_use_zst || m_optional
+            || !ends_with(m_repodata_url, ".json"))
+        {
+            return false;
+        }
+        if (!m_has_zst.is_object() || m_has_zst.value("value", false))
+        {
+            return true;
+        }
+        return std::time(nullptr) - m_has_zst.value("last_checked", std::time_t(0))
+               > ZST_RECHECK_SECONDS;
+    }
+
+    void MSubdirData::fall_back_to_full()
+    {
+        std::string url = m_zst ? m_repodata_url + ".zst" : m_repodata_url;
+        m_target->fall_back_to(url);
+        m_target->set_ignore_failure(!m_is_noarch || m_zst);
+        m_target->set_zstd_decompression(m_zst);
+        m_target->set_mirrors(get_mirror_urls(url));
+        m_target->set_mod_etag_headers(m_mod_etag);
     }
 
     std::size_t MSubdirData::get_cache_control_max_age(const std::string& val)
@@ -423,14 +847,437 @@ namespace mamba
         return cache_dir;
     }
 
+    static std::string sha256_hex(const std::string& data)
+    {
+        validate::Hasher hasher(validate::Hasher::Algorithm::sha256);
+        hasher.update(data.data(), data.size());
+        return hasher.hex_digest();
+    }
+
+    RepoSnapshot::RepoSnapshot(const fs::path& cache_dir,
+                               const std::vector<std::shared_ptr<MSubdirData>>& subdirs,
+                               const std::vector<std::pair<int, int>>& priorities)
+    {
+        std::string urls;
+        nlohmann::json key = { { "tool_version", mamba_tool_version() },
+                               { "filters", repodata_filters_key() },
+                               { "repos", nlohmann::json::array() } };
+        for (std::size_t i = 0; i < subdirs.size(); ++i)
+        {
+            if (!subdirs[i]->loaded())
+            {
+                continue;
+            }
+            m_metadata.push_back(subdirs[i]->repo_metadata());
+            m_priorities.push_back(priorities[i]);
+
+            nlohmann::json repo = subdirs[i]->cache_identity();
+            repo["pip_added"] = m_metadata.back().pip_added;
+            repo["priority"] = { priorities[i].first, priorities[i].second };
+            key["repos"].push_back(repo);
+            urls += m_metadata.back().url + "\n";
+        }
+        m_key = sha256_hex(key.dump());
+        // one snapshot per channel set, replaced when the repodata change
+        m_path = cache_dir / ("pool-" + sha256_hex(urls).substr(0, 8) + ".solvs");
+    }
+
+    const fs::path& RepoSnapshot::path() const
+    {
+        return m_path;
+    }
+
+    std::vector<MRepo> RepoSnapshot::load(MPool& pool) const
+    {
+        std::vector<MRepo> repos;
+        if (m_metadata.empty() || !fs::exists(m_path))
+        {
+            return repos;
+        }
+
+        std::FILE* fp = std::fopen(m_path.string().c_str(), "rb");
+        if (!fp)
+        {
+            return repos;
+        }
+        try
+        {
+            // footer: {"key": ..., "offsets": [...]} followed by its offset
+            char offset_str[SNAPSHOT_FOOTER_OFFSET_SIZE + 1] = {};
+            if (std::fseek(fp, -SNAPSHOT_FOOTER_OFFSET_SIZE, SEEK_END) != 0
+                || std::fread(offset_str, 1, SNAPSHOT_FOOTER_OFFSET_SIZE, fp)
+                       != SNAPSHOT_FOOTER_OFFSET_SIZE)
+            {
+                throw std::runtime_error("truncated file");
+            }
+            long footer_offset = std::stol(offset_str);
+            long footer_end = std::ftell(fp) - SNAPSHOT_FOOTER_OFFSET_SIZE;
+            std::string footer_str(footer_end - footer_offset, '\0');
+            std::fseek(fp, footer_offset, SEEK_SET);
+            if (std::fread(footer_str.data(), 1, footer_str.size(), fp) != footer_str.size())
+            {
+                throw std::runtime_error("truncated file");
+            }
+            auto footer = nlohmann::json::parse(footer_str);
+            if (footer.at("key") != m_key || footer.at("offsets").size() != m_metadata.size())
+            {
+                LOG_INFO << "Repo snapshot " << m_path << " is outdated";
+                std::fclose(fp);
+                return repos;
+            }
+
+            for (std::size_t i = 0; i < m_metadata.size(); ++i)
+            {
+                std::fseek(fp, footer["offsets"][i].get<long>(), SEEK_SET);
+                repos.push_back(MRepo(pool, fp, m_metadata[i]));
+                repos.back().set_priority(m_priorities[i].first, m_priorities[i].second);
+            }
+            LOG_INFO << "Loaded " << repos.size() << " repos from snapshot " << m_path;
+            // its age tells when it was last used
+            std::error_code ec;
+            fs::last_write_time(m_path, fs::file_time_type::clock::now(), ec);
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARNING << "Could not load repo snapshot " << m_path << ": " << e.what();
+            for (auto it = repos.rbegin(); it != repos.rend(); ++it)
+            {
+                it->clear(false);
+            }
+            repos.clear();
+        }
+        std::fclose(fp);
+        return repos;
+    }
+
+    bool RepoSnapshot::write(std::vector<MRepo>& repos) const
+    {
+        if (repos.empty() || repos.size() != m_metadata.size())
+        {
+            return false;
+        }
+
+        std::string data;
+        nlohmann::json footer = { { "key", m_key }, { "offsets", nlohmann::json::array() } };
+        for (auto& repo : repos)
+        {
+            std::string repo_data;
+            if (!write_solv(repo.repo(), repo_data))
+            {
+                LOG_WARNING << "Could not write repo snapshot " << m_path << ": "
+                            << pool_errstr(repo.repo()->pool);
+                return false;
+            }
+            footer["offsets"].push_back(data.size());
+            data += repo_data;
+        }
+        std::size_t footer_offset = data.size();
+        data += footer.dump();
+        std::string offset_str = std::to_string(footer_offset);
+        data += std::string(SNAPSHOT_FOOTER_OFFSET_SIZE - offset_str.size(), '0') + offset_str;
+        SolvWriter::instance().write(m_path, std::move(data));
+        LOG_INFO << "Queued repo snapshot " << m_path;
+
+        // only the most recently used snapshots of other channel sets are kept
+        std::error_code ec;
+        std::vector<std::pair<fs::file_time_type, fs::path>> others;
+        for (const auto& entry : fs::directory_iterator(m_path.parent_path(), ec))
+        {
+            std::string name = entry.path().filename().string();
+            if (entry.path() != m_path && starts_with(name, "pool-") && ends_with(name, ".solvs"))
+            {
+                others.emplace_back(fs::last_write_time(entry.path(), ec), entry.path());
+            }
+        }
+        std::sort(others.begin(), others.end(), std::greater<>());
+        for (std::size_t i = MAX_REPO_SNAPSHOTS - 1; i < others.size(); ++i)
+        {
+            LOG_INFO << "Removing repo snapshot " << others[i].second;
+            fs::remove(others[i].second, ec);
+        }
+        return true;
+    }
+
+    std::string apply_repodata_patches(const fs::path& repodata_fn,
+                                       const fs::path& patch_log_fn,
+                                       const std::string& sha256)
+    {
+        // patches by the hash of the version they apply to
+        std::map<std::string, nlohmann::json> patches;
+        std::string latest;
+        try
+        {
+            std::ifstream patch_log(patch_log_fn);
+            std::string line;
+            while (std::getline(patch_log, line))
+            {
+                if (line.empty())
+                {
+                    continue;
+                }
+                auto entry = nlohmann::json::parse(line);
+                if (entry.contains("latest"))
+                {
+                    latest = entry["latest"].get<std::string>();
+                }
+                else
+                {
+                    patches.emplace(entry.at("from").get<std::string>(), std::move(entry));
+                }
+            }
+        }
+        catch (const nlohmann::json::exception& e)
+        {
+            LOG_WARNING << "Could not read patch log " << patch_log_fn << ": " << e.what();
+            return "";
+        }
+        if (latest.empty())
+        {
+            LOG_INFO << "Patch log " << patch_log_fn << " is incomplete";
+            return "";
+        }
+        if (latest == sha256)
+        {
+            return latest;
+        }
+
+        std::string patched;
+        try
+        {
+            // all the patches from our version to the latest one, as a single patch
+            nlohmann::json operations = nlohmann::json::array();
+            std::string current = sha256;
+            while (current != latest)
+            {
+                auto it = patches.find(current);
+                if (it == patches.end())
+                {
+                    LOG_INFO << "Repodata " << current << " is not in patch log " << patch_log_fn;
+                    return "";
+                }
+                for (auto& op : it->second.at("patch"))
+                {
+                    operations.push_back(std::move(op));
+                }
+                current = it->second.at("to").get<std::string>();
+                // a cycle ends up here
+                patches.erase(it);
+            }
+
+            nlohmann::json repodata;
+            std::ifstream repodata_file(repodata_fn);
+            repodata_file >> repodata;
+            patched = repodata.patch(operations).dump();
+        }
+        catch (const nlohmann::json::exception& e)
+        {
+            LOG_WARNING << "Could not patch " << repodata_fn << ": " << e.what();
+            return "";
+        }
+
+        if (sha256_hex(patched) != latest)
+        {
+            LOG_WARNING << "Patched " << repodata_fn << " does not match " << latest;
+            return "";
+        }
+
+        TemporaryFile temp_file("mambaf", "", repodata_fn.parent_path());
+        {
+            std::ofstream out(temp_file.path());
+            out << patched;
+            if (!out)
+            {
+                LOG_WARNING << "Could not write " << temp_file.path() << ": " << strerror(errno);
+                return "";
+            }
+        }
+        fs::rename(temp_file.path(), repodata_fn);
+        return latest;
+    }
+
+    RepoMetadata MSubdirData::repo_metadata() const
+    {
+        auto header = [this](const char* key) {
+            return m_mod_etag.is_object() ? m_mod_etag.value(key, "") : std::string();
+        };
+        return { m_repodata_url,
+                 Context::instance().add_pip_as_python_dependency,
+                 header("_etag"),
+                 header("_mod"),
+                 header("_sha256") };
+    }
+
+    nlohmann::json MSubdirData::cache_identity() const
+    {
+        RepoMetadata meta = repo_metadata();
+        nlohmann::json identity
+            = { { "url", meta.url }, { "etag", meta.etag }, { "mod", meta.mod } };
+        // patched repodata keeps the headers of the download it started from
+        identity["size"] = fs::exists(m_json_fn) ? fs::file_size(m_json_fn) : 0;
+        if (m_mod_etag.contains("_sha256"))
+        {
+            identity["sha256"] = m_mod_etag["_sha256"];
+        }
+        return identity;
+    }
+
+    std::vector<std::string> MSubdirData::solv_files() const
+    {
+        std::vector<std::string> files;
+        if (m_solv_cache_valid)
+        {
+            files.push_back(m_solv_fn);
+        }
+        std::string sha256 = repo_metadata().sha256;
+        if (sha256.empty())
+        {
+            return files;
+        }
+
+        // the .solv caches of the same repodata in the shared caches, they are
+        // checked against its hash when they are read
+        for (const auto& cache_dir : Context::instance().shared_index_caches)
+        {
+            fs::path solv_fn = cache_dir / fs::path(m_solv_fn).filename();
+            fs::path state_fn = cache_dir / fs::path(m_state_fn).filename();
+            if (!fs::exists(solv_fn) || !fs::exists(state_fn))
+            {
+                continue;
+            }
+            try
+            {
+                std::ifstream state_file(state_fn);
+                nlohmann::json state;
+                state_file >> state;
+                if (state.value("sha256", "") == sha256)
+                {
+                    files.push_back(solv_fn.string());
+                }
+            }
+            catch (const std::exception& e)
+            {
+                LOG_INFO << "Could not read " << state_fn << ": " << e.what();
+            }
+        }
+        return files;
+    }
+
     MRepo MSubdirData::create_repo(MPool& pool)
     {
-        RepoMetadata meta{ m_repodata_url,
-                           Context::instance().add_pip_as_python_dependency,
-                           m_mod_etag["_etag"],
-                           m_mod_etag["_mod"] };
+        if (!m_json_cache_valid)
+        {
+            throw std::runtime_error("Cache not loaded!");
+        }
+        return MRepo(pool, m_name, m_json_fn, solv_files(), m_solv_fn, repo_metadata());
+    }
 
-        return MRepo(pool, m_name, cache_path(), meta);
+    bool MSubdirData::stage_repo()
+    {
+        if (!m_json_cache_valid || !solv_files().empty())
+        {
+            return true;
+        }
+        try
+        {
+            MPool staging_pool;
+            MRepo repo(staging_pool, m_name, m_json_fn, repo_metadata());
+            // off the critical path, create_repo then finds the .solv
+            SolvWriter::instance().wait();
+        }
+        catch (const std::exception& e)
+        {
+            // create_repo will fail the same way, and handle it
+            LOG_INFO << "Could not stage " << m_name << ": " << e.what();
+            return false;
+        }
+        m_solv_cache_valid = fs::exists(m_solv_fn);
+        return m_solv_cache_valid;
+    }
+
+    RepodataRefresher::RepodataRefresher(
+        const fs::path& cache_dir, const std::vector<std::shared_ptr<MSubdirData>>& subdirs)
+    {
+        for (const auto& subdir : subdirs)
+        {
+            if (subdir && subdir->stale())
+            {
+                m_subdirs.push_back(subdir->revalidation());
+            }
+        }
+        if (m_subdirs.empty() || Context::instance().offline)
+        {
+            m_subdirs.clear();
+            return;
+        }
+
+        LOG_INFO << "Revalidating " << m_subdirs.size() << " stale repodata in the background";
+        m_thread = thread([this, cache_dir]() {
+            try
+            {
+                LockFile lock(cache_dir / "mamba.lock");
+                // packages are downloaded on the main thread meanwhile
+                MultiDownloadTarget multi_dl(false);
+                for (auto& subdir : m_subdirs)
+                {
+                    multi_dl.add(subdir->target());
+                }
+                multi_dl.download(false);
+            }
+            catch (const std::exception& e)
+            {
+                // the next command will try again
+                LOG_WARNING << "Could not revalidate repodata: " << e.what();
+            }
+        });
+    }
+
+    RepodataRefresher::~RepodataRefresher()
+    {
+        wait();
+    }
+
+    std::size_t RepodataRefresher::size() const
+    {
+        return m_subdirs.size();
+    }
+
+    void RepodataRefresher::wait()
+    {
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+    }
+
+    void stage_repos(const std::vector<std::shared_ptr<MSubdirData>>& subdirs,
+                     std::size_t max_threads)
+    {
+        std::size_t n_threads = std::min(subdirs.size(), max_threads);
+        if (n_threads < 2)
+        {
+            return;
+        }
+
+        std::atomic<std::size_t> next(0);
+        auto stage = [&subdirs, &next]() {
+            for (std::size_t i = next++; i < subdirs.size(); i = next++)
+            {
+                if (subdirs[i]->loaded())
+                {
+                    subdirs[i]->stage_repo();
+                }
+            }
+        };
+
+        std::vector<thread> threads;
+        for (std::size_t i = 0; i < n_threads; ++i)
+        {
+            threads.emplace_back(stage);
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
     }
 
     void MSubdirData::clear_cache()
@@ -443,5 +1290,9 @@ namespace mamba
         {
             fs::remove(m_solv_fn);
         }
+        if (fs::exists(m_state_fn))
+        {
+            fs::remove(m_state_fn);
+        }
     }
 }  // namespace mamba
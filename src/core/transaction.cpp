@@ -4,7 +4,10 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <stack>
 #include <thread>
 
@@ -105,7 +108,8 @@ namespace mamba
         }
         interruption_point();
 
-        if (!m_sha256.empty() && !validate::sha256(m_tarball_path, m_sha256))
+        // the checksums were computed while downloading, no need to read the file again
+        if (!m_sha256.empty() && m_target->sha256sum != m_sha256)
         {
             m_validation_result = SHA256_ERROR;
             m_progress_proxy.mark_as_completed("SHA256 sum validation error.");
@@ -114,7 +118,7 @@ namespace mamba
         }
         else
         {
-            if (!m_md5.empty() && !validate::md5(m_tarball_path, m_md5))
+            if (!m_md5.empty() && m_target->md5sum != m_md5)
             {
                 m_validation_result = MD5SUM_ERROR;
                 m_progress_proxy.mark_as_completed("MD5 sum validation error.");
@@ -134,11 +138,24 @@ namespace mamba
             std::lock_guard<std::mutex> lock(PackageDownloadExtractTarget::extract_mutex);
             interruption_point();
             m_progress_proxy.set_postfix("Decompressing...");
-            LOG_INFO << "Decompressing " << m_tarball_path;
+            LOG_INFO << (m_streamed ? "Moving extracted " : "Decompressing ") << m_tarball_path;
             fs::path extract_path;
             try
             {
-                extract_path = mamba::extract(m_tarball_path);
+                if (m_streamed)
+                {
+                    // extracted while downloading and validated, only needs to be moved
+                    extract_path = strip_package_extension(m_tarball_path);
+                    if (fs::exists(extract_path))
+                    {
+                        fs::remove_all(extract_path);
+                    }
+                    fs::rename(m_staging_path, extract_path);
+                }
+                else
+                {
+                    extract_path = mamba::extract(m_tarball_path);
+                }
                 interruption_point();
                 LOG_INFO << "Extracted to " << extract_path;
                 write_repodata_record(extract_path);
@@ -173,9 +190,67 @@ namespace mamba
         return true;
     }
 
+    void PackageDownloadExtractTarget::stream_extract(std::size_t available)
+    {
+        if (m_staging_path.empty())
+        {
+            return;
+        }
+        if (available == 0)
+        {
+            // the download restarted, what was extracted so far is garbage
+            m_streaming_extractor.reset();
+            fs::remove_all(m_staging_path);
+            return;
+        }
+        if (!m_streaming_extractor)
+        {
+            try
+            {
+                fs::remove_all(m_staging_path);
+                m_streaming_extractor
+                    = std::make_unique<StreamingExtractor>(m_tarball_path, m_staging_path);
+            }
+            catch (const std::exception& e)
+            {
+                LOG_WARNING << "Could not extract " << m_name << " while downloading: " << e.what();
+                m_staging_path.clear();
+                return;
+            }
+        }
+        m_streaming_extractor->set_available(available);
+    }
+
+    bool PackageDownloadExtractTarget::finish_streaming_extraction()
+    {
+        if (!m_streaming_extractor)
+        {
+            return false;
+        }
+
+        // only keep what was extracted if the whole download is valid
+        bool valid = m_validation_result == VALIDATION_RESULT::VALID;
+        m_streaming_extractor->finish(valid);
+        m_streamed = m_streaming_extractor->wait() && valid;
+        if (valid && !m_streamed)
+        {
+            LOG_INFO << "Extraction of " << m_name
+                     << " while downloading failed, extracting the tarball instead: "
+                     << m_streaming_extractor->error();
+        }
+        m_streaming_extractor.reset();
+
+        if (!m_streamed)
+        {
+            fs::remove_all(m_staging_path);
+        }
+        return m_streamed;
+    }
+
     bool PackageDownloadExtractTarget::validate_extract()
     {
         validate();
+        finish_streaming_extraction();
         // Validation
         if (m_validation_result != VALIDATION_RESULT::VALID)
         {
@@ -226,6 +301,12 @@ namespace mamba
     void PackageDownloadExtractTarget::clear_cache() const
     {
         fs::remove_all(m_tarball_path);
+        fs::remove(m_tarball_path.string() + MAMBA_RESUME_STATE_SUFFIX);
+        fs::remove(m_tarball_path.string() + MAMBA_SEGMENTS_STATE_SUFFIX);
+        if (!m_staging_path.empty())
+        {
+            fs::remove_all(m_staging_path);
+        }
         fs::path dest_dir = strip_package_extension(m_tarball_path);
         if (fs::exists(dest_dir))
         {
@@ -273,7 +354,17 @@ namespace mamba
                 m_target->set_finalize_callback(&PackageDownloadExtractTarget::finalize_callback,
                                                 this);
                 m_target->set_expected_size(m_expected_size);
+                m_target->set_mirrors(get_mirror_urls(m_url));
+                m_target->set_resumable(true);
+                m_target->compute_checksums(!m_sha256.empty(), !m_md5.empty());
                 m_target->set_progress_bar(m_progress_proxy);
+                if (Context::instance().extract_while_downloading
+                    && (ends_with(m_filename, ".tar.bz2") || ends_with(m_filename, ".conda")))
+                {
+                    m_staging_path = strip_package_extension(m_tarball_path).string() + ".staging";
+                    m_target->set_write_observer(
+                        [this](std::size_t available) { stream_extract(available); });
+                }
                 return m_target.get();
             }
         }
@@ -314,7 +405,7 @@ namespace mamba
                 "Cannot create transaction without calling solver.solve() first.");
         }
 
-        m_transaction = solver_create_transaction(solver);
+        m_transaction = solver.create_transaction();
         transaction_order(m_transaction, 0);
 
         auto* pool = static_cast<Solver*>(solver)->pool;
@@ -718,10 +809,98 @@ namespace mamba
         };
 
         add_json(to_fetch, "FETCH");
+        if (!to_fetch.empty())
+        {
+            JsonLogger::instance().json_write(
+                { { "FETCH_ORDER", download_order_str(Context::instance().download_order) } });
+        }
         add_json(to_link, "LINK");
         add_json(to_unlink, "UNLINK");
     }
 
+    std::vector<std::size_t> MTransaction::download_priorities(DownloadOrder order)
+    {
+        std::vector<std::size_t> priorities(m_to_install.size(), 0);
+        if (order == DownloadOrder::kFifo)
+        {
+            return priorities;
+        }
+
+        for (std::size_t i = 0; i < m_to_install.size(); ++i)
+        {
+            priorities[i] = solvable_lookup_num(m_to_install[i], SOLVABLE_DOWNLOADSIZE, 0);
+        }
+        if (order == DownloadOrder::kLargestFirst)
+        {
+            return priorities;
+        }
+
+        // critical path: weight of the heaviest chain going from a package
+        // through the packages that depend on it
+        Pool* pool = m_transaction->pool;
+        std::map<Id, std::size_t> index;
+        for (std::size_t i = 0; i < m_to_install.size(); ++i)
+        {
+            index[pool_solvable2id(pool, m_to_install[i])] = i;
+        }
+
+        std::vector<std::vector<std::size_t>> dependents(m_to_install.size());
+        for (std::size_t i = 0; i < m_to_install.size(); ++i)
+        {
+            Solvable* s = m_to_install[i];
+            if (!s->requires)
+            {
+                continue;
+            }
+            for (Id* reqp = s->repo->idarraydata + s->requires; *reqp; ++reqp)
+            {
+                if (*reqp == SOLVABLE_PREREQMARKER)
+                {
+                    continue;
+                }
+                Id p, pp;
+                FOR_PROVIDES(p, pp, *reqp)
+                {
+                    auto it = index.find(p);
+                    if (it != index.end() && it->second != i)
+                    {
+                        dependents[it->second].push_back(i);
+                    }
+                }
+            }
+        }
+
+        enum class state
+        {
+            todo,
+            visiting,
+            done
+        };
+        std::vector<state> states(m_to_install.size(), state::todo);
+        std::vector<std::size_t> weights(priorities);
+        std::function<std::size_t(std::size_t)> weight = [&](std::size_t i) -> std::size_t {
+            // a dependency cycle contributes nothing more
+            if (states[i] != state::todo)
+            {
+                return states[i] == state::done ? weights[i] : 0;
+            }
+            states[i] = state::visiting;
+            std::size_t heaviest_dependent = 0;
+            for (std::size_t d : dependents[i])
+            {
+                heaviest_dependent = std::max(heaviest_dependent, weight(d));
+            }
+            weights[i] = priorities[i] + heaviest_dependent;
+            states[i] = state::done;
+            return weights[i];
+        };
+        for (std::size_t i = 0; i < m_to_install.size(); ++i)
+        {
+            weight(i);
+        }
+        return weights;
+    }
+
     bool MTransaction::fetch_extract_packages(std::vector<MRepo*>& repos)
     {
         std::vector<std::unique_ptr<PackageDownloadExtractTarget>> targets;
@@ -729,8 +908,10 @@ namespace mamba
 
         Console::instance().init_multi_progress(ProgressBarMode::aggregated);
 
-        for (auto& s : m_to_install)
+        auto priorities = download_priorities(Context::instance().download_order);
+        for (std::size_t i = 0; i < m_to_install.size(); ++i)
         {
+            Solvable* s = m_to_install[i];
             std::string url;
             MRepo* mamba_repo = nullptr;
             for (auto& r : repos)
@@ -768,7 +949,12 @@ namespace mamba
             }
 
             targets.emplace_back(std::make_unique<PackageDownloadExtractTarget>(s));
-            multi_dl.add(targets[targets.size() - 1]->target(m_cache_path, m_multi_cache));
+            DownloadTarget* target = targets.back()->target(m_cache_path, m_multi_cache);
+            if (target)
+            {
+                target->set_priority(priorities[i]);
+            }
+            multi_dl.add(target);
         }
 
         interruption_guard g([]() { Console::instance().init_multi_progress(); });
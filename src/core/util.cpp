@@ -142,12 +142,15 @@ namespace mamba
         return m_path;
     }
 
-    TemporaryFile::TemporaryFile(const std::string& prefix, const std::string& suffix)
+    TemporaryFile::TemporaryFile(const std::string& prefix,
+                                 const std::string& suffix,
+                                 const fs::path& directory)
     {
         static std::mutex file_creation_mutex;
 
         bool success = false;
-        fs::path temp_path = fs::temp_directory_path(), final_path;
+        fs::path temp_path = directory.empty() ? fs::temp_directory_path() : directory;
+        fs::path final_path;
 
         std::lock_guard<std::mutex> file_creation_lock(file_creation_mutex);
 
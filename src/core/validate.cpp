@@ -12,7 +12,6 @@
 #include "mamba/core/url.hpp"
 #include "mamba/core/util.hpp"
 
-#include "openssl/md5.h"
 #include "openssl/sha.h"
 #include "openssl/evp.h"
 
@@ -82,56 +81,74 @@ namespace validate
     {
     }
 
-    std::string sha256sum(const std::string& path)
+    Hasher::Hasher(Algorithm algorithm)
+        : m_algorithm(algorithm)
+        , m_ctx(EVP_MD_CTX_new())
     {
-        std::array<unsigned char, SHA256_DIGEST_LENGTH> hash;
-
-        SHA256_CTX sha256;
-        SHA256_Init(&sha256);
-
-        std::ifstream infile(path, std::ios::binary);
-
-        constexpr std::size_t BUFSIZE = 32768;
-        std::vector<char> buffer(BUFSIZE);
-
-        while (infile)
+        if (!m_ctx)
         {
-            infile.read(buffer.data(), BUFSIZE);
-            size_t count = infile.gcount();
-            if (!count)
-                break;
-            SHA256_Update(&sha256, buffer.data(), count);
+            throw std::runtime_error("Could not allocate a hash context");
         }
+        reset();
+    }
 
-        SHA256_Final(hash.data(), &sha256);
+    Hasher::~Hasher()
+    {
+        EVP_MD_CTX_free(m_ctx);
+    }
 
-        return ::mamba::hex_string(hash);
+    void Hasher::reset()
+    {
+        const EVP_MD* md = m_algorithm == Algorithm::sha256 ? EVP_sha256() : EVP_md5();
+        EVP_DigestInit_ex(m_ctx, md, nullptr);
     }
 
-    std::string md5sum(const std::string& path)
+    void Hasher::update(const char* data, std::size_t size)
+    {
+        EVP_DigestUpdate(m_ctx, data, size);
+    }
+
+    std::string Hasher::hex_digest()
     {
-        std::array<unsigned char, MD5_DIGEST_LENGTH> hash;
+        std::array<unsigned char, EVP_MAX_MD_SIZE> hash;
+        unsigned int size = 0;
+        EVP_DigestFinal_ex(m_ctx, hash.data(), &size);
+        reset();
+        return ::mamba::hex_string(hash, size);
+    }
 
-        MD5_CTX md5;
-        MD5_Init(&md5);
+    namespace
+    {
+        std::string file_digest(const std::string& path, Hasher::Algorithm algorithm)
+        {
+            Hasher hasher(algorithm);
 
-        std::ifstream infile(path, std::ios::binary);
+            std::ifstream infile(path, std::ios::binary);
 
-        constexpr std::size_t BUFSIZE = 32768;
-        std::vector<char> buffer(BUFSIZE);
+            constexpr std::size_t BUFSIZE = 32768;
+            std::vector<char> buffer(BUFSIZE);
 
-        while (infile)
-        {
-            infile.read(buffer.data(), BUFSIZE);
-            size_t count = infile.gcount();
-            if (!count)
-                break;
-            MD5_Update(&md5, buffer.data(), count);
+            while (infile)
+            {
+                infile.read(buffer.data(), BUFSIZE);
+                size_t count = infile.gcount();
+                if (!count)
+                    break;
+                hasher.update(buffer.data(), count);
+            }
+
+            return hasher.hex_digest();
         }
+    }
 
-        MD5_Final(hash.data(), &md5);
+    std::string sha256sum(const std::string& path)
+    {
+        return file_digest(path, Hasher::Algorithm::sha256);
+    }
 
-        return ::mamba::hex_string(hash);
+    std::string md5sum(const std::string& path)
+    {
+        return file_digest(path, Hasher::Algorithm::md5);
     }
 
     bool sha256(const std::string& path, const std::string& validation)
@@ -79,6 +79,21 @@ PYBIND11_MODULE(mamba_api, m)
             return self.execute(target_prefix);
         });
 
+    py::class_<SolveStats>(m, "SolveStats")
+        .def_readonly("createwhatprovides_ms", &SolveStats::createwhatprovides_ms)
+        .def_readonly("rule_creation_ms", &SolveStats::rule_creation_ms)
+        .def_readonly("propagation_ms", &SolveStats::propagation_ms)
+        .def_readonly("solve_ms", &SolveStats::solve_ms)
+        .def_readonly("rules", &SolveStats::rules)
+        .def_readonly("learned_rules", &SolveStats::learned_rules)
+        .def_readonly("decisions", &SolveStats::decisions)
+        .def_readonly("problems", &SolveStats::problems)
+        .def_readonly("pruned_solvables", &SolveStats::pruned_solvables)
+        .def_readonly("from_cache", &SolveStats::from_cache)
+        .def_readonly("pool_size", &SolveStats::pool_size)
+        .def_readonly("repo_sizes", &SolveStats::repo_sizes)
+        .def_readonly("jobs", &SolveStats::jobs);
+
     py::class_<MSolver>(m, "Solver")
         .def(py::init<MPool&, std::vector<std::pair<int, int>>>())
         .def(py::init<MPool&, std::vector<std::pair<int, int>>, const PrefixData*>())
@@ -89,7 +104,13 @@ PYBIND11_MODULE(mamba_api, m)
         .def("set_postsolve_flags", &MSolver::set_postsolve_flags)
         .def("is_solved", &MSolver::is_solved)
         .def("problems_to_str", &MSolver::problems_to_str)
-        .def("solve", &MSolver::solve);
+        .def("solve", &MSolver::solve)
+        .def("set_solve_cache", &MSolver::set_solve_cache)
+        .def("from_cache", &MSolver::from_cache)
+        .def_readwrite("prune_unreachable", &MSolver::prune_unreachable)
+        .def("pruned_solvables", &MSolver::pruned_solvables)
+        .def("stats", &MSolver::stats)
+        .def_readwrite("log_json", &MSolver::log_json);
 
     py::class_<History>(m, "History")
         .def(py::init<const std::string&>())
@@ -199,6 +220,11 @@ PYBIND11_MODULE(mamba_api, m)
         .value("kStrict", ChannelPriority::kStrict)
         .value("kDisabled", ChannelPriority::kDisabled);
 
+    py::enum_<DownloadOrder>(m, "DownloadOrder")
+        .value("kFifo", DownloadOrder::kFifo)
+        .value("kLargestFirst", DownloadOrder::kLargestFirst)
+        .value("kCriticalPath", DownloadOrder::kCriticalPath);
+
     py::class_<Context, std::unique_ptr<Context, py::nodelete>>(m, "Context")
         .def(
             py::init([]() { return std::unique_ptr<Context, py::nodelete>(&Context::instance()); }))
@@ -207,8 +233,19 @@ PYBIND11_MODULE(mamba_api, m)
         .def_readwrite("json", &Context::json)
         .def_readwrite("offline", &Context::offline)
         .def_readwrite("local_repodata_ttl", &Context::local_repodata_ttl)
+        .def_readwrite("repodata_max_stale", &Context::repodata_max_stale)
+        .def_readwrite("channel_repodata_max_stale", &Context::channel_repodata_max_stale)
+        .def_readwrite("repodata_use_patches", &Context::repodata_use_patches)
+        .def_readwrite("repodata_use_zst", &Context::repodata_use_zst)
+        .def_readwrite("repodata_use_shards", &Context::repodata_use_shards)
         .def_readwrite("use_index_cache", &Context::use_index_cache)
+        .def_readwrite("shared_index_caches", &Context::shared_index_caches)
         .def_readwrite("max_parallel_downloads", &Context::max_parallel_downloads)
+        .def_readwrite("use_http2", &Context::use_http2)
+        .def_readwrite("download_order", &Context::download_order)
+        .def_readwrite("extract_while_downloading", &Context::extract_while_downloading)
+        .def_readwrite("segmented_download_threshold", &Context::segmented_download_threshold)
+        .def_readwrite("download_segments", &Context::download_segments)
         .def_readwrite("always_yes", &Context::always_yes)
         .def_readwrite("dry_run", &Context::dry_run)
         .def_readwrite("ssl_verify", &Context::ssl_verify)
@@ -227,8 +264,19 @@ PYBIND11_MODULE(mamba_api, m)
         .def("set_verbosity", &Context::set_verbosity)
         .def_readwrite("channels", &Context::channels)
         .def_readwrite("custom_channels", &Context::custom_channels)
+        .def_readwrite("mirrored_channels", &Context::mirrored_channels)
+        .def_readwrite("max_retry_after", &Context::max_retry_after)
+        .def_readwrite("mirror_racing", &Context::mirror_racing)
         .def_readwrite("channel_alias", &Context::channel_alias)
         .def_readwrite("use_only_tar_bz2", &Context::use_only_tar_bz2)
+        .def_readwrite("repodata_keep_versions", &Context::repodata_keep_versions)
+        .def_readwrite("repodata_keep_builds", &Context::repodata_keep_builds)
+        .def_readwrite("repodata_exclude_builds", &Context::repodata_exclude_builds)
+        .def_readwrite("repodata_exclude_licenses", &Context::repodata_exclude_licenses)
+        .def_readwrite("repodata_drop_fields", &Context::repodata_drop_fields)
+        .def_readwrite("use_solve_cache", &Context::use_solve_cache)
+        .def_readwrite("prune_pool", &Context::prune_pool)
+        .def_readwrite("solve_portfolio", &Context::solve_portfolio)
         .def_readwrite("channel_priority", &Context::channel_priority);
 
     py::class_<PrefixData>(m, "PrefixData")
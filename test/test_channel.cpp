@@ -231,6 +231,63 @@ namespace mamba
                                              "https://conda.anaconda.org/conda-forge/noarch" }));
     }
 
+    TEST(Channel, mirror_urls)
+    {
+        auto& ctx = Context::instance();
+        ctx.mirrored_channels["conda-forge"]
+            = { "https://mirror.example.com/conda-forge/", "http://other.example.com/cf" };
+
+        EXPECT_EQ(get_mirror_urls("https://conda.anaconda.org/conda-forge/noarch/repodata.json"),
+                  std::vector<std::string>(
+                      { "https://conda.anaconda.org/conda-forge/noarch/repodata.json",
+                        "https://mirror.example.com/conda-forge/noarch/repodata.json",
+                        "http://other.example.com/cf/noarch/repodata.json" }));
+        EXPECT_EQ(get_mirror_urls("http://other.example.com/cf/linux-64/a-1-0.tar.bz2"),
+                  std::vector<std::string>(
+                      { "http://other.example.com/cf/linux-64/a-1-0.tar.bz2",
+                        "https://conda.anaconda.org/conda-forge/linux-64/a-1-0.tar.bz2",
+                        "https://mirror.example.com/conda-forge/linux-64/a-1-0.tar.bz2" }));
+        EXPECT_TRUE(get_mirror_urls("https://conda.anaconda.org/bioconda/noarch/x.json").empty());
+
+        // the credentials of the url never go to another host
+        auto mirrors
+            = get_mirror_urls("https://conda.anaconda.org/t/tk-123/conda-forge/noarch/x.json");
+        EXPECT_EQ(mirrors,
+                  std::vector<std::string>(
+                      { "https://conda.anaconda.org/t/tk-123/conda-forge/noarch/x.json",
+                        "https://mirror.example.com/conda-forge/noarch/x.json",
+                        "http://other.example.com/cf/noarch/x.json" }));
+        mirrors = get_mirror_urls("https://u:p@mirror.example.com/conda-forge/noarch/x.json");
+        EXPECT_EQ(mirrors,
+                  std::vector<std::string>(
+                      { "https://u:p@mirror.example.com/conda-forge/noarch/x.json",
+                        "https://conda.anaconda.org/conda-forge/noarch/x.json",
+                        "http://other.example.com/cf/noarch/x.json" }));
+        for (std::size_t i = 1; i < mirrors.size(); ++i)
+        {
+            EXPECT_EQ(mirrors[i].find("u:p@"), std::string::npos);
+            EXPECT_EQ(mirrors[i].find("tk-123"), std::string::npos);
+        }
+
+        // a mirror keeps the credentials configured with it
+        ctx.mirrored_channels["conda-forge"]
+            = { "https://m:s@mirror.example.com/t/tk-m/conda-forge" };
+        EXPECT_EQ(
+            get_mirror_urls("https://conda.anaconda.org/t/tk-123/conda-forge/noarch/x.json"),
+            std::vector<std::string>(
+                { "https://conda.anaconda.org/t/tk-123/conda-forge/noarch/x.json",
+                  "https://m:s@mirror.example.com/t/tk-m/conda-forge/noarch/x.json" }));
+
+        // resolved again when the setting changes
+        ctx.mirrored_channels["conda-forge"] = { "https://third.example.com/conda-forge" };
+        EXPECT_EQ(get_mirror_urls("https://conda.anaconda.org/conda-forge/noarch/x.json"),
+                  std::vector<std::string>(
+                      { "https://conda.anaconda.org/conda-forge/noarch/x.json",
+                        "https://third.example.com/conda-forge/noarch/x.json" }));
+
+        ctx.mirrored_channels.clear();
+    }
+
     TEST(Channel, add_token)
     {
         auto& ctx = Context::instance();
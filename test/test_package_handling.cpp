@@ -0,0 +1,61 @@
+#include <gtest/gtest.h>
+
+#include "mamba/core/package_handling.hpp"
+#include "mamba/core/util.hpp"
+
+namespace mamba
+{
+    class StreamingExtractorTest : public ::testing::TestWithParam<std::string>
+    {
+    protected:
+        StreamingExtractorTest()
+        {
+            fs::create_directories(tmp_dir.path() / "pkg" / "info");
+            fs::create_directories(tmp_dir.path() / "pkg" / "lib");
+            std::ofstream(tmp_dir.path() / "pkg" / "info" / "index.json") << "{}";
+            std::ofstream data_file(tmp_dir.path() / "pkg" / "lib" / "data.txt");
+            for (int i = 0; i < 100000; ++i)
+            {
+                data_file << i << "\n";
+            }
+            data_file.close();
+
+            archive = tmp_dir.path() / ("pkg-1.0-0" + GetParam());
+            create_package(tmp_dir.path() / "pkg", archive, 1);
+        }
+
+        TemporaryDirectory tmp_dir;
+        fs::path archive;
+    };
+
+    TEST_P(StreamingExtractorTest, extract_in_chunks)
+    {
+        fs::path dest = tmp_dir.path() / "out";
+        auto size = fs::file_size(archive);
+        {
+            StreamingExtractor extractor(archive, dest);
+            for (std::size_t available = 0; available < size; available += 1000)
+            {
+                extractor.set_available(available);
+            }
+            extractor.set_available(size);
+            extractor.finish(true);
+            EXPECT_TRUE(extractor.wait()) << extractor.error();
+        }
+        EXPECT_TRUE(fs::exists(dest / "info" / "index.json"));
+        EXPECT_EQ(fs::file_size(dest / "lib" / "data.txt"),
+                  fs::file_size(tmp_dir.path() / "pkg" / "lib" / "data.txt"));
+    }
+
+    TEST_P(StreamingExtractorTest, cancel)
+    {
+        StreamingExtractor extractor(archive, tmp_dir.path() / "out");
+        extractor.set_available(fs::file_size(archive) / 2);
+        extractor.finish(false);
+        EXPECT_FALSE(extractor.wait());
+    }
+
+    INSTANTIATE_TEST_CASE_P(package_handling,
+                            StreamingExtractorTest,
+                            ::testing::Values(".tar.bz2", ".conda"));
+}  // namespace mamba
@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 
+#include "mamba/api/install.hpp"
 #include "mamba/core/pinning.hpp"
 
 
@@ -99,5 +100,27 @@ namespace mamba
             EXPECT_EQ(pins[0], "numpy=1.13");
             EXPECT_EQ(pins[1], "python=3.7.5");
         }
+
+        TEST(pinning, specs_already_installed)
+        {
+            using detail::specs_already_installed;
+            PrefixData prefix_data("");
+            prefix_data.m_package_records.insert(
+                { "python", PackageInfo("python", "3.7.10", "abcde", 0) });
+            prefix_data.m_package_records.insert(
+                { "numpy", PackageInfo("numpy", "1.20.1", "py37_0", 0) });
+
+            EXPECT_TRUE(specs_already_installed(prefix_data, { "numpy" }, {}));
+            EXPECT_TRUE(specs_already_installed(prefix_data, { "numpy>=1.20", "python" }, {}));
+            EXPECT_FALSE(specs_already_installed(prefix_data, { "numpy<1.20" }, {}));
+            EXPECT_FALSE(specs_already_installed(prefix_data, { "scipy" }, {}));
+            EXPECT_FALSE(specs_already_installed(prefix_data, { "conda-forge::numpy" }, {}));
+            EXPECT_FALSE(specs_already_installed(prefix_data, {}, {}));
+
+            // pins of installed names have to match, the others do not matter
+            EXPECT_TRUE(
+                specs_already_installed(prefix_data, { "numpy" }, { "python 3.7.*", "scipy 1" }));
+            EXPECT_FALSE(specs_already_installed(prefix_data, { "numpy" }, { "numpy 1.19.*" }));
+        }
     }  // namespace testing
 }  // namespace mamba
@@ -0,0 +1,262 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <iterator>
+
+#include "mamba/core/subdirdata.hpp"
+#include "mamba/core/util.hpp"
+
+namespace mamba
+{
+    TEST(repo, stage_repos)
+    {
+#ifdef __linux__
+        TemporaryDirectory tmp_dir;
+        std::vector<std::string> urls;
+        for (std::string subdir : { "linux-64", "noarch" })
+        {
+            fs::path source = tmp_dir.path() / (subdir + ".json");
+            std::ofstream(source) << R"({"info": {"subdir": ")" << subdir << R"("}, "packages": {)"
+                                  << R"("a-1.0-0.tar.bz2": {"name": "a", "version": "1.0",)"
+                                  << R"( "build": "0", "build_number": 0, "depends": []},)"
+                                  << R"("b-2.0-0.tar.bz2": {"name": "b", "version": "2.0",)"
+                                  << R"( "build": "0", "build_number": 0, "depends": ["a"]}}})";
+            urls.push_back("file://" + source.string());
+        }
+
+        // the same repos, with and without staging
+        auto load = [&](const std::string& prefix, bool staged) {
+            std::vector<std::shared_ptr<MSubdirData>> subdirs;
+            MultiDownloadTarget multi_dl;
+            for (const auto& url : urls)
+            {
+                fs::path cache_fn
+                    = tmp_dir.path() / (prefix + std::to_string(subdirs.size()) + ".json");
+                subdirs.push_back(
+                    std::make_shared<MSubdirData>("local", url, cache_fn.string(), false));
+                subdirs.back()->load();
+                multi_dl.add(subdirs.back()->target());
+            }
+            multi_dl.download(true);
+            if (staged)
+            {
+                stage_repos(subdirs, 2);
+                for (auto& subdir : subdirs)
+                {
+                    EXPECT_TRUE(ends_with(subdir->cache_path(), ".solv"));
+                }
+            }
+
+            MPool mpool;
+            for (auto& subdir : subdirs)
+            {
+                subdir->create_repo(mpool);
+            }
+            Pool* pool = mpool;
+            std::vector<std::string> solvables;
+            Id id;
+            Solvable* s;
+            FOR_POOL_SOLVABLES(id)
+            {
+                s = pool_id2solvable(pool, id);
+                solvables.push_back(std::string(s->repo->name) + " " + pool_solvable2str(pool, s));
+            }
+            return solvables;
+        };
+
+        auto serial = load("serial", false);
+        EXPECT_EQ(serial.size(), 4);
+        EXPECT_EQ(load("staged", true), serial);
+#endif
+    }
+
+    TEST(repo, repo_snapshot)
+    {
+#ifdef __linux__
+        TemporaryDirectory tmp_dir;
+        std::vector<std::shared_ptr<MSubdirData>> subdirs;
+        MultiDownloadTarget multi_dl;
+        for (std::string subdir : { "linux-64", "noarch" })
+        {
+            fs::path source = tmp_dir.path() / (subdir + ".json");
+            std::ofstream(source) << R"({"info": {"subdir": ")" << subdir << R"("}, "packages": {)"
+                                  << R"("a-1.0-0.tar.bz2": {"name": "a", "version": "1.0",)"
+                                  << R"( "build": "0", "build_number": 0, "depends": []}}})";
+            fs::path cache_fn = tmp_dir.path() / (subdir + ".cache.json");
+            subdirs.push_back(std::make_shared<MSubdirData>(
+                subdir, "file://" + source.string(), cache_fn.string(), false));
+            subdirs.back()->load();
+            multi_dl.add(subdirs.back()->target());
+        }
+        multi_dl.download(true);
+        std::vector<std::pair<int, int>> priorities = { { 1, 1 }, { 1, 0 } };
+
+        auto solvables = [](MPool& mpool) {
+            Pool* pool = mpool;
+            std::vector<std::string> result;
+            Id id;
+            FOR_POOL_SOLVABLES(id)
+            {
+                Solvable* s = pool_id2solvable(pool, id);
+                result.push_back(std::string(s->repo->name) + " " + pool_solvable2str(pool, s)
+                                 + " " + std::to_string(s->repo->subpriority));
+            }
+            return result;
+        };
+
+        // those of other channel sets, the oldest one goes
+        std::vector<fs::path> other_snapshots;
+        for (int i = 0; i < 4; ++i)
+        {
+            other_snapshots.push_back(tmp_dir.path()
+                                      / ("pool-0000000" + std::to_string(i) + ".solvs"));
+            std::ofstream(other_snapshots.back()) << "x";
+            fs::last_write_time(other_snapshots.back(),
+                                fs::file_time_type::clock::now() - std::chrono::hours(4 - i));
+        }
+
+        RepoSnapshot snapshot(tmp_dir.path(), subdirs, priorities);
+        MPool pool;
+        EXPECT_TRUE(snapshot.load(pool).empty());
+        std::vector<MRepo> repos;
+        for (std::size_t i = 0; i < subdirs.size(); ++i)
+        {
+            repos.push_back(subdirs[i]->create_repo(pool));
+            repos.back().set_priority(priorities[i].first, priorities[i].second);
+        }
+        EXPECT_TRUE(snapshot.write(repos));
+        SolvWriter::instance().wait();
+        EXPECT_FALSE(fs::exists(other_snapshots[0]));
+        for (int i = 1; i < 4; ++i)
+        {
+            EXPECT_TRUE(fs::exists(other_snapshots[i]));
+        }
+
+        MPool snapshot_pool;
+        EXPECT_EQ(snapshot.load(snapshot_pool).size(), 2);
+        EXPECT_EQ(solvables(snapshot_pool), solvables(pool));
+
+        // another priority order needs another snapshot
+        priorities = { { 1, 0 }, { 1, 1 } };
+        MPool other_pool;
+        EXPECT_TRUE(RepoSnapshot(tmp_dir.path(), subdirs, priorities).load(other_pool).empty());
+#endif
+    }
+
+    TEST(repo, repodata_filters)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path json_fn = tmp_dir.path() / "repodata.json";
+        std::string solv_fn = (tmp_dir.path() / "repodata.solv").string();
+        std::ofstream(json_fn)
+            << R"({"info": {"subdir": "linux-64"}, "packages": {)"
+            << R"("a-1.0-0.tar.bz2": {"name": "a", "version": "1.0", "build": "0",)"
+            << R"( "build_number": 0, "license": "MIT"},)"
+            << R"("a-2.0-0.tar.bz2": {"name": "a", "version": "2.0", "build": "0",)"
+            << R"( "build_number": 0, "license": "MIT"},)"
+            << R"("a-2.0-1.tar.bz2": {"name": "a", "version": "2.0", "build": "1",)"
+            << R"( "build_number": 1, "license": "MIT"},)"
+            << R"("a-2.0-pypy_1.tar.bz2": {"name": "a", "version": "2.0", "build": "pypy_1",)"
+            << R"( "build_number": 1, "license": "MIT"},)"
+            << R"("b-1.0-0.tar.bz2": {"name": "b", "version": "1.0", "build": "0",)"
+            << R"( "build_number": 0, "license": "GPL-3.0"}}})";
+        RepoMetadata meta{ "file://" + json_fn.string(), false, "", "", "abc" };
+
+        auto& ctx = Context::instance();
+        auto load = [&]() {
+            MPool mpool;
+            MRepo repo(mpool, "test", json_fn.string(), { solv_fn }, solv_fn, meta);
+            SolvWriter::instance().wait();
+            Pool* pool = mpool;
+            std::vector<std::string> solvables;
+            Id id;
+            FOR_POOL_SOLVABLES(id)
+            {
+                Solvable* s = pool_id2solvable(pool, id);
+                solvables.push_back(std::string(pool_id2str(pool, s->name)) + "-"
+                                    + pool_id2str(pool, s->evr) + "-"
+                                    + solvable_lookup_str(s, SOLVABLE_BUILDFLAVOR)
+                                    + (solvable_lookup_str(s, SOLVABLE_LICENSE) ? " L" : ""));
+            }
+            std::sort(solvables.begin(), solvables.end());
+            return solvables;
+        };
+
+        EXPECT_EQ(load().size(), 5);
+
+        ctx.repodata_keep_versions = 1;
+        ctx.repodata_keep_builds = 1;
+        ctx.repodata_exclude_builds = { "^pypy" };
+        ctx.repodata_exclude_licenses = { "GPL" };
+        ctx.repodata_drop_fields = { "license" };
+        std::vector<std::string> expected = { "a-2.0-1 L" };
+        EXPECT_EQ(load(), expected);
+        // from the .solv made with the same filters, without the dropped fields
+        expected = { "a-2.0-1" };
+        EXPECT_EQ(load(), expected);
+
+        // other filters do not use that .solv
+        ctx.repodata_keep_versions = 0;
+        expected = { "a-1.0-0 L", "a-2.0-1 L" };
+        EXPECT_EQ(load(), expected);
+
+        ctx.repodata_keep_versions = 0;
+        ctx.repodata_keep_builds = 0;
+        ctx.repodata_exclude_builds.clear();
+        ctx.repodata_exclude_licenses.clear();
+        ctx.repodata_drop_fields.clear();
+    }
+
+    TEST(repo, repodata_keep_builds_variants)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path json_fn = tmp_dir.path() / "repodata.json";
+        std::string solv_fn = (tmp_dir.path() / "repodata.solv").string();
+        std::ofstream(json_fn)
+            << R"({"info": {"subdir": "linux-64"}, "packages": {)"
+            << R"("a-1.0-py38_0.tar.bz2": {"name": "a", "version": "1.0", "build": "py38_0",)"
+            << R"( "build_number": 0},)"
+            << R"("a-1.0-py38_1.tar.bz2": {"name": "a", "version": "1.0", "build": "py38_1",)"
+            << R"( "build_number": 1},)"
+            << R"("a-1.0-py39_1.tar.bz2": {"name": "a", "version": "1.0", "build": "py39_1",)"
+            << R"( "build_number": 1}}})";
+        RepoMetadata meta{ "file://" + json_fn.string(), false, "", "", "abc" };
+
+        auto& ctx = Context::instance();
+        ctx.repodata_keep_builds = 1;
+        MPool mpool;
+        MRepo repo(mpool, "test", json_fn.string(), { solv_fn }, solv_fn, meta);
+        SolvWriter::instance().wait();
+        ctx.repodata_keep_builds = 0;
+
+        Pool* pool = mpool;
+        std::vector<std::string> builds;
+        Id id;
+        FOR_POOL_SOLVABLES(id)
+        {
+            builds.push_back(solvable_lookup_str(pool_id2solvable(pool, id), SOLVABLE_BUILDFLAVOR));
+        }
+        std::sort(builds.begin(), builds.end());
+        // the variants of the newest build number are all kept
+        std::vector<std::string> expected = { "py38_1", "py39_1" };
+        EXPECT_EQ(builds, expected);
+    }
+
+    TEST(repo, solv_writer)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path path = tmp_dir.path() / "a.solv";
+        auto& writer = SolvWriter::instance();
+        for (std::string data : { "1", "2", "3" })
+        {
+            writer.write(path, data);
+        }
+        writer.wait();
+        std::ifstream in(path);
+        std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        // the last one queued, and no temporary files left
+        EXPECT_EQ(content, "3");
+        EXPECT_EQ(std::distance(fs::directory_iterator(tmp_dir.path()), fs::directory_iterator()),
+                  1);
+    }
+}  // namespace mamba
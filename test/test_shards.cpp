@@ -0,0 +1,156 @@
+#include <gtest/gtest.h>
+
+#include <map>
+#include <set>
+
+#include "mamba/core/shards.hpp"
+#include "mamba/core/subdirdata.hpp"
+#include "mamba/core/util.hpp"
+#include "mamba/core/validate.hpp"
+
+namespace mamba
+{
+    TEST(shards, repodata_shards)
+    {
+#ifdef __linux__
+        TemporaryDirectory tmp_dir;
+        fs::path cache_dir = tmp_dir.path() / "cache";
+        fs::create_directories(cache_dir);
+
+        // a -> b -> c, d is not reachable, b is in the other subdir
+        std::map<std::string, std::map<std::string, std::vector<std::string>>> channel
+            = { { "linux-64", { { "a", { "b" } }, { "d", { "c" } } } },
+                { "noarch", { { "b", { "c >=1", "__unix" } }, { "c", {} } } } };
+        std::vector<std::shared_ptr<SubdirShards>> subdirs;
+        for (auto& [subdir, packages] : channel)
+        {
+            fs::path subdir_dir = tmp_dir.path() / "channel" / subdir;
+            fs::create_directories(subdir_dir / "shards");
+            nlohmann::json manifest = { { "info", { { "subdir", subdir } } } };
+            for (auto& [name, depends] : packages)
+            {
+                nlohmann::json shard;
+                shard["packages"][name + "-1.0-0.tar.bz2"] = { { "name", name },
+                                                               { "version", "1.0" },
+                                                               { "build", "0" },
+                                                               { "build_number", 0 },
+                                                               { "depends", depends } };
+                fs::path shard_fn = subdir_dir / "shards" / "tmp.json";
+                std::ofstream(shard_fn) << shard.dump();
+                std::string sha256 = validate::sha256sum(shard_fn.string());
+                fs::rename(shard_fn, subdir_dir / "shards" / (sha256 + ".json"));
+                manifest["shards"][name] = sha256;
+            }
+            std::ofstream(subdir_dir / "repodata_shards.json") << manifest.dump();
+
+            subdirs.push_back(std::make_shared<SubdirShards>("channel/" + subdir,
+                                                             "file://" + subdir_dir.string(),
+                                                             cache_dir,
+                                                             subdir == "noarch"));
+        }
+
+        MultiDownloadTarget multi_dl;
+        for (auto& subdir : subdirs)
+        {
+            subdir->manifest().load();
+            multi_dl.add(subdir->manifest().target());
+        }
+        multi_dl.download(true);
+        for (auto& subdir : subdirs)
+        {
+            EXPECT_TRUE(subdir->read_manifest());
+        }
+        fetch_shard_closure(subdirs, { "a" });
+        EXPECT_EQ(fs::directory_iterator(cache_dir / "shards")->path().extension(), ".json");
+
+        MPool mpool;
+        for (auto& subdir : subdirs)
+        {
+            std::shared_ptr<MSubdirData> sdir = subdir->subdir_data();
+            EXPECT_TRUE(sdir->loaded());
+            sdir->create_repo(mpool);
+        }
+        SolvWriter::instance().wait();
+        Pool* pool = mpool;
+        std::set<std::string> solvables;
+        Id id;
+        FOR_POOL_SOLVABLES(id)
+        {
+            solvables.insert(pool_solvable2str(pool, pool_id2solvable(pool, id)));
+        }
+        EXPECT_EQ(solvables, std::set<std::string>({ "a-1.0-0", "b-1.0-0", "c-1.0-0" }));
+
+        // the same closure keeps the repodata, and the .solv cache, as they are
+        std::string solv_fn = subdirs[0]->subdir_data()->cache_path();
+        EXPECT_TRUE(ends_with(solv_fn, ".shards.solv"));
+
+        // a shard that does not match its hash is rejected
+        fs::path cached_shard = subdirs[1]->shard_path(subdirs[1]->shard_hash("c"));
+        fs::remove(cached_shard);
+        fs::path source = tmp_dir.path() / "channel" / "noarch" / "shards"
+                          / cached_shard.filename();
+        std::ofstream(source, std::ios::app) << " ";
+        EXPECT_THROW(fetch_shard_closure(subdirs, { "c" }), std::runtime_error);
+        EXPECT_FALSE(fs::exists(cached_shard));
+#endif
+    }
+
+    TEST(shards, invalid_manifest_hash)
+    {
+#ifdef __linux__
+        TemporaryDirectory tmp_dir;
+        fs::path subdir_dir = tmp_dir.path() / "channel" / "linux-64";
+        fs::create_directories(subdir_dir);
+        std::string valid(64, 'a');
+        for (std::string hash : { std::string("../../../etc/x"), valid + "/..", valid + "A" })
+        {
+            nlohmann::json manifest = { { "shards", { { "a", valid }, { "b", hash } } } };
+            std::ofstream(subdir_dir / "repodata_shards.json") << manifest.dump();
+
+            // the channel is then loaded from its repodata.json
+            SubdirShards shards("channel/linux-64",
+                                "file://" + subdir_dir.string(),
+                                tmp_dir.path(),
+                                false);
+            shards.manifest().load();
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(shards.manifest().target());
+            multi_dl.download(true);
+            EXPECT_FALSE(shards.read_manifest());
+            EXPECT_TRUE(shards.shard_hash("a").empty());
+        }
+#endif
+    }
+
+    TEST(shards, missing_manifest)
+    {
+        TemporaryDirectory tmp_dir;
+        std::string url = "https://conda.anaconda.org/x/linux-64";
+        std::string manifest_url = url + "/repodata_shards.json";
+        std::string cache_fn = cache_fn_url(manifest_url);
+        fs::path state_fn
+            = tmp_dir.path() / (cache_fn.substr(0, cache_fn.size() - 4) + "state.json");
+
+        // a channel without sharded index is not asked for it again for a while
+        nlohmann::json state = { { "url", manifest_url },
+                                 { "missing", true },
+                                 { "last_checked", std::time(nullptr) } };
+        std::ofstream(state_fn) << state.dump();
+        {
+            SubdirShards shards("x/linux-64", url, tmp_dir.path(), false);
+            shards.manifest().load();
+            EXPECT_TRUE(shards.manifest().missing());
+            EXPECT_EQ(shards.manifest().target(), nullptr);
+            EXPECT_FALSE(shards.read_manifest());
+        }
+
+        state["last_checked"] = std::time(nullptr) - 2 * 24 * 3600;
+        std::ofstream(state_fn) << state.dump();
+        {
+            SubdirShards shards("x/linux-64", url, tmp_dir.path(), false);
+            shards.manifest().load();
+            EXPECT_FALSE(shards.manifest().missing());
+            EXPECT_NE(shards.manifest().target(), nullptr);
+        }
+    }
+}  // namespace mamba
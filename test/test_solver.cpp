@@ -0,0 +1,250 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <fstream>
+#include <iterator>
+
+#include "mamba/api/install.hpp"
+#include "mamba/core/solver.hpp"
+#include "mamba/core/util.hpp"
+
+namespace mamba
+{
+    TEST(solver, solve_cache)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path json_fn = tmp_dir.path() / "repodata.json";
+        std::ofstream(json_fn) << R"({"info": {"subdir": "linux-64"}, "packages": {)"
+                               << R"("a-1.0-0.tar.bz2": {"name": "a", "version": "1.0",)"
+                               << R"( "build": "0", "build_number": 0, "depends": []},)"
+                               << R"("a-2.0-0.tar.bz2": {"name": "a", "version": "2.0",)"
+                               << R"( "build": "0", "build_number": 0, "depends": []},)"
+                               << R"("b-1.0-0.tar.bz2": {"name": "b", "version": "1.0",)"
+                               << R"( "build": "0", "build_number": 0, "depends": ["a <2"]}}})";
+        RepoMetadata meta{ "file://" + json_fn.string(), false, "etag", "", "" };
+
+        auto solve = [&](const std::vector<std::string>& specs, bool& from_cache) {
+            MPool pool;
+            MRepo repo(pool, "test", json_fn, meta);
+            MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+            solver.set_solve_cache(tmp_dir.path(), { &repo });
+            solver.add_jobs(specs, SOLVER_INSTALL);
+            EXPECT_TRUE(solver.solve());
+            from_cache = solver.from_cache();
+
+            Transaction* trans = solver.create_transaction();
+            transaction_order(trans, 0);
+            std::vector<std::string> steps;
+            for (int i = 0; i < trans->steps.count; ++i)
+            {
+                steps.push_back(pool_solvid2str(pool, trans->steps.elements[i]));
+            }
+            transaction_free(trans);
+            return steps;
+        };
+
+        // results of older problems, beyond what is kept
+        fs::create_directories(tmp_dir.path() / "solves");
+        for (int i = 0; i < 300; ++i)
+        {
+            fs::path old_fn = tmp_dir.path() / "solves" / ("old-" + std::to_string(i) + ".json");
+            std::ofstream(old_fn) << "{}";
+            fs::last_write_time(old_fn,
+                                fs::file_time_type::clock::now() - std::chrono::hours(300 - i));
+        }
+
+        bool from_cache = true;
+        auto steps = solve({ "b" }, from_cache);
+        EXPECT_FALSE(from_cache);
+        EXPECT_EQ(steps.size(), 2);
+        // the least recently used ones are removed
+        EXPECT_EQ(std::distance(fs::directory_iterator(tmp_dir.path() / "solves"),
+                                fs::directory_iterator()),
+                  256);
+        EXPECT_FALSE(fs::exists(tmp_dir.path() / "solves" / "old-44.json"));
+        EXPECT_TRUE(fs::exists(tmp_dir.path() / "solves" / "old-45.json"));
+
+        // the same problem is replayed, with the same transaction
+        EXPECT_EQ(solve({ "b" }, from_cache), steps);
+        EXPECT_TRUE(from_cache);
+
+        // another one is solved
+        solve({ "a" }, from_cache);
+        EXPECT_FALSE(from_cache);
+
+        // as is the same one with other repodata
+        meta.etag = "other";
+        EXPECT_EQ(solve({ "b" }, from_cache), steps);
+        EXPECT_FALSE(from_cache);
+        SolvWriter::instance().wait();
+    }
+
+    TEST(solver, prune_unreachable)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path json_fn = tmp_dir.path() / "repodata.json";
+        std::ofstream(json_fn) << R"({"info": {"subdir": "linux-64"}, "packages": {)"
+                               << R"("a-1.0-0.tar.bz2": {"name": "a", "version": "1.0",)"
+                               << R"( "build": "0", "build_number": 0, "depends": []},)"
+                               << R"("a-2.0-0.tar.bz2": {"name": "a", "version": "2.0",)"
+                               << R"( "build": "0", "build_number": 0, "depends": []},)"
+                               << R"("b-1.0-0.tar.bz2": {"name": "b", "version": "1.0",)"
+                               << R"( "build": "0", "build_number": 0, "depends": ["a <2"]},)"
+                               << R"("c-1.0-0.tar.bz2": {"name": "c", "version": "1.0",)"
+                               << R"( "build": "0", "build_number": 0, "depends": []},)"
+                               << R"("d-1.0-0.tar.bz2": {"name": "d", "version": "1.0",)"
+                               << R"( "build": "0", "build_number": 0, "depends": ["c"]}}})";
+        RepoMetadata meta{ "file://" + json_fn.string(), false, "etag", "", "" };
+
+        auto solve = [&](bool prune, std::size_t& pruned) {
+            MPool pool;
+            MRepo repo(pool, "test", json_fn, meta);
+            MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+            solver.prune_unreachable = prune;
+            solver.add_jobs({ "b" }, SOLVER_INSTALL);
+            EXPECT_TRUE(solver.solve());
+            pruned = solver.pruned_solvables();
+
+            Transaction* trans = solver.create_transaction();
+            transaction_order(trans, 0);
+            std::vector<std::string> steps;
+            for (int i = 0; i < trans->steps.count; ++i)
+            {
+                steps.push_back(pool_solvid2str(pool, trans->steps.elements[i]));
+            }
+            transaction_free(trans);
+            return steps;
+        };
+
+        std::size_t pruned = 0;
+        auto steps = solve(false, pruned);
+        EXPECT_EQ(pruned, 0);
+        EXPECT_EQ(solve(true, pruned), steps);
+        // c and d, the other version of a can replace the one b needs
+        EXPECT_EQ(pruned, 2);
+        SolvWriter::instance().wait();
+    }
+
+    TEST(solver, solve_stats)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path json_fn = tmp_dir.path() / "repodata.json";
+        std::ofstream(json_fn) << R"({"info": {"subdir": "linux-64"}, "packages": {)"
+                               << R"("a-1.0-0.tar.bz2": {"name": "a", "version": "1.0",)"
+                               << R"( "build": "0", "build_number": 0, "depends": []},)"
+                               << R"("a-2.0-0.tar.bz2": {"name": "a", "version": "2.0",)"
+                               << R"( "build": "0", "build_number": 0, "depends": []},)"
+                               << R"("b-1.0-0.tar.bz2": {"name": "b", "version": "1.0",)"
+                               << R"( "build": "0", "build_number": 0, "depends": ["a <2"]}}})";
+        RepoMetadata meta{ "file://" + json_fn.string(), false, "etag", "", "" };
+
+        {
+            MPool pool;
+            MRepo repo(pool, "test", json_fn, meta);
+            MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+            solver.add_jobs({ "b" }, SOLVER_INSTALL);
+            solver.add_jobs({ "c" }, SOLVER_ERASE);
+            EXPECT_TRUE(solver.solve());
+
+            const SolveStats& stats = solver.stats();
+            EXPECT_EQ(stats.pool_size, 3);
+            EXPECT_EQ(stats.repo_sizes.at(repo.repo()->name), 3);
+            EXPECT_EQ(stats.jobs.at("install"), 1);
+            EXPECT_EQ(stats.jobs.at("erase"), 1);
+            EXPECT_GT(stats.rules, 0);
+            EXPECT_GT(stats.decisions, 0);
+            EXPECT_EQ(stats.problems, 0);
+            EXPECT_FALSE(stats.from_cache);
+            EXPECT_GE(stats.solve_ms, stats.rule_creation_ms);
+            EXPECT_GE(stats.createwhatprovides_ms, 0);
+
+            nlohmann::json j = stats.to_json();
+            EXPECT_EQ(j["repo_sizes"][repo.repo()->name], 3);
+            EXPECT_EQ(j["jobs"]["install"], 1);
+        }
+
+        {
+            MPool pool;
+            MRepo repo(pool, "test", json_fn, meta);
+            MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+            solver.add_jobs({ "b", "a >=2" }, SOLVER_INSTALL);
+            EXPECT_FALSE(solver.solve());
+            EXPECT_GT(solver.stats().problems, 0);
+            EXPECT_EQ(solver.stats().jobs.at("install"), 2);
+        }
+        SolvWriter::instance().wait();
+    }
+
+    TEST(solver, portfolio)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path high_fn = tmp_dir.path() / "high.json";
+        fs::path low_fn = tmp_dir.path() / "low.json";
+        std::ofstream(high_fn) << R"({"info": {"subdir": "linux-64"}, "packages": {)"
+                               << R"("a-1.0-0.tar.bz2": {"name": "a", "version": "1.0",)"
+                               << R"( "build": "0", "build_number": 0, "depends": []}}})";
+        std::ofstream(low_fn) << R"({"info": {"subdir": "linux-64"}, "packages": {)"
+                              << R"("a-2.0-0.tar.bz2": {"name": "a", "version": "2.0",)"
+                              << R"( "build": "0", "build_number": 0, "depends": []}}})";
+
+        MPool pool;
+        MRepo high(pool, "high", high_fn, { "file://" + high_fn.string(), false, "", "", "" });
+        MRepo low(pool, "low", low_fn, { "file://" + low_fn.string(), false, "", "", "" });
+        high.set_priority(1, 0);
+        low.set_priority(0, 0);
+
+        auto flags = [](bool strict) {
+            return std::vector<std::pair<int, int>>{ { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 },
+                                                     { SOLVER_FLAG_STRICT_REPO_PRIORITY,
+                                                       strict } };
+        };
+        auto setup = [](MSolver& s) { s.add_jobs({ "a >=2" }, SOLVER_INSTALL); };
+
+        MSolver solver(pool, flags(true));
+        setup(solver);
+        nlohmann::json solution;
+        std::string winner;
+        {
+            SolvePortfolio portfolio({ &high, &low });
+            portfolio.add("strict", flags(true), setup);
+            portfolio.add("flexible", flags(false), setup);
+            portfolio.add("flexible_too", flags(false), setup);
+            // only the lower priority channel has a 2.0
+            EXPECT_FALSE(solver.solve());
+            winner = portfolio.wait(solution);
+        }
+        EXPECT_EQ(winner, "flexible");
+
+        // the solution of the copy is the one of the pool
+        EXPECT_TRUE(solver.replay_solution(solution));
+        EXPECT_TRUE(solver.is_solved());
+        Transaction* trans = solver.create_transaction();
+        ASSERT_EQ(trans->steps.count, 1);
+        EXPECT_EQ(std::string(pool_solvid2str(pool, trans->steps.elements[0])), "a-2.0-0");
+        transaction_free(trans);
+
+        // none succeeds
+        SolvePortfolio failing({ &high, &low });
+        failing.add("strict", flags(true), setup);
+        EXPECT_EQ(failing.wait(solution), "");
+        SolvWriter::instance().wait();
+    }
+
+    TEST(solver, portfolio_strategies)
+    {
+        auto strategies = detail::portfolio_strategies(
+            { "unfrozen", "flexible", "unknown", "allow_uninstall", "relaxed", "flexible" },
+            true,
+            false);
+        // unfrozen is the configured solve, flexible is there once
+        ASSERT_EQ(strategies.size(), 3);
+        EXPECT_EQ(strategies[0].name, "flexible");
+        EXPECT_FALSE(strategies[0].strict_priority);
+        EXPECT_EQ(strategies[1].name, "allow_uninstall");
+        EXPECT_TRUE(strategies[1].strict_priority);
+        EXPECT_TRUE(strategies[1].allow_uninstall);
+        EXPECT_EQ(strategies[2].name, "relaxed");
+
+        EXPECT_TRUE(detail::portfolio_strategies({}, true, true).empty());
+    }
+}  // namespace mamba
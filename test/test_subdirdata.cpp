@@ -0,0 +1,255 @@
+#include <gtest/gtest.h>
+
+#include <zstd.h>
+
+#include "mamba/core/subdirdata.hpp"
+#include "mamba/core/util.hpp"
+#include "mamba/core/validate.hpp"
+
+namespace mamba
+{
+    TEST(subdirdata, repodata_state_sidecar)
+    {
+#ifdef __linux__
+        TemporaryDirectory tmp_dir;
+        fs::path source = tmp_dir.path() / "repodata.json";
+        std::string repodata = R"({"info": {"subdir": "noarch"}, "packages": {}})";
+        std::ofstream(source) << repodata;
+        fs::path cache_fn = tmp_dir.path() / "cache.json";
+
+        MultiDownloadTarget multi_dl;
+        MSubdirData sd("local/noarch", "file://" + source.string(), cache_fn.string(), true);
+        sd.load();
+        multi_dl.add(sd.target());
+        EXPECT_TRUE(multi_dl.download(true));
+        EXPECT_TRUE(sd.loaded());
+
+        // the repodata is stored as downloaded, its metadata next to it
+        std::ifstream cache_file(cache_fn);
+        std::string cached((std::istreambuf_iterator<char>(cache_file)),
+                           std::istreambuf_iterator<char>());
+        EXPECT_EQ(cached, repodata);
+        std::ifstream state_file(tmp_dir.path() / "cache.state.json");
+        nlohmann::json state;
+        state_file >> state;
+        EXPECT_EQ(state["url"], "file://" + source.string());
+        EXPECT_EQ(state["size"], repodata.size());
+#endif
+    }
+
+    TEST(subdirdata, repodata_zst)
+    {
+#ifdef __linux__
+        TemporaryDirectory tmp_dir;
+        fs::path source = tmp_dir.path() / "repodata.json";
+        std::string repodata = R"({"info": {"subdir": "noarch"}, "packages": {}})";
+        std::ofstream(source) << repodata;
+        std::string compressed(ZSTD_compressBound(repodata.size()), '\0');
+        compressed.resize(ZSTD_compress(
+            compressed.data(), compressed.size(), repodata.data(), repodata.size(), 3));
+        std::ofstream(source.string() + ".zst", std::ios::binary) << compressed;
+
+        auto download = [&](const std::string& cache_name) {
+            fs::path cache_fn = tmp_dir.path() / (cache_name + ".json");
+            MultiDownloadTarget multi_dl;
+            MSubdirData sd("local/noarch", "file://" + source.string(), cache_fn.string(), true);
+            sd.load();
+            multi_dl.add(sd.target());
+            EXPECT_TRUE(multi_dl.download(true));
+            EXPECT_TRUE(sd.loaded());
+            std::ifstream cache_file(cache_fn);
+            return std::string((std::istreambuf_iterator<char>(cache_file)),
+                               std::istreambuf_iterator<char>());
+        };
+
+        EXPECT_EQ(download("zst"), repodata);
+        std::ifstream state_file(tmp_dir.path() / "zst.state.json");
+        nlohmann::json state;
+        state_file >> state;
+        EXPECT_TRUE(state["has_zst"]["value"].get<bool>());
+
+        // falls back to repodata.json
+        fs::remove(source.string() + ".zst");
+        EXPECT_EQ(download("json"), repodata);
+#endif
+    }
+
+    TEST(subdirdata, repodata_old_cache_format)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path cache_fn = tmp_dir.path() / "cache.json";
+        std::ofstream(cache_fn) << R"({"_url": "https://conda.anaconda.org/x/noarch/repodata.json",)"
+                                << R"( "_etag": "\"abc\"", "_mod": "", "_cache_control": "",)"
+                                << R"( "packages": {}})";
+
+        auto& ctx = Context::instance();
+        bool offline = ctx.offline;
+        ctx.offline = true;
+        MSubdirData sd("x/noarch",
+                       "https://conda.anaconda.org/x/noarch/repodata.json",
+                       cache_fn.string(),
+                       true);
+        sd.load();
+        ctx.offline = offline;
+
+        EXPECT_TRUE(sd.loaded());
+        EXPECT_EQ(sd.cache_path(), cache_fn.string());
+    }
+
+    TEST(subdirdata, repodata_stale_while_revalidate)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path cache_fn = tmp_dir.path() / "cache.json";
+        // nothing listens there, revalidating fails
+        std::string url = "http://127.0.0.1:1/x/noarch/repodata.json";
+        std::string repodata = R"({"packages": {}})";
+        std::ofstream(cache_fn) << repodata;
+        nlohmann::json state = { { "url", url }, { "etag", "\"abc\"" }, { "mod", "" } };
+        state["size"] = repodata.size();
+        std::ofstream(tmp_dir.path() / "cache.state.json") << state.dump();
+        fs::last_write_time(cache_fn,
+                            fs::file_time_type::clock::now() - std::chrono::seconds(120));
+
+        auto& ctx = Context::instance();
+        std::size_t ttl = ctx.local_repodata_ttl;
+        int max_retries = ctx.max_retries;
+        bool use_zst = ctx.repodata_use_zst;
+        ctx.local_repodata_ttl = 60;
+        ctx.max_retries = 0;
+        ctx.repodata_use_zst = false;
+
+        auto load = [&]() {
+            auto sd = std::make_shared<MSubdirData>("x/noarch", url, cache_fn.string(), true);
+            sd->load();
+            return sd;
+        };
+
+        auto expired = load();
+        EXPECT_FALSE(expired->loaded());
+        EXPECT_NE(expired->target(), nullptr);
+
+        ctx.repodata_max_stale = 3600;
+        auto stale = load();
+        EXPECT_TRUE(stale->loaded());
+        EXPECT_TRUE(stale->stale());
+        EXPECT_EQ(stale->target(), nullptr);
+        {
+            RepodataRefresher refresher(tmp_dir.path(), { stale });
+            EXPECT_EQ(refresher.size(), 1);
+        }
+        // the failed revalidation left the cache as it was
+        EXPECT_EQ(stale->cache_path(), cache_fn.string());
+        EXPECT_TRUE(fs::exists(cache_fn));
+
+        ctx.channel_repodata_max_stale["x"] = 0;
+        EXPECT_FALSE(load()->loaded());
+
+        ctx.repodata_max_stale = 0;
+        ctx.channel_repodata_max_stale.clear();
+        ctx.local_repodata_ttl = ttl;
+        ctx.max_retries = max_retries;
+        ctx.repodata_use_zst = use_zst;
+    }
+
+    TEST(subdirdata, shared_index_cache)
+    {
+        TemporaryDirectory tmp_dir;
+        std::string url = "https://conda.anaconda.org/x/noarch/repodata.json";
+        std::string cache_name = cache_fn_url(url);
+        std::string stem = cache_name.substr(0, cache_name.size() - 5);
+        fs::path shared_dir = tmp_dir.path() / "shared";
+        fs::path own_dir = tmp_dir.path() / "own";
+        fs::create_directories(shared_dir);
+        fs::create_directories(own_dir);
+
+        std::string repodata = R"({"info": {"subdir": "noarch"}, "packages": {)"
+                               R"("a-1.0-0.tar.bz2": {"name": "a", "version": "1.0",)"
+                               R"( "build": "0", "build_number": 0, "depends": []}}})";
+        std::ofstream(shared_dir / cache_name) << repodata;
+        nlohmann::json state = { { "url", url }, { "etag", "\"abc\"" }, { "mod", "" } };
+        state["size"] = repodata.size();
+        state["sha256"] = validate::sha256sum((shared_dir / cache_name).string());
+        std::ofstream(shared_dir / (stem + ".state.json")) << state.dump();
+
+        auto& ctx = Context::instance();
+        bool offline = ctx.offline;
+        ctx.offline = true;
+        auto load = [&](const fs::path& cache_dir) {
+            auto sd = std::make_shared<MSubdirData>(
+                "x/noarch", url, (cache_dir / cache_name).string(), true);
+            sd->load();
+            return sd;
+        };
+
+        // the shared cache gets its .solv
+        MPool shared_pool;
+        load(shared_dir)->create_repo(shared_pool);
+        SolvWriter::instance().wait();
+        EXPECT_TRUE(fs::exists(shared_dir / (stem + ".solv")));
+
+        ctx.shared_index_caches = { shared_dir };
+        auto sd = load(own_dir);
+        ctx.offline = offline;
+
+        // the repodata is copied, the .solv of the same content is used where it is
+        EXPECT_TRUE(sd->loaded());
+        EXPECT_TRUE(fs::exists(own_dir / cache_name));
+        EXPECT_EQ(sd->repo_metadata().sha256, state["sha256"]);
+        EXPECT_TRUE(sd->stage_repo());
+        MPool mpool;
+        MRepo repo = sd->create_repo(mpool);
+        EXPECT_EQ(repo.size(), 1);
+        EXPECT_FALSE(fs::exists(own_dir / (stem + ".solv")));
+
+        // a repodata that is not what its state tells is not used
+        fs::path other_dir = tmp_dir.path() / "other";
+        fs::create_directories(other_dir);
+        state["sha256"] = std::string(64, '0');
+        std::ofstream(shared_dir / (stem + ".state.json")) << state.dump();
+        ctx.offline = true;
+        EXPECT_FALSE(load(other_dir)->loaded());
+        EXPECT_FALSE(fs::exists(other_dir / cache_name));
+        ctx.offline = offline;
+        ctx.shared_index_caches.clear();
+    }
+
+    TEST(subdirdata, repodata_patches)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path repodata_fn = tmp_dir.path() / "repodata.json";
+        fs::path patch_log_fn = tmp_dir.path() / "repodata.jlap";
+        auto sha256 = [](const std::string& data) {
+            validate::Hasher hasher(validate::Hasher::Algorithm::sha256);
+            hasher.update(data.data(), data.size());
+            return hasher.hex_digest();
+        };
+
+        std::string v1 = R"({"packages":{"a-1.0-0.tar.bz2":{"version":"1.0"}}})";
+        std::string v2 = R"({"packages":{"a-1.0-0.tar.bz2":{"version":"1.0"},)"
+                         R"("a-2.0-0.tar.bz2":{"version":"2.0"}}})";
+        std::string v3 = R"({"packages":{"a-2.0-0.tar.bz2":{"version":"2.0"}}})";
+        std::ofstream(patch_log_fn)
+            << R"({"from": ")" << sha256(v1) << R"(", "to": ")" << sha256(v2) << R"(", "patch": )"
+            << R"([{"op": "add", "path": "/packages/a-2.0-0.tar.bz2", "value": {"version": "2.0"}}]})"
+            << "\n"
+            << R"({"from": ")" << sha256(v2) << R"(", "to": ")" << sha256(v3) << R"(", "patch": )"
+            << R"([{"op": "remove", "path": "/packages/a-1.0-0.tar.bz2"}]})"
+            << "\n"
+            << R"({"latest": ")" << sha256(v3) << R"("})"
+            << "\n";
+
+        std::ofstream(repodata_fn) << v1;
+        EXPECT_EQ(apply_repodata_patches(repodata_fn, patch_log_fn, sha256(v1)), sha256(v3));
+        std::ifstream repodata_file(repodata_fn);
+        std::string patched((std::istreambuf_iterator<char>(repodata_file)),
+                            std::istreambuf_iterator<char>());
+        EXPECT_EQ(patched, v3);
+        EXPECT_EQ(apply_repodata_patches(repodata_fn, patch_log_fn, sha256(v3)), sha256(v3));
+
+        // unknown version, or content that does not match its hash
+        std::ofstream(repodata_fn) << v1;
+        EXPECT_EQ(apply_repodata_patches(repodata_fn, patch_log_fn, sha256("{}")), "");
+        EXPECT_EQ(apply_repodata_patches(repodata_fn, patch_log_fn, sha256(v2)), "");
+        EXPECT_EQ(validate::sha256sum(repodata_fn.string()), sha256(v1));
+    }
+}  // namespace mamba
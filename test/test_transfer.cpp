@@ -1,5 +1,15 @@
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <thread>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
 #include "mamba/core/subdirdata.hpp"
 #include "mamba/core/util.hpp"
 
@@ -35,6 +45,589 @@ namespace mamba
             EXPECT_THROW(multi_dl.download(true), std::runtime_error);
         }
         Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, concurrent_transfer_sets)
+    {
+#ifdef __linux__
+        TemporaryDirectory tmp_dir;
+        auto& ctx = Context::instance();
+        int max_retries = ctx.max_retries;
+        ctx.max_retries = 0;
+
+        // a background refresh and the package downloads: both sets share
+        // DNS and TLS sessions, only the main thread's the connections
+        auto make_targets = [&](const std::string& prefix) {
+            std::vector<std::unique_ptr<DownloadTarget>> targets;
+            for (std::size_t i = 0; i < 8; ++i)
+            {
+                fs::path source = tmp_dir.path() / (prefix + std::to_string(i));
+                std::ofstream(source) << std::string(100000 + i, 'x');
+                targets.push_back(std::make_unique<DownloadTarget>(
+                    source.filename().string(),
+                    "file://" + source.string(),
+                    source.string() + ".out"));
+            }
+            // nothing listens there
+            targets.push_back(std::make_unique<DownloadTarget>(
+                prefix, "http://127.0.0.1:1/" + prefix, (tmp_dir.path() / prefix).string()));
+            targets.back()->set_ignore_failure(true);
+            return targets;
+        };
+        auto download = [](std::vector<std::unique_ptr<DownloadTarget>>& targets,
+                           bool share_connections) {
+            MultiDownloadTarget multi_dl(share_connections);
+            for (auto& target : targets)
+            {
+                multi_dl.add(target.get());
+            }
+            return multi_dl.download(false);
+        };
+
+        auto background_targets = make_targets("background");
+        auto main_targets = make_targets("main");
+        bool background_result = false;
+        std::thread background(
+            [&]() { background_result = download(background_targets, false); });
+        EXPECT_TRUE(download(main_targets, true));
+        background.join();
+        EXPECT_TRUE(background_result);
+
+        for (auto* targets : { &background_targets, &main_targets })
+        {
+            for (std::size_t i = 0; i < 8; ++i)
+            {
+                EXPECT_EQ((*targets)[i]->result, CURLE_OK);
+                EXPECT_EQ((*targets)[i]->downloaded_size, static_cast<curl_off_t>(100000 + i));
+            }
+            EXPECT_NE(targets->back()->result, CURLE_OK);
+        }
+        ctx.max_retries = max_retries;
+#endif
+    }
+
+    TEST(transfer, shared_session)
+    {
+        auto& session = DownloadSession::instance();
+        EXPECT_EQ(&session, &DownloadSession::instance());
+        CURLSH* share = session.share_handle(true);
+        CURLSH* share_no_connections = session.share_handle(false);
+        EXPECT_NE(share, nullptr);
+        EXPECT_NE(share_no_connections, nullptr);
+        EXPECT_NE(share, share_no_connections);
+
+#ifdef __linux__
+        TemporaryDirectory tmp_dir;
+        fs::path source = tmp_dir.path() / "source.tar.bz2";
+        std::ofstream(source) << std::string(1000, 'x');
+        std::string url = "file://" + source.string();
+
+        // the handles of short-lived targets come and go, the session outlives them
+        for (std::size_t i = 0; i < 4; ++i)
+        {
+            DownloadTarget target("source", url, (tmp_dir.path() / "dest").string());
+            EXPECT_TRUE(target.resource_exists());
+            DownloadTarget missing("missing", url + ".missing", (tmp_dir.path() / "x").string());
+            EXPECT_FALSE(missing.resource_exists());
+        }
+
+        for (bool share_connections : { true, false })
+        {
+            fs::path dest = tmp_dir.path() / ("dest-" + std::to_string(share_connections));
+            DownloadTarget target("source", url, dest.string());
+            MultiDownloadTarget multi_dl(share_connections);
+            multi_dl.add(&target);
+            EXPECT_TRUE(multi_dl.download(false));
+            EXPECT_EQ(target.result, CURLE_OK);
+            EXPECT_EQ(fs::file_size(dest), 1000u);
+        }
+#endif
+        EXPECT_EQ(session.share_handle(true), share);
+        EXPECT_EQ(session.share_handle(false), share_no_connections);
+    }
+
+    TEST(transfer, retry_on_throttling)
+    {
+        DownloadTarget target("name", "https://conda.anaconda.org:8080/x.json", "/tmp/x.json");
+        EXPECT_EQ(target.host(), "conda.anaconda.org:8080");
+        for (int status : { 429, 500, 503 })
+        {
+            target.http_status = status;
+            EXPECT_TRUE(target.can_retry());
+        }
+        for (int status : { 403, 404 })
+        {
+            target.http_status = status;
+            EXPECT_FALSE(target.can_retry());
+        }
+
+        auto header = [&](std::string line) {
+            DownloadTarget::header_callback(line.data(), 1, line.size(), &target);
+        };
+        target.http_status = 429;
+        header("Retry-After: 1\r\n");
+        EXPECT_EQ(target.retry_after(), 1u);
+        EXPECT_TRUE(target.can_retry());
+        // longer than we wait, and too large for an unsigned long: the wait is
+        // shortened and the transfer retried
+        std::size_t max_wait = Context::instance().max_retry_after;
+        header("Retry-After: 86400\r\n");
+        EXPECT_EQ(target.retry_after(), max_wait);
+        EXPECT_TRUE(target.can_retry());
+        EXPECT_NO_THROW(header("Retry-After: 99999999999999999999999\r\n"));
+        EXPECT_EQ(target.retry_after(), max_wait);
+        EXPECT_TRUE(target.can_retry());
+    }
+
+    TEST(transfer, header_callback)
+    {
+        DownloadTarget target("name", "https://conda.anaconda.org/x.json", "/tmp/x.json");
+        auto header = [&](std::string line) {
+            DownloadTarget::header_callback(line.data(), 1, line.size(), &target);
+        };
+
+        // the cache headers of a redirect hop are not kept
+        header("HTTP/1.1 301 Moved Permanently\r\n");
+        header("ETag: \"hop\"\r\n");
+        header("Last-Modified: Fri, 03 Apr 2020 03:29:49 GMT\r\n");
+        header("Cache-Control: max-age=10\r\n");
+        header("HTTP/2 200\r\n");
+        EXPECT_TRUE(target.etag.empty());
+        EXPECT_TRUE(target.mod.empty());
+        EXPECT_TRUE(target.cache_control.empty());
+
+        // HTTP/2 headers are lower case, and may not end with \r\n
+        header("etag: \"final\"\n");
+        header("last-modified:   Sat, 04 Apr 2020 03:29:49 GMT \n");
+        header("cache-control: public, max-age=1200");
+        EXPECT_EQ(target.etag, "\"final\"");
+        EXPECT_EQ(target.mod, "Sat, 04 Apr 2020 03:29:49 GMT");
+        EXPECT_EQ(target.cache_control, "public, max-age=1200");
+    }
+
+    TEST(transfer, mirror_failover)
+    {
+#ifdef __linux__
+        TemporaryDirectory tmp_dir;
+        fs::path source = tmp_dir.path() / "source.json";
+        std::ofstream(source) << "{}";
+
+        DownloadTarget target("source",
+                              "file:///nonexistent/source.json",
+                              (tmp_dir.path() / "dest.json").string());
+        target.set_mirrors({ "file://" + source.string() });
+
+        MultiDownloadTarget multi_dl;
+        multi_dl.add(&target);
+        EXPECT_TRUE(multi_dl.download(true));
+        EXPECT_EQ(target.result, CURLE_OK);
+        EXPECT_EQ(target.final_url, "file://" + source.string());
+        EXPECT_TRUE(fs::exists(tmp_dir.path() / "dest.json"));
+#endif
+    }
+
+    TEST(transfer, split_large_file)
+    {
+        TemporaryDirectory tmp_dir;
+        auto& ctx = Context::instance();
+        auto threshold = ctx.segmented_download_threshold;
+        ctx.segmented_download_threshold = 1000;
+
+        std::string dest = (tmp_dir.path() / "dest.tar.bz2").string();
+        DownloadTarget small("small", "https://conda.anaconda.org/x/small.tar.bz2", dest);
+        small.set_expected_size(999);
+        EXPECT_TRUE(small.split().empty());
+
+        DownloadTarget large("large", "https://conda.anaconda.org/x/large.tar.bz2", dest);
+        large.set_expected_size(1001);
+        auto segments = large.split();
+        ASSERT_EQ(segments.size(), std::size_t(ctx.download_segments));
+        for (auto* segment : segments)
+        {
+            EXPECT_EQ(segment->segment_parent(), &large);
+        }
+        // preallocated, written in place
+        EXPECT_EQ(fs::file_size(dest), 1001u);
+        EXPECT_TRUE(fs::exists(dest + MAMBA_SEGMENTS_STATE_SUFFIX));
+        EXPECT_TRUE(large.split().empty());
+
+        ctx.segmented_download_threshold = threshold;
+    }
+
+    TEST(transfer, split_resumes_partial_file)
+    {
+        TemporaryDirectory tmp_dir;
+        auto& ctx = Context::instance();
+        auto threshold = ctx.segmented_download_threshold;
+        auto count = ctx.download_segments;
+        ctx.segmented_download_threshold = 1000;
+        ctx.download_segments = 2;
+
+        std::string url = "https://conda.anaconda.org/x/large.tar.bz2";
+        std::string dest = (tmp_dir.path() / "large.tar.bz2").string();
+        nlohmann::json state;
+        state["url"] = url;
+        state["expected_size"] = 1001;
+
+        // what a single stream download left goes to the first segments
+        std::ofstream(dest, std::ios::binary) << std::string(700, 'x');
+        std::ofstream(dest + MAMBA_RESUME_STATE_SUFFIX) << state.dump();
+        std::size_t reported = 0;
+        {
+            DownloadTarget target("large", url, dest);
+            target.set_expected_size(1001);
+            target.set_resumable(true);
+            target.set_write_observer([&](std::size_t size) { reported = size; });
+            EXPECT_EQ(target.split().size(), 1u);
+            EXPECT_EQ(reported, 700u);
+            EXPECT_EQ(fs::file_size(dest), 1001u);
+            EXPECT_FALSE(fs::exists(dest + MAMBA_RESUME_STATE_SUFFIX));
+        }
+
+        // an interrupted segmented download continues where it stopped
+        state["segments"] = { { 0, 500, 100 }, { 501, 1000, 499 } };
+        std::ofstream(dest + MAMBA_SEGMENTS_STATE_SUFFIX) << state.dump();
+        {
+            DownloadTarget target("large", url, dest);
+            target.set_expected_size(1001);
+            target.set_write_observer([&](std::size_t size) { reported = size; });
+            EXPECT_EQ(target.split().size(), 2u);
+            EXPECT_EQ(reported, 100u);
+        }
+
+        ctx.segmented_download_threshold = threshold;
+        ctx.download_segments = count;
+    }
+
+#ifdef __linux__
+    // Serves a single file over HTTP/1.1 on localhost, with ranges and If-Range
+    // checked against its own etag, one connection at a time.
+    class range_server
+    {
+    public:
+        range_server(const std::string& content, const std::string& etag)
+            : m_content(content)
+            , m_etag(etag)
+        {
+            m_fd = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            bind(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+            socklen_t len = sizeof(addr);
+            getsockname(m_fd, reinterpret_cast<sockaddr*>(&addr), &len);
+            m_port = ntohs(addr.sin_port);
+            listen(m_fd, 16);
+            m_thread = std::thread([this]() { serve(); });
+        }
+
+        ~range_server()
+        {
+            m_stop = true;
+            m_thread.join();
+            close(m_fd);
+        }
+
+        std::string url(const std::string& path) const
+        {
+            return "http://127.0.0.1:" + std::to_string(m_port) + "/" + path;
+        }
+
+        std::atomic<int> full_responses{ 0 };
+        std::atomic<int> range_responses{ 0 };
+
+    private:
+        void serve()
+        {
+            while (!m_stop)
+            {
+                pollfd pfd = { m_fd, POLLIN, 0 };
+                if (poll(&pfd, 1, 50) <= 0)
+                {
+                    continue;
+                }
+                int conn = accept(m_fd, nullptr, nullptr);
+                if (conn >= 0)
+                {
+                    respond(conn);
+                    close(conn);
+                }
+            }
+        }
+
+        void respond(int conn)
+        {
+            std::string request;
+            char buffer[4096];
+            while (request.find("\r\n\r\n") == std::string::npos)
+            {
+                ssize_t n = recv(conn, buffer, sizeof(buffer), 0);
+                if (n <= 0)
+                {
+                    return;
+                }
+                request.append(buffer, std::size_t(n));
+            }
+
+            std::size_t begin = 0, end = m_content.size() - 1;
+            bool range = false;
+            bool if_range_matches = true;
+            std::istringstream lines(request);
+            std::string line;
+            while (std::getline(lines, line))
+            {
+                line = std::string(strip(line));
+                std::string lower = to_lower(line);
+                if (starts_with(lower, "range: bytes="))
+                {
+                    std::string spec = line.substr(std::strlen("range: bytes="));
+                    std::size_t dash = spec.find('-');
+                    begin = std::stoul(spec.substr(0, dash));
+                    if (dash + 1 < spec.size())
+                    {
+                        end = std::min(end, std::size_t(std::stoul(spec.substr(dash + 1))));
+                    }
+                    range = true;
+                }
+                else if (starts_with(lower, "if-range:"))
+                {
+                    if_range_matches = strip(line.substr(std::strlen("if-range:"))) == m_etag;
+                }
+            }
+
+            std::ostringstream response;
+            std::string body;
+            if (range && if_range_matches)
+            {
+                ++range_responses;
+                body = m_content.substr(begin, end - begin + 1);
+                response << "HTTP/1.1 206 Partial Content\r\n"
+                         << "Content-Range: bytes " << begin << "-" << end << "/"
+                         << m_content.size() << "\r\n";
+            }
+            else
+            {
+                ++full_responses;
+                body = m_content;
+                response << "HTTP/1.1 200 OK\r\n";
+            }
+            response << "ETag: " << m_etag << "\r\n"
+                     << "Content-Length: " << body.size() << "\r\n"
+                     << "Connection: close\r\n\r\n"
+                     << body;
+            std::string data = response.str();
+            for (std::size_t sent = 0; sent < data.size();)
+            {
+                ssize_t n = send(conn, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+                if (n <= 0)
+                {
+                    return;
+                }
+                sent += std::size_t(n);
+            }
+        }
+
+        std::string m_content, m_etag;
+        int m_fd = -1;
+        int m_port = 0;
+        std::atomic<bool> m_stop{ false };
+        std::thread m_thread;
+    };
+
+    TEST(transfer, http_version_fallback)
+    {
+        auto& ctx = Context::instance();
+        bool use_http2 = ctx.use_http2;
+        TemporaryDirectory tmp_dir;
+        std::string content(1000, 'x');
+        range_server server(content, "\"etag\"");
+
+        // HTTP/2 is only negotiated over TLS, and never with use_http2 off:
+        // both end up on HTTP/1.1 with a plain http:// server
+        for (bool http2 : { true, false })
+        {
+            ctx.use_http2 = http2;
+            fs::path dest = tmp_dir.path() / ("dest-" + std::to_string(http2));
+            DownloadTarget target("dest", server.url("x.tar.bz2"), dest.string());
+            EXPECT_TRUE(target.perform());
+            EXPECT_TRUE(target.finalize());
+            EXPECT_EQ(target.result, CURLE_OK);
+            EXPECT_EQ(target.http_status, 200);
+            long version = 0;
+            curl_easy_getinfo(target.handle(), CURLINFO_HTTP_VERSION, &version);
+            EXPECT_EQ(version, long(CURL_HTTP_VERSION_1_1));
+            EXPECT_EQ(fs::file_size(dest), content.size());
+        }
+        ctx.use_http2 = use_http2;
+    }
+
+    TEST(transfer, split_over_mirrors_with_different_etags)
+    {
+        TemporaryDirectory tmp_dir;
+        auto& ctx = Context::instance();
+        auto threshold = ctx.segmented_download_threshold;
+        auto count = ctx.download_segments;
+        ctx.segmented_download_threshold = 1000;
+        ctx.download_segments = 4;
+
+        std::string content(100000, 'x');
+        for (std::size_t i = 0; i < content.size(); ++i)
+        {
+            content[i] = char('a' + i % 26);
+        }
+        fs::path source = tmp_dir.path() / "source.tar.bz2";
+        std::ofstream(source, std::ios::binary) << content;
+
+        // the same file, with validators of their own
+        range_server first(content, "\"first\"");
+        range_server second(content, "\"second\"");
+        std::string url = first.url("large.tar.bz2");
+
+        // an interrupted download, whose validators came from the first mirror
+        fs::path dest = tmp_dir.path() / "large.tar.bz2";
+        std::string partial(content.size(), '\0');
+        nlohmann::json state;
+        state["url"] = url;
+        state["expected_size"] = content.size();
+        state["etag"] = "\"first\"";
+        state["mod"] = "";
+        state["validator_url"] = url;
+        state["segments"] = nlohmann::json::array();
+        for (std::size_t begin = 0; begin < content.size(); begin += 25000)
+        {
+            partial.replace(begin, 1000, content.substr(begin, 1000));
+            state["segments"].push_back({ begin, begin + 24999, 1000 });
+        }
+        std::ofstream(dest, std::ios::binary) << partial;
+        std::ofstream(dest.string() + MAMBA_SEGMENTS_STATE_SUFFIX) << state.dump();
+
+        DownloadTarget target("large", url, dest.string());
+        target.set_expected_size(content.size());
+        target.set_mirrors({ second.url("large.tar.bz2") });
+        target.compute_checksums(true, false);
+        MultiDownloadTarget multi_dl;
+        multi_dl.add(&target);
+        EXPECT_TRUE(multi_dl.download(true));
+
+        // each mirror got its segments as ranges, none was downloaded again whole
+        EXPECT_EQ(target.result, CURLE_OK);
+        EXPECT_EQ(first.full_responses, 0);
+        EXPECT_EQ(second.full_responses, 0);
+        EXPECT_GT(first.range_responses, 0);
+        EXPECT_GT(second.range_responses, 0);
+        std::ifstream result(dest, std::ios::binary);
+        std::string downloaded((std::istreambuf_iterator<char>(result)),
+                               std::istreambuf_iterator<char>());
+        EXPECT_EQ(downloaded, content);
+        EXPECT_EQ(target.sha256sum, validate::sha256sum(source));
+
+        ctx.segmented_download_threshold = threshold;
+        ctx.download_segments = count;
+    }
+#endif
+
+    TEST(transfer, resume_partial_file)
+    {
+#ifdef __linux__
+        TemporaryDirectory tmp_dir;
+        fs::path source = tmp_dir.path() / "source.tar.bz2";
+        fs::path dest = tmp_dir.path() / "dest.tar.bz2";
+        std::string content(100000, 'x');
+        for (std::size_t i = 0; i < content.size(); ++i)
+        {
+            content[i] = char('a' + i % 26);
+        }
+        std::ofstream(source, std::ios::binary) << content;
+        std::ofstream(dest, std::ios::binary) << content.substr(0, 40000);
+
+        std::string url = "file://" + source.string();
+        nlohmann::json state;
+        state["url"] = url;
+        state["expected_size"] = content.size();
+        std::ofstream(dest.string() + MAMBA_RESUME_STATE_SUFFIX) << state.dump();
+
+        DownloadTarget target("source", url, dest);
+        target.set_expected_size(content.size());
+        target.set_resumable(true);
+        target.compute_checksums(true, true);
+        EXPECT_TRUE(target.perform());
+        EXPECT_TRUE(target.finalize());
+
+        EXPECT_EQ(target.downloaded_size, curl_off_t(content.size()));
+        std::ifstream result(dest, std::ios::binary);
+        std::string downloaded((std::istreambuf_iterator<char>(result)),
+                               std::istreambuf_iterator<char>());
+        EXPECT_EQ(downloaded, content);
+        // checksums cover the bytes downloaded by the previous attempt as well
+        EXPECT_EQ(target.sha256sum, validate::sha256sum(source));
+        EXPECT_EQ(target.md5sum, validate::md5sum(source));
+        EXPECT_FALSE(fs::exists(dest.string() + MAMBA_RESUME_STATE_SUFFIX));
+#endif
+    }
+
+    TEST(transfer, retry_restarts_complete_file)
+    {
+        TemporaryDirectory tmp_dir;
+        fs::path dest = tmp_dir.path() / "dest.tar.bz2";
+        std::string url = "https://conda.anaconda.org/x/dest.tar.bz2";
+        DownloadTarget target("dest", url, dest);
+        target.set_expected_size(1000);
+        target.set_resumable(true);
+
+        // as left by an attempt that got more than expected
+        std::ofstream(dest, std::ios::binary) << std::string(1000, 'x');
+        nlohmann::json state;
+        state["url"] = url;
+        state["expected_size"] = 1000;
+        std::ofstream(dest.string() + MAMBA_RESUME_STATE_SUFFIX) << state.dump();
+
+        EXPECT_NE(target.retry(), nullptr);
+        EXPECT_FALSE(fs::exists(dest));
+    }
+
+    struct finish_recorder
+    {
+        bool finished()
+        {
+            order->push_back(name);
+            return true;
+        }
+
+        std::string name;
+        std::vector<std::string>* order;
+    };
+
+    TEST(transfer, priority_order)
+    {
+#ifdef __linux__
+        TemporaryDirectory tmp_dir;
+        auto max_parallel_downloads = Context::instance().max_parallel_downloads;
+        Context::instance().max_parallel_downloads = 1;
+
+        std::vector<std::string> order;
+        std::vector<std::unique_ptr<DownloadTarget>> targets;
+        std::vector<finish_recorder> recorders;
+        recorders.reserve(3);
+
+        MultiDownloadTarget multi_dl;
+        for (std::size_t priority : { 1, 3, 2 })
+        {
+            std::string name = "p" + std::to_string(priority);
+            fs::path source = tmp_dir.path() / name;
+            std::ofstream(source) << name;
+
+            recorders.push_back({ name, &order });
+            targets.push_back(std::make_unique<DownloadTarget>(
+                name, "file://" + source.string(), (tmp_dir.path() / (name + ".out")).string()));
+            targets.back()->set_priority(priority);
+            targets.back()->set_finalize_callback(&finish_recorder::finished, &recorders.back());
+            multi_dl.add(targets.back().get());
+        }
+        multi_dl.download(true);
+        Context::instance().max_parallel_downloads = max_parallel_downloads;
+
+        EXPECT_EQ(order, std::vector<std::string>({ "p3", "p2", "p1" }));
 #endif
     }
 }  // namespace mamba